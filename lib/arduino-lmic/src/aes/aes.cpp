@@ -46,10 +46,16 @@ void Aes::micB0(uint32_t devaddr, uint32_t seqno, uint8_t dndir, uint8_t len,
  */
 bool Aes::verifyMic(uint32_t devaddr, uint32_t seqno, uint8_t dndir,
                     uint8_t *pdu, uint8_t len) const {
+  return verifyMicWithKey(nwkSKey, devaddr, seqno, dndir, pdu, len);
+}
+
+bool Aes::verifyMicWithKey(const uint8_t key[16], uint32_t devaddr,
+                           uint32_t seqno, uint8_t dndir, uint8_t *pdu,
+                           uint8_t len) {
   uint8_t buf[AES_BLCK_SIZE];
   uint8_t lenWithoutMic = len - MIC_LEN;
   micB0(devaddr, seqno, dndir, lenWithoutMic, buf);
-  aes_cmac(pdu, lenWithoutMic, true, nwkSKey, buf);
+  aes_cmac(pdu, lenWithoutMic, true, key, buf);
   return std::equal(buf, buf + MIC_LEN, pdu + lenWithoutMic);
 }
 
@@ -102,7 +108,14 @@ void Aes::encrypt(uint8_t *pdu, uint8_t len) const {
 void Aes::framePayloadEncryption(uint8_t port, uint32_t devaddr, uint32_t seqno,
                                  uint8_t dndir, uint8_t *payload,
                                  uint8_t len) const {
-  auto key = port == 0 ? nwkSKey : appSKey;
+  framePayloadEncryptionWithKey(port == 0 ? nwkSKey : appSKey, devaddr,
+                                seqno, dndir, payload, len);
+}
+
+void Aes::framePayloadEncryptionWithKey(const uint8_t key[16],
+                                        uint32_t devaddr, uint32_t seqno,
+                                        uint8_t dndir, uint8_t *payload,
+                                        uint8_t len) {
   // Generate
   uint8_t blockAi[AES_BLCK_SIZE];
   blockAi[0] = 1; // mode=cipher
@@ -144,6 +157,38 @@ void Aes::sessKeys(uint16_t devnonce, const uint8_t *artnonce) {
   lmic_aes_encrypt(appSKey, AESDevKey);
 }
 
+// Remote multicast setup: the keys only need the AES encryption
+void Aes::multicastKeys(const uint8_t *mcKeyEnc, uint32_t addr, uint8_t *nwk,
+                        uint8_t *app) const {
+  // McRootKey then McKEKey
+  uint8_t key[16] = {};
+  lmic_aes_encrypt(key, AESDevKey);
+  uint8_t keKey[16] = {};
+  lmic_aes_encrypt(keKey, key);
+  // McKey
+  std::copy(mcKeyEnc, mcKeyEnc + 16, key);
+  lmic_aes_encrypt(key, keKey);
+
+  std::fill(app, app + 16, 0);
+  app[0] = 0x01;
+  wlsbf4(app + 1, addr);
+  std::copy(app, app + 16, nwk);
+  nwk[0] = 0x02;
+  lmic_aes_encrypt(app, key);
+  lmic_aes_encrypt(nwk, key);
+}
+
+// Random of the beacon period, encrypted with a key of zeros
+uint16_t Aes::pingOffset(uint32_t beaconTime, uint32_t devaddr,
+                         uint16_t period) {
+  uint8_t key[16] = {};
+  uint8_t rand[16] = {};
+  wlsbf4(rand, beaconTime);
+  wlsbf4(rand + 4, devaddr);
+  lmic_aes_encrypt(rand, key);
+  return rlsbf2(rand) % period;
+}
+
 // Shift the given buffer left one bit
 static void shift_left(uint8_t *buf, uint8_t len) {
   while (len--) {
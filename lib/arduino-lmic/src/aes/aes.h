@@ -33,12 +33,29 @@ public:
   void setApplicationSessionKey(uint8_t key[16]);
   bool verifyMic(uint32_t devaddr, uint32_t seqno, uint8_t dndir, uint8_t *pdu,
                  uint8_t len) const;
+  // with the network session key of a multicast group
+  static bool verifyMicWithKey(const uint8_t key[16], uint32_t devaddr,
+                               uint32_t seqno, uint8_t dndir, uint8_t *pdu,
+                               uint8_t len);
   bool verifyMic0(uint8_t *pdu, uint8_t len) const;
   void framePayloadEncryption(uint8_t port, uint32_t devaddr, uint32_t seqno,
                               uint8_t dndir, uint8_t *payload,
                               uint8_t len) const;
+  // with the application session key of a multicast group
+  static void framePayloadEncryptionWithKey(const uint8_t key[16],
+                                            uint32_t devaddr, uint32_t seqno,
+                                            uint8_t dndir, uint8_t *payload,
+                                            uint8_t len);
   void encrypt(uint8_t *pdu, uint8_t len) const;
   void sessKeys(uint16_t devnonce, const uint8_t *artnonce);
+  // session keys of the multicast group addr, from the McKey_encrypted of
+  // McGroupSetupReq and the device key
+  void multicastKeys(const uint8_t *mcKeyEnc, uint32_t addr, uint8_t *nwk,
+                     uint8_t *app) const;
+  // class B ping slot offset of devaddr in the beacon period of
+  // beaconTime, below period
+  static uint16_t pingOffset(uint32_t beaconTime, uint32_t devaddr,
+                             uint16_t period);
   void appendMic(uint32_t devaddr, uint32_t seqno, uint8_t dndir, uint8_t *pdu,
                  uint8_t len) const;
   void appendMic0(uint8_t *pdu, uint8_t len) const;
@@ -7,6 +7,7 @@
  *
  * This the HAL to run LMIC on top of the Arduino environment.
  *******************************************************************************/
+#if defined(ARDUINO)
 
 #include "hal.h"
 #include "../lmic.h"
@@ -28,7 +29,13 @@ static void hal_io_init() {
   // NSS and DIO0 are required, DIO1 is required for LoRa
   ASSERT(lmic_pins.nss != LMIC_UNUSED_PIN);
   ASSERT(lmic_pins.dio[0] != LMIC_UNUSED_PIN);
+#if defined(CFG_sx126x_radio)
+  // SX126x: all IRQs on DIO1 (dio[0]), BUSY is required
+  ASSERT(lmic_pins.busy != LMIC_UNUSED_PIN);
+  pinMode(lmic_pins.busy, INPUT);
+#else
   ASSERT(lmic_pins.dio[1] != LMIC_UNUSED_PIN);
+#endif
 
   pinMode(lmic_pins.nss, OUTPUT);
   if (lmic_pins.rxtx != LMIC_UNUSED_PIN)
@@ -62,6 +69,9 @@ void hal_pin_rst(uint8_t val) {
   }
 }
 
+// read radio BUSY pin
+uint8_t hal_pin_busy() { return digitalRead(lmic_pins.busy); }
+
 static bool dio_states[NUM_DIO] = {0};
 
 void hal_io_check() {
@@ -282,3 +292,5 @@ void hal_failed(const char *file, uint16_t line) {
   while (1)
     ;
 }
+
+#endif // defined(ARDUINO)
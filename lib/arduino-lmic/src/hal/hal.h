@@ -22,11 +22,23 @@ struct lmic_pinmap {
   uint8_t rxtx;
   uint8_t rst;
   uint8_t dio[NUM_DIO];
+  // SX126x only: BUSY pin, DIO1 is connected to dio[0]
+  uint8_t busy;
+  // SX127x only: power amplifier outputs wired to the antenna, LMIC_PA_*
+  // flags (0 is LMIC_PA_BOOST)
+  uint8_t pa;
 };
 
 // Use this for any unused pins.
 const uint8_t LMIC_UNUSED_PIN = 0xff;
 
+// Power amplifier outputs of the SX127x
+const uint8_t LMIC_PA_RFO = 0x01;
+const uint8_t LMIC_PA_BOOST = 0x02;
+// PA_BOOST, with the +20dBm mode allowed (the board supply delivers 120mA,
+// duty cycle at most 1%)
+const uint8_t LMIC_PA_BOOST_20DBM = 0x04;
+
 // Declared here, to be defined an initialized by the application
 extern const lmic_pinmap lmic_pins;
 
@@ -65,6 +77,11 @@ void hal_pin_rxtx(uint8_t val);
  */
 void hal_pin_rst(uint8_t val);
 
+/*
+ * read radio BUSY pin (SX126x only, 1=busy).
+ */
+uint8_t hal_pin_busy();
+
 /*
  * perform 8-bit SPI transaction with radio.
  *   - write given byte 'outval'
@@ -129,4 +146,20 @@ void hal_failed(const char *file, uint16_t line);
 
 void hal_store_trigger();
 
+/*
+ * staging area of the firmware updates, see FragReceiver. Defined by the
+ * application, only needed with FUOTA_MAX_FRAGS in config.h.
+ *   - read/write len bytes at offset, the HAL erases the flash as needed
+ *   - size returns the size of the area
+ */
+void hal_storage_read(uint32_t offset, uint8_t *buf, uint16_t len);
+void hal_storage_write(uint32_t offset, const uint8_t *buf, uint16_t len);
+uint32_t hal_storage_size();
+
+/*
+ * hand the verified image of length bytes at the start of the staging area
+ * over to the bootloader. Does not return if the device restarts.
+ */
+void hal_storage_install(uint32_t length);
+
 #endif // _hal_hal_h_
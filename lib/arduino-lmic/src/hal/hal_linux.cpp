@@ -0,0 +1,250 @@
+/*
+ * HAL to run LMIC on a Linux host with a virtual clock, against the SX126x
+ * emulator or the mock radio. Build the application with the .cpp files of
+ * lmic, aes and hal, CFG_sx126x_radio or CFG_mock_radio defined in config.h
+ * and ARDUINO undefined.
+ *
+ * The application sets up the LMIC as usual, queues downlinks with
+ * sx126xEmulator.queueDownlink() (or ends the operations of LMIC.radio
+ * itself with the mock) and advances time with hal_sim_run().
+ * Time only moves in hal_wait*, hal_add_time_in_sleep, hal_sim_run and
+ * while polling BUSY, so runs are deterministic. The native env of
+ * platformio.ini builds the tests of test/ this way.
+ */
+#include "../lmic.h"
+#include "hal.h"
+#include "sx126x_emu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(ARDUINO) &&                                                       \
+    (defined(CFG_sx126x_radio) || defined(CFG_mock_radio))
+
+// (initialized by init() with radio RSSI, used by rand1())
+uint8_t randbuf[16];
+
+static uint32_t simTicks = 0;
+static uint8_t irqlevel = 0;
+static bool is_sleep_allow = false;
+#if RADIO_CAPTURE_SIZE > 0
+static FILE *captureFile = nullptr;
+#endif
+#if FUOTA_MAX_FRAGS > 0
+static FILE *storageFile = nullptr;
+static uint32_t storageSize = 0;
+static uint32_t installedLength = 0;
+#endif
+
+// -----------------------------------------------------------------------------
+// I/O
+
+void hal_store_trigger() {}
+
+void hal_pin_rxtx(uint8_t val) {}
+
+#if defined(CFG_sx126x_radio)
+static bool dio1State = false;
+
+void hal_pin_rst(uint8_t val) {
+  if (val == 0) {
+    sx126xEmulator.reset();
+  }
+}
+
+void hal_pin_nss(uint8_t val) { sx126xEmulator.select(val == 0); }
+
+uint8_t hal_pin_busy() {
+  if (!sx126xEmulator.busy(hal_ticks())) {
+    return 0;
+  }
+  // polling takes time
+  simTicks++;
+  return 1;
+}
+
+uint8_t hal_spi(uint8_t out) { return sx126xEmulator.transfer(out); }
+
+void hal_io_check() {
+  OsTime now = hal_ticks();
+  sx126xEmulator.update(now);
+  bool level = sx126xEmulator.dio1();
+  if (level != dio1State) {
+    dio1State = level;
+    if (level)
+      LMIC.radio.irq_handler(0, now);
+  }
+}
+#else
+// no chip behind the mock radio
+void hal_pin_rst(uint8_t val) {}
+
+void hal_pin_nss(uint8_t val) {}
+
+uint8_t hal_pin_busy() { return 0; }
+
+uint8_t hal_spi(uint8_t out) { return 0; }
+
+void hal_io_check() {}
+#endif
+
+// -----------------------------------------------------------------------------
+// TIME
+
+bool hal_is_sleep_allow() { return is_sleep_allow; }
+
+void hal_allow_sleep() { is_sleep_allow = true; }
+
+void hal_forbid_sleep() { is_sleep_allow = false; }
+
+void hal_add_time_in_sleep(OsDeltaTime const &nb_tick) {
+  if (nb_tick > 0)
+    simTicks += nb_tick.tick();
+}
+
+OsTime hal_ticks() { return OsTime(simTicks); }
+
+void hal_waitUntil(OsTime const &time) { hal_wait(time - hal_ticks()); }
+
+void hal_wait(OsDeltaTime delta) {
+  if (delta > 0)
+    simTicks += delta.tick();
+}
+
+bool hal_checkTimer(OsTime const &time) {
+  return time - hal_ticks() <= OsDeltaTime(0);
+}
+
+void hal_disableIRQs() { irqlevel++; }
+
+void hal_enableIRQs() { irqlevel--; }
+
+// -----------------------------------------------------------------------------
+// CAPTURE
+
+#if RADIO_CAPTURE_SIZE > 0
+bool hal_sim_capture(const char *path) {
+  captureFile = fopen(path, "wb");
+  if (!captureFile) {
+    return false;
+  }
+  uint8_t header[PCAP_FILE_HEADER_LEN];
+  RadioCapture::fileHeader(header);
+  fwrite(header, 1, sizeof(header), captureFile);
+  return true;
+}
+
+static void drainCapture() {
+  if (!captureFile) {
+    return;
+  }
+  uint8_t buf[64];
+  uint16_t n;
+  while ((n = LMIC.radio.capture.read(buf, sizeof(buf))) > 0) {
+    fwrite(buf, 1, n, captureFile);
+  }
+  fflush(captureFile);
+}
+#else
+bool hal_sim_capture(const char *path) { return false; }
+
+static void drainCapture() {}
+#endif
+
+// -----------------------------------------------------------------------------
+// STORAGE
+
+#if FUOTA_MAX_FRAGS > 0
+bool hal_sim_storage(const char *path, uint32_t size) {
+  storageFile = fopen(path, "w+b");
+  storageSize = size;
+  installedLength = 0;
+  return storageFile != nullptr;
+}
+
+uint32_t hal_sim_installed() { return installedLength; }
+
+void hal_storage_read(uint32_t offset, uint8_t *buf, uint16_t len) {
+  size_t n = 0;
+  if (storageFile && fseek(storageFile, offset, SEEK_SET) == 0) {
+    n = fread(buf, 1, len, storageFile);
+  }
+  // never written, as erased flash
+  memset(buf + n, 0xFF, len - n);
+}
+
+void hal_storage_write(uint32_t offset, const uint8_t *buf, uint16_t len) {
+  if (!storageFile || offset + len > storageSize) {
+    hal_failed(__FILE__, __LINE__);
+  }
+  fseek(storageFile, offset, SEEK_SET);
+  fwrite(buf, 1, len, storageFile);
+  fflush(storageFile);
+}
+
+uint32_t hal_storage_size() { return storageSize; }
+
+void hal_storage_install(uint32_t length) { installedLength = length; }
+#else
+bool hal_sim_storage(const char *path, uint32_t size) { return false; }
+
+uint32_t hal_sim_installed() { return 0; }
+#endif
+
+// -----------------------------------------------------------------------------
+// RUN
+
+void hal_sim_run(OsTime const &until) {
+  while (hal_ticks() < until) {
+    OsDeltaTime delta = OSS.runloopOnce();
+    drainCapture();
+    OsTime next = hal_ticks() + delta;
+    if (next <= hal_ticks()) {
+      // more jobs to run
+      continue;
+    }
+#if defined(CFG_sx126x_radio)
+    OsTime event;
+    if (sx126xEmulator.nextEvent(event) && event < next) {
+      next = event;
+    }
+#endif
+    if (until < next) {
+      next = until;
+    }
+    if (next <= hal_ticks()) {
+      next = hal_ticks() + OsDeltaTime(1);
+    }
+    simTicks = next.tick();
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+void hal_init() {}
+
+void hal_init_random() { LMIC.radio.init_random(randbuf); }
+
+// return next random byte derived from seed buffer
+// (buf[0] holds index of next byte to be returned)
+uint8_t hal_rand1() {
+  uint8_t i = randbuf[0];
+
+  if (i == 16) {
+    LMIC.aes.encrypt(randbuf, 16); // encrypt seed with any key
+    i = 0;
+  }
+  uint8_t v = randbuf[i++];
+  randbuf[0] = i;
+  return v;
+}
+
+//! Get random number (default impl for uint16_t).
+uint16_t hal_rand2() { return ((uint16_t)((hal_rand1() << 8) | hal_rand1())); }
+
+void hal_failed(const char *file, uint16_t line) {
+  fprintf(stderr, "FAILURE %s:%u\n", file, line);
+  abort();
+}
+
+#endif // !defined(ARDUINO) && (CFG_sx126x_radio || CFG_mock_radio)
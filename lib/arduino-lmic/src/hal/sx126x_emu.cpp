@@ -0,0 +1,468 @@
+/*
+ * Command level emulator of the SX1261/SX1262, see sx126x_emu.h.
+ */
+#if !defined(ARDUINO)
+
+#include "sx126x_emu.h"
+#include "../lmic/sx126x.h"
+#include "hal.h"
+#include <string.h>
+
+// minimal part of the preamble needed to detect it
+#define DETECT_SYMS 4
+#define DETECT_FSK_BYTES 2
+#define PREAMBLE_SYMS 8
+#define PREAMBLE_FSK_BYTES 5
+#define FSK_BYTE_US 160
+
+#define WAKEUP_WARM_US 340
+#define WAKEUP_COLD_US 3500
+#define CALIBRATE_US 3500
+
+Sx126xEmulator sx126xEmulator;
+
+Sx126xEmulator::Sx126xEmulator() { reset(); }
+
+void Sx126xEmulator::reset() {
+  chipMode = STANDBY;
+  warmStart = false;
+  selected = false;
+  wakeTransaction = false;
+  cmdLength = 0;
+  memset(buffer, 0, sizeof(buffer));
+  memset(registers, 0, sizeof(registers));
+  // reset values used by the driver
+  registers[SX126X_REG_LORA_SYNC_WORD] = 0x14;
+  registers[SX126X_REG_LORA_SYNC_WORD + 1] = 0x24;
+  registers[SX126X_REG_IQ_POLARITY] = 0x0D;
+  packetType = SX126X_PACKET_TYPE_GFSK;
+  frf = 0;
+  memset(modulation, 0, sizeof(modulation));
+  memset(packet, 0, sizeof(packet));
+  memset(cadParams, 0, sizeof(cadParams));
+  txBase = 0;
+  rxBase = 0;
+  irqStatus = 0;
+  irqMask = 0;
+  dio1Mask = 0;
+  rxTimeout = 0;
+  stopTimerOnPreamble = false;
+  receiving = -1;
+  rxLength = 0;
+}
+
+uint8_t Sx126xEmulator::status() const {
+  switch (chipMode) {
+  case FS:
+    return SX126X_STATUS_MODE_FS;
+  case TX:
+    return SX126X_STATUS_MODE_TX;
+  case RX:
+  case CAD:
+    return SX126X_STATUS_MODE_RX;
+  default:
+    return SX126X_STATUS_MODE_STDBY_RC;
+  }
+}
+
+bool Sx126xEmulator::busy(OsTime const &now) const {
+  return chipMode == SLEEP || now < busyUntil;
+}
+
+bool Sx126xEmulator::dio1() const { return (irqStatus & dio1Mask) != 0; }
+
+void Sx126xEmulator::select(bool sel) {
+  OsTime now = hal_ticks();
+  if (sel) {
+    cmdLength = 0;
+    wakeTransaction = false;
+    if (chipMode == SLEEP) {
+      // falling NSS wakes the chip, the transaction itself is lost
+      bool warm = warmStart;
+      if (!warm) {
+        reset();
+      }
+      chipMode = STANDBY;
+      wakeTransaction = true;
+      busyUntil = now + OsDeltaTime::from_us(warm ? WAKEUP_WARM_US
+                                                  : WAKEUP_COLD_US);
+    } else if (busy(now)) {
+      // host did not wait for BUSY
+      errors++;
+      wakeTransaction = true;
+    }
+  } else if (selected && !wakeTransaction) {
+    execute();
+  }
+  selected = sel;
+}
+
+uint8_t Sx126xEmulator::transfer(uint8_t out) {
+  uint16_t pos = cmdLength;
+  if (cmdLength < sizeof(cmd)) {
+    cmd[cmdLength++] = out;
+  }
+  if (!selected || wakeTransaction || pos < 2) {
+    return status();
+  }
+  switch (cmd[0]) {
+  case SX126X_CMD_READ_REGISTER:
+    if (pos >= 4) {
+      uint16_t addr = (((cmd[1] << 8) | cmd[2]) + pos - 4) & 0xFFF;
+      if (addr >= SX126X_REG_RANDOM_NUMBER &&
+          addr < SX126X_REG_RANDOM_NUMBER + 4) {
+        random = random * 1103515245 + 12345;
+        return random >> 16;
+      }
+      return registers[addr];
+    }
+    break;
+  case SX126X_CMD_READ_BUFFER:
+    if (pos >= 3) {
+      return buffer[(uint8_t)(cmd[1] + pos - 3)];
+    }
+    break;
+  case SX126X_CMD_GET_IRQ_STATUS:
+    return pos == 2 ? irqStatus >> 8 : irqStatus & 0xFF;
+  case SX126X_CMD_GET_RX_BUFFER_STATUS:
+    return pos == 2 ? rxLength : rxBase;
+  case SX126X_CMD_GET_PACKET_STATUS:
+    if (packetType == SX126X_PACKET_TYPE_GFSK) {
+      return pos == 2 ? 0 : -pktRssi * 2;
+    }
+    return pos == 3 ? (uint8_t)pktSnr : -pktRssi * 2;
+  case SX126X_CMD_GET_RSSI_INST:
+    // noise floor -120dBm
+    return 240;
+  }
+  return status();
+}
+
+void Sx126xEmulator::execute() {
+  if (cmdLength == 0) {
+    return;
+  }
+  OsTime now = hal_ticks();
+  const uint8_t *p = cmd + 1;
+  uint16_t n = cmdLength - 1;
+  switch (cmd[0]) {
+  case SX126X_CMD_SET_SLEEP:
+    chipMode = SLEEP;
+    warmStart = (p[0] & SX126X_SLEEP_WARM_START) != 0;
+    break;
+  case SX126X_CMD_SET_STANDBY:
+    chipMode = STANDBY;
+    break;
+  case SX126X_CMD_SET_FS:
+    chipMode = FS;
+    break;
+  case SX126X_CMD_SET_TX: {
+    rps_t rps = currentRps();
+    uint8_t length =
+        packetType == SX126X_PACKET_TYPE_GFSK ? packet[6] : packet[3];
+    uint16_t preamble = packetType == SX126X_PACKET_TYPE_LORA
+                            ? (packet[0] << 8) | packet[1]
+                            : PREAMBLE_SYMS;
+    chipMode = TX;
+    opStart = now;
+    opEnd = now + airTime(rps, length, preamble);
+    uplink.start = now;
+    uplink.preamble = preamble;
+    uplink.freq = currentFreq();
+    uplink.rps = rps;
+    uplink.invertIQ = currentInvertIQ();
+    uplink.length = length;
+    for (uint16_t i = 0; i < length; i++) {
+      uplink.data[i] = buffer[(uint8_t)(txBase + i)];
+    }
+    break;
+  }
+  case SX126X_CMD_SET_RX:
+    chipMode = RX;
+    opStart = now;
+    rxTimeout = ((uint32_t)p[0] << 16) | (p[1] << 8) | p[2];
+    receiving = -1;
+    break;
+  case SX126X_CMD_SET_STOP_RX_TIMER_ON_PREAMBLE:
+    stopTimerOnPreamble = p[0] != 0;
+    break;
+  case SX126X_CMD_SET_CAD:
+    chipMode = CAD;
+    opStart = now;
+    // 1, 2, 4, 8 or 16 symbols
+    opEnd = now + (int16_t)(1 << cadParams[0]) * symbolTime(currentRps());
+    break;
+  case SX126X_CMD_CALIBRATE:
+  case SX126X_CMD_CALIBRATE_IMAGE:
+    busyUntil = now + OsDeltaTime::from_us(CALIBRATE_US);
+    break;
+  case SX126X_CMD_WRITE_REGISTER:
+    for (uint16_t i = 3; i < cmdLength; i++) {
+      registers[(((cmd[1] << 8) | cmd[2]) + i - 3) & 0xFFF] = cmd[i];
+    }
+    break;
+  case SX126X_CMD_WRITE_BUFFER:
+    for (uint16_t i = 2; i < cmdLength; i++) {
+      buffer[(uint8_t)(cmd[1] + i - 2)] = cmd[i];
+    }
+    break;
+  case SX126X_CMD_SET_DIO_IRQ_PARAMS:
+    irqMask = (p[0] << 8) | p[1];
+    dio1Mask = (p[2] << 8) | p[3];
+    break;
+  case SX126X_CMD_CLEAR_IRQ_STATUS:
+    irqStatus &= ~((p[0] << 8) | p[1]);
+    break;
+  case SX126X_CMD_SET_RF_FREQUENCY:
+    frf = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | (p[2] << 8) | p[3];
+    break;
+  case SX126X_CMD_SET_PACKET_TYPE:
+    // only allowed in standby
+    if (chipMode != STANDBY) {
+      errors++;
+    }
+    packetType = p[0];
+    break;
+  case SX126X_CMD_SET_MODULATION_PARAMS:
+    memcpy(modulation, p, n < sizeof(modulation) ? n : sizeof(modulation));
+    break;
+  case SX126X_CMD_SET_PACKET_PARAMS:
+    memcpy(packet, p, n < sizeof(packet) ? n : sizeof(packet));
+    break;
+  case SX126X_CMD_SET_CAD_PARAMS:
+    memcpy(cadParams, p, n < sizeof(cadParams) ? n : sizeof(cadParams));
+    break;
+  case SX126X_CMD_SET_BUFFER_BASE_ADDRESS:
+    txBase = p[0];
+    rxBase = p[1];
+    break;
+  case SX126X_CMD_SET_REGULATOR_MODE:
+  case SX126X_CMD_SET_PA_CONFIG:
+  case SX126X_CMD_SET_TX_PARAMS:
+  case SX126X_CMD_SET_DIO2_AS_RF_SWITCH_CTRL:
+  case SX126X_CMD_SET_DIO3_AS_TCXO_CTRL:
+  case SX126X_CMD_GET_STATUS:
+  case SX126X_CMD_GET_IRQ_STATUS:
+  case SX126X_CMD_GET_RX_BUFFER_STATUS:
+  case SX126X_CMD_GET_PACKET_STATUS:
+  case SX126X_CMD_READ_REGISTER:
+  case SX126X_CMD_READ_BUFFER:
+    break;
+  case SX126X_CMD_GET_RSSI_INST:
+    // meaningless outside of RX
+    if (chipMode != RX && chipMode != CAD) {
+      errors++;
+    }
+    break;
+  default:
+    // unknown command
+    errors++;
+    break;
+  }
+}
+
+rps_t Sx126xEmulator::currentRps() const {
+  rps_t rps;
+  rps.rawValue = 0;
+  if (packetType == SX126X_PACKET_TYPE_GFSK) {
+    rps.sf = FSK;
+    return rps;
+  }
+  rps.sf = modulation[0] - 6;
+  rps.bw = modulation[1] - 0x04;
+  rps.cr = modulation[2] - 1;
+  rps.ih = packet[2] ? packet[3] : 0;
+  rps.nocrc = packet[4] == 0;
+  return rps;
+}
+
+uint32_t Sx126xEmulator::currentFreq() const {
+  return ((uint64_t)frf * SX126X_FXTAL + (1 << 24)) >> 25;
+}
+
+bool Sx126xEmulator::currentInvertIQ() const {
+  return packetType == SX126X_PACKET_TYPE_LORA && packet[5] != 0;
+}
+
+OsDeltaTime Sx126xEmulator::symbolTime(rps_t rps) const {
+  if (rps.sf == FSK) {
+    return OsDeltaTime::from_us(FSK_BYTE_US);
+  }
+  // 2^sf / bw
+  return OsDeltaTime::from_us(((int64_t)1000 << (rps.sf + 6)) /
+                              (125 << rps.bw));
+}
+
+OsDeltaTime Sx126xEmulator::airTime(rps_t rps, uint8_t length,
+                                    uint16_t preamble) const {
+  OsDeltaTime time = calcAirTime(rps, length);
+  if (rps.sf != FSK && preamble > PREAMBLE_SYMS) {
+    time = time + (int16_t)(preamble - PREAMBLE_SYMS) * symbolTime(rps);
+  }
+  return time;
+}
+
+OsDeltaTime Sx126xEmulator::airTime(Frame const &frame) const {
+  return airTime(frame.rps, frame.length,
+                 frame.preamble ? frame.preamble : PREAMBLE_SYMS);
+}
+
+bool Sx126xEmulator::matches(Frame const &frame) const {
+  int32_t df = (int32_t)(frame.freq - currentFreq());
+  if (df > 100 || df < -100) {
+    return false;
+  }
+  rps_t rps = currentRps();
+  if (rps.sf == FSK || frame.rps.sf == FSK) {
+    return rps.sf == frame.rps.sf;
+  }
+  return sameSfBw(rps, frame.rps) && frame.invertIQ == currentInvertIQ();
+}
+
+void Sx126xEmulator::raise(uint16_t irq) { irqStatus |= irq & irqMask; }
+
+bool Sx126xEmulator::queueDownlink(Frame const &frame) {
+  for (uint8_t i = 0; i < QUEUE_SIZE; i++) {
+    if (!queued[i]) {
+      downlinks[i] = frame;
+      queued[i] = true;
+      return true;
+    }
+  }
+  return false;
+}
+
+// earliest time a queued frame gets locked by the open receiver
+int8_t Sx126xEmulator::detectable(OsTime &when) const {
+  rps_t rps = currentRps();
+  bool fsk = rps.sf == FSK;
+  OsDeltaTime sym = symbolTime(rps);
+  int8_t found = -1;
+  for (uint8_t i = 0; i < QUEUE_SIZE; i++) {
+    if (!queued[i] || !matches(downlinks[i])) {
+      continue;
+    }
+    Frame const &f = downlinks[i];
+    uint16_t preamble = f.preamble ? f.preamble : PREAMBLE_SYMS;
+    OsTime preambleEnd =
+        f.start + (int16_t)(fsk ? PREAMBLE_FSK_BYTES : preamble) * sym;
+    OsTime detect = f.start < opStart ? opStart : f.start;
+    detect += (int16_t)(fsk ? DETECT_FSK_BYTES : DETECT_SYMS) * sym;
+    if (detect > preambleEnd) {
+      // preamble mostly over before the receiver was open
+      continue;
+    }
+    // without stop on preamble the timer runs until the header
+    OsTime lock = stopTimerOnPreamble ? detect : preambleEnd;
+    if (rxTimeout != SX126X_RX_SINGLE && rxTimeout != SX126X_RX_CONTINUOUS &&
+        lock > windowEnd()) {
+      continue;
+    }
+    if (found < 0 || detect < when) {
+      found = i;
+      when = detect;
+    }
+  }
+  return found;
+}
+
+OsTime Sx126xEmulator::windowEnd() const {
+  return opStart + OsDeltaTime::from_us((int64_t)rxTimeout * 15625 / 1000);
+}
+
+void Sx126xEmulator::update(OsTime const &now) {
+  switch (chipMode) {
+  case TX:
+    if (now >= opEnd) {
+      chipMode = STANDBY;
+      uplinkEnd = opEnd;
+      uplinks++;
+      raise(SX126X_IRQ_TX_DONE);
+    }
+    break;
+  case CAD:
+    if (now >= opEnd) {
+      uint16_t irq = SX126X_IRQ_CAD_DONE;
+      for (uint8_t i = 0; i < QUEUE_SIZE; i++) {
+        Frame const &f = downlinks[i];
+        if (queued[i] && matches(f) && f.start <= opEnd &&
+            f.start + airTime(f) >= opStart) {
+          irq |= SX126X_IRQ_CAD_DETECTED;
+        }
+      }
+      chipMode = STANDBY;
+      raise(irq);
+    }
+    break;
+  case RX: {
+    OsTime detect;
+    if (receiving < 0) {
+      int8_t i = detectable(detect);
+      if (i >= 0 && detect <= now) {
+        receiving = i;
+      } else if (rxTimeout != SX126X_RX_SINGLE &&
+                 rxTimeout != SX126X_RX_CONTINUOUS && now >= windowEnd()) {
+        chipMode = STANDBY;
+        raise(SX126X_IRQ_TIMEOUT);
+      }
+    }
+    if (receiving >= 0) {
+      Frame const &f = downlinks[receiving];
+      if (now >= f.start + airTime(f)) {
+        for (uint16_t i = 0; i < f.length; i++) {
+          buffer[(uint8_t)(rxBase + i)] = f.data[i];
+        }
+        rxLength = f.length;
+        pktRssi = f.rssi;
+        pktSnr = f.snr;
+        queued[receiving] = false;
+        receiving = -1;
+        if (rxTimeout != SX126X_RX_CONTINUOUS) {
+          chipMode = STANDBY;
+        }
+        raise(SX126X_IRQ_RX_DONE | (f.crcError ? SX126X_IRQ_CRC_ERR : 0));
+      }
+    }
+    break;
+  }
+  default:
+    break;
+  }
+  // frames which are over can no longer be received
+  for (uint8_t i = 0; i < QUEUE_SIZE; i++) {
+    Frame const &f = downlinks[i];
+    if (queued[i] && i != receiving &&
+        now > f.start + airTime(f)) {
+      queued[i] = false;
+    }
+  }
+}
+
+bool Sx126xEmulator::nextEvent(OsTime &when) const {
+  switch (chipMode) {
+  case TX:
+  case CAD:
+    when = opEnd;
+    return true;
+  case RX: {
+    if (receiving >= 0) {
+      Frame const &f = downlinks[receiving];
+      when = f.start + airTime(f);
+      return true;
+    }
+    OsTime detect;
+    bool found = detectable(detect) >= 0;
+    if (rxTimeout != SX126X_RX_SINGLE && rxTimeout != SX126X_RX_CONTINUOUS &&
+        (!found || windowEnd() < detect)) {
+      detect = windowEnd();
+      found = true;
+    }
+    when = detect;
+    return found;
+  }
+  default:
+    return false;
+  }
+}
+
+#endif // !defined(ARDUINO)
@@ -0,0 +1,146 @@
+/*
+ * Command level emulator of the SX1261/SX1262, to run the LMIC on a host
+ * without a board (see hal_linux.cpp).
+ *
+ * The emulator decodes the SPI command stream, keeps the chip state (mode,
+ * buffer, registers, IRQ status, BUSY, DIO1) and plays the air interface:
+ * uplinks are logged, downlinks are queued by the host with their start
+ * time and delivered if the receiver is open on the right channel and data
+ * rate at that time. Commands sent while BUSY is high are counted as
+ * protocol errors.
+ */
+#ifndef _hal_sx126x_emu_h_
+#define _hal_sx126x_emu_h_
+
+#include "../lmic/lorabase.h"
+#include <stdint.h>
+
+class Sx126xEmulator {
+public:
+  enum { QUEUE_SIZE = 4 };
+  enum Mode { SLEEP, STANDBY, FS, TX, RX, CAD };
+
+  struct Frame {
+    OsTime start;
+    uint32_t freq;
+    rps_t rps;
+    bool invertIQ;
+    bool crcError;
+    int8_t rssi; // dBm
+    int8_t snr;  // dB * 4
+    uint8_t length;
+    uint8_t data[255];
+    uint16_t preamble; // LoRa symbols, 0 for the usual 8
+  };
+
+  Sx126xEmulator();
+
+  // chip side, driven by the HAL
+  void reset();
+  void select(bool selected);
+  uint8_t transfer(uint8_t out);
+  bool busy(OsTime const &now) const;
+  bool dio1() const;
+  // end operations which are over at now
+  void update(OsTime const &now);
+  // time of the next operation end, if any
+  bool nextEvent(OsTime &when) const;
+
+  // host side
+  // queue a downlink, starting at frame.start
+  bool queueDownlink(Frame const &frame);
+  // last frame sent, its frequency and end of transmission
+  Frame const &lastUplink() const { return uplink; };
+  OsTime const &lastUplinkEnd() const { return uplinkEnd; };
+  uint16_t uplinkCount() const { return uplinks; };
+  uint16_t protocolErrors() const { return errors; };
+  Mode mode() const { return chipMode; };
+
+private:
+  Mode chipMode = STANDBY;
+  bool warmStart = false;
+  bool selected = false;
+  bool wakeTransaction = false;
+  OsTime busyUntil;
+
+  uint8_t cmd[260];
+  uint16_t cmdLength = 0;
+
+  uint8_t buffer[256];
+  uint8_t registers[0x1000];
+  uint32_t random = 0x12345678;
+
+  uint8_t packetType = 0;
+  uint32_t frf = 0;
+  uint8_t modulation[8] = {};
+  uint8_t packet[9] = {};
+  uint8_t txBase = 0;
+  uint8_t rxBase = 0;
+  uint8_t cadParams[7] = {};
+
+  uint16_t irqStatus = 0;
+  uint16_t irqMask = 0;
+  uint16_t dio1Mask = 0;
+
+  OsTime opStart;
+  OsTime opEnd;
+  // rx timeout in steps of 15.625us, 0 = single, 0xFFFFFF = continuous
+  uint32_t rxTimeout = 0;
+  bool stopTimerOnPreamble = false;
+  // downlink being received
+  int8_t receiving = -1;
+
+  uint8_t rxLength = 0;
+  int8_t pktRssi = 0;
+  int8_t pktSnr = 0;
+
+  Frame downlinks[QUEUE_SIZE];
+  bool queued[QUEUE_SIZE] = {};
+
+  Frame uplink = {};
+  OsTime uplinkEnd;
+  uint16_t uplinks = 0;
+  uint16_t errors = 0;
+
+  uint8_t status() const;
+  void execute();
+  rps_t currentRps() const;
+  uint32_t currentFreq() const;
+  bool currentInvertIQ() const;
+  OsDeltaTime symbolTime(rps_t rps) const;
+  OsDeltaTime airTime(rps_t rps, uint8_t length, uint16_t preamble) const;
+  OsDeltaTime airTime(Frame const &frame) const;
+  bool matches(Frame const &frame) const;
+  int8_t detectable(OsTime &when) const;
+  OsTime windowEnd() const;
+  void raise(uint16_t irq);
+};
+
+extern Sx126xEmulator sx126xEmulator;
+
+/*
+ * run the LMIC on the emulator until the given time: jobs are run and the
+ * virtual clock is moved to the next job or radio event.
+ */
+void hal_sim_run(OsTime const &until);
+
+/*
+ * write the LoRa frames of LMIC.radio to a pcap file (LoRaTap link type),
+ * drained by hal_sim_run. Needs RADIO_CAPTURE_SIZE in config.h, false if
+ * capture is off or the file can't be created.
+ */
+bool hal_sim_capture(const char *path);
+
+/*
+ * back the staging area of hal_storage_* with a file of size bytes, created
+ * empty. Needs FUOTA_MAX_FRAGS in config.h, false if it is off or the file
+ * can't be created.
+ */
+bool hal_sim_storage(const char *path, uint32_t size);
+
+/*
+ * length given to hal_storage_install, 0 if not called
+ */
+uint32_t hal_sim_installed();
+
+#endif // _hal_sx126x_emu_h_
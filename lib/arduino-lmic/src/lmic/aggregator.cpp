@@ -0,0 +1,53 @@
+//! \file
+//! Records packed in the uplink payloads, see PayloadAggregator.
+#include "lmic.h"
+#include <string.h>
+
+#if TX_AGGREGATE_SIZE > 0
+
+bool PayloadAggregator::add(uint8_t source, const uint8_t *data,
+                            uint8_t len) {
+  uint8_t end = sealedLen + openLen;
+  if (TX_AGGREGATE_SIZE - end < 1 + len)
+    return false;
+  buffer[end] = (source << 5) | len;
+  memcpy(buffer + end + 1, data, len);
+  openLen += 1 + len;
+  return true;
+}
+
+uint8_t PayloadAggregator::seal(uint8_t maxLen) {
+  if (sealedLen != 0)
+    return 0;
+  // whole records only, the others wait for the next payload
+  uint8_t len = 0;
+  while (len < openLen) {
+    uint8_t next = len + 1 + (buffer[len] & AGG_LEN_MASK);
+    if (next > maxLen && len == 0) {
+      // added before the DR was lowered, it would block the others
+      openLen -= next;
+      memmove(buffer, buffer + next, openLen);
+      if (dropped < 0xFFFF)
+        dropped++;
+      continue;
+    }
+    if (next > maxLen)
+      break;
+    len = next;
+  }
+  sealedLen = len;
+  openLen -= len;
+  return len;
+}
+
+void PayloadAggregator::release() {
+  memmove(buffer, buffer + sealedLen, openLen);
+  sealedLen = 0;
+}
+
+void PayloadAggregator::clear() {
+  sealedLen = 0;
+  openLen = 0;
+}
+
+#endif // TX_AGGREGATE_SIZE > 0
@@ -25,6 +25,12 @@ void wlsbf2(uint8_t *buf, uint16_t v) {
   buf[1] = v >> 8;
 }
 
+void wlsbf3(uint8_t *buf, uint32_t v) {
+  buf[0] = v;
+  buf[1] = v >> 8;
+  buf[2] = v >> 16;
+}
+
 void wlsbf4(uint8_t *buf, uint32_t v) {
   buf[0] = v;
   buf[1] = v >> 8;
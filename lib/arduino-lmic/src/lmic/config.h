@@ -11,8 +11,18 @@
 // RFM92 boards.
 //#define CFG_sx1272_radio 1
 // This is the SX1276/SX1277/SX1278/SX1279 radio, which is also used on
-// the HopeRF RFM95 boards.
+// the HopeRF RFM95 boards. The default unless the build flags select
+// another one (see the native env of platformio.ini).
+#if !defined(CFG_sx1272_radio) && !defined(CFG_sx126x_radio) &&                \
+    !defined(CFG_mock_radio)
 #define CFG_sx1276_radio 1
+#endif
+// This is the SX1261/SX1262 radio (command interface, needs the BUSY
+// pin). See hal/hal_linux.cpp to run it against the host emulator.
+//#define CFG_sx126x_radio 1
+// No radio, the application ends the operations itself (RadioMock in
+// lmic/radio.h), for host tests and simulations.
+//#define CFG_mock_radio 1
 
 // 16 μs per tick
 // LMIC requires ticks to be 15.5μs - 100 μs long
@@ -54,6 +64,63 @@
 // example).
 //#define DISABLE_INVERT_IQ_ON_RX
 
+// The radio driver estimates the offset of its crystal from the frequency
+// error of received LoRa frames and corrects the channel frequencies with
+// it. Uncomment to only measure the offset, without correction.
+//#define DISABLE_FREQ_CORRECTION
+
+// Number of radio operations kept in the journal (RadioJournal in
+// lmic/radio.h), about 20 bytes of RAM each. Undefined to leave it out.
+//#define RADIO_JOURNAL_SIZE 16
+
+// Size of the buffer of captured frames in bytes (RadioCapture in
+// lmic/radio.h), each frame takes 31 bytes plus its length. The
+// application drains it in pcap format with LMIC.radio.capture.read().
+// Undefined to leave it out.
+//#define RADIO_CAPTURE_SIZE 512
+
+// Number of uplinks waiting in the queue of Lmic::queueTxData()
+// (UplinkQueue in lmic/lmic.h), about 16 bytes of RAM each. 0 to leave it
+// out, 4 if undefined.
+//#define UPLINK_QUEUE_SIZE 4
+
+// Size in bytes of the frame buffer (Lmic::frame), the longest frame sent
+// or received. Frames of the region above it are not used, 255 for all of
+// them. 64 if undefined.
+//#define FRAME_BUFFER_SIZE 255
+
+// Size in bytes of the buffer of Lmic::aggregateTxData() (PayloadAggregator
+// in lmic/lmic.h), twice the largest payload lets records come in while a
+// payload is sent. Needs the uplink queue. Undefined to leave it out.
+//#define TX_AGGREGATE_SIZE 102
+
+// Largest data in a fragment of Lmic::sendFragmented() (FragSession in
+// lmic/lmic.h), the session holds one fragment in RAM. Smaller if the DR
+// allows less. Undefined to leave it out.
+//#define UPLINK_FRAG_SIZE 46
+
+// Fragments of a file received on port 201 (FragReceiver in lmic/lmic.h),
+// rebuilt in the storage of the HAL (hal_storage_* in hal/hal.h). RAM takes
+// a bit per fragment, plus as much on the stack for each parity fragment.
+// Needs the uplink queue for the answers. Undefined to leave it out.
+//#define FUOTA_MAX_FRAGS 512
+// Fragments lost which the parity can recover, the storage needs room for
+// a row of the system per fragment lost after the file. 64 if undefined.
+//#define FUOTA_MAX_LOST 64
+
+// Multicast groups set up by the network on port 200 (McGroup in
+// lmic/lmic.h), 60 bytes of RAM each. Needs the uplink queue for the
+// answers. Up to 4, undefined to leave them out.
+//#define MC_GROUP_COUNT 2
+
+// Class C: continuous RX on the RX2 parameters between the uplinks, turned
+// on with Lmic::setClassC(). Undefined to leave it out.
+//#define ENABLE_CLASS_C 1
+
+// Class B: beacon tracking and ping slots, turned on with
+// Lmic::enableTracking() and Lmic::setPingable(). Undefined to leave it out.
+//#define ENABLE_CLASS_B 1
+
 #define CFG_noassert
 
 // Special APIs - for development or testing
@@ -0,0 +1,267 @@
+//! \file
+//! Reassembly of a file sent in fragments with parity, see FragReceiver.
+#include "lmic.h"
+#include "bufferpack.h"
+#include "../hal/hal.h"
+#include <string.h>
+
+#if FUOTA_MAX_FRAGS > 0
+
+// storage read and XORed per chunk of this size
+enum { FRAG_CHUNK = 16 };
+
+uint8_t FragReceiver::receive(uint8_t *buf, uint8_t len, uint8_t *ans,
+                              uint8_t room) {
+  uint8_t ansLen = 0;
+  uint8_t i = 0;
+  while (i < len) {
+    uint8_t cid = buf[i];
+    uint8_t cmdLen;
+    if (cid == FRAG_PACKAGE_VERSION) {
+      cmdLen = 1;
+    } else if (cid == FRAG_SESSION_STATUS || cid == FRAG_SESSION_DELETE) {
+      cmdLen = 2;
+    } else if (cid == FRAG_SESSION_SETUP) {
+      cmdLen = 11;
+    } else if (cid == FRAG_DATA_FRAGMENT) {
+      // the fragment takes the rest of the payload
+      uint16_t indexAndN = len - i >= 3 ? rlsbf2(buf + i + 1) : 0;
+      uint16_t n = indexAndN & 0x3FFF;
+      if (fileState == FRAG_RECEIVING && (indexAndN >> 14) == index &&
+          n != 0 && len - i - 3 >= size) {
+        addFragment(n, buf + i + 3);
+      }
+      break;
+    } else {
+      // unknown command, the rest cannot be parsed
+      break;
+    }
+    if (len - i < cmdLen)
+      break;
+
+    uint8_t out[5];
+    uint8_t outLen = 0;
+    out[0] = cid;
+    if (cid == FRAG_PACKAGE_VERSION) {
+      // package identifier and version
+      out[1] = 3;
+      out[2] = 1;
+      outLen = 3;
+    } else if (cid == FRAG_SESSION_STATUS) {
+      bool participants = buf[i + 1] & 0x01;
+      uint8_t idx = (buf[i + 1] >> 1) & 0x03;
+      uint16_t lack = missing();
+      if (fileState != FRAG_IDLE && idx == index &&
+          (participants || lack != 0)) {
+        wlsbf2(out + 1, ((uint16_t)index << 14) | (frags & 0x3FFF));
+        out[3] = lack > 255 ? 255 : lack;
+        out[4] = tooMany ? 0x01 : 0x00;
+        outLen = 5;
+      }
+    } else if (cid == FRAG_SESSION_SETUP) {
+      out[1] = setup(buf + i + 1);
+      outLen = 2;
+    } else {
+      uint8_t idx = buf[i + 1] & 0x03;
+      out[1] = idx;
+      if (fileState == FRAG_IDLE || idx != index) {
+        // no such session
+        out[1] |= 0x04;
+      } else {
+        fileState = FRAG_IDLE;
+      }
+      outLen = 2;
+    }
+    if (room - ansLen >= outLen) {
+      memcpy(ans + ansLen, out, outLen);
+      ansLen += outLen;
+    }
+    i += cmdLen;
+  }
+  return ansLen;
+}
+
+uint16_t FragReceiver::missing() const {
+  if (fileState != FRAG_RECEIVING)
+    return 0;
+  if (!parityPhase)
+    return count - have;
+  return tooMany ? lost : lost - solved;
+}
+
+// FragSessionSetupReq, return the status of the answer
+uint8_t FragReceiver::setup(const uint8_t *cmd) {
+  uint8_t idx = (cmd[0] >> 4) & 0x03;
+  uint16_t nbFrag = rlsbf2(cmd + 1);
+  uint8_t fragSize = cmd[3];
+  uint8_t status = idx << 6;
+  // only the matrix of the specification, FragmentationMatrix in bits 5:3
+  // of Control, BlockAckDelay below it
+  if (((cmd[4] >> 3) & 0x07) != 0)
+    status |= 0x01;
+  if (nbFrag == 0 || nbFrag > FUOTA_MAX_FRAGS || fragSize == 0 ||
+      (uint32_t)nbFrag * fragSize > hal_storage_size()) {
+    status |= 0x02;
+  }
+  // one session at a time, a new setup of the same index restarts it
+  if (fileState == FRAG_RECEIVING && idx != index)
+    status |= 0x04;
+  if (status & 0x07)
+    return status;
+
+  index = idx;
+  groupMask = cmd[0] & 0x0F;
+  count = nbFrag;
+  size = fragSize;
+  padding = cmd[5];
+  descriptor = rlsbf4(cmd + 6);
+  frags = 0;
+  have = 0;
+  lost = 0;
+  solved = 0;
+  parityPhase = false;
+  tooMany = false;
+  memset(got, 0, sizeof(got));
+  fileState = FRAG_RECEIVING;
+  PRINT_DEBUG_1("Frag session %d, %d x %d bytes", index, count, size);
+  return status;
+}
+
+void FragReceiver::addFragment(uint16_t n, uint8_t *data) {
+  frags++;
+  if (n <= count && !parityPhase) {
+    uint16_t k = n - 1;
+    if (!received(k)) {
+      hal_storage_write((uint32_t)k * size, data, size);
+      got[k >> 3] |= 1 << (k & 7);
+      have++;
+      if (have == count)
+        verify();
+    }
+    return;
+  }
+  if (!parityPhase) {
+    // the missing fragments are the unknowns of the system from now on
+    parityPhase = true;
+    lost = count - have;
+    tooMany = lost > FUOTA_MAX_LOST || rowOffset(lost) > hal_storage_size();
+    memset(pivots, 0, sizeof(pivots));
+    PRINT_DEBUG_1("Frag lost %d of %d", lost, count);
+  }
+  if (!tooMany)
+    addParity(n, data);
+}
+
+// reduce the fragment n to the missing ones, then by the rows stored
+void FragReceiver::addParity(uint16_t n, uint8_t *data) {
+  uint8_t line[FUOTA_MAX_FRAGS / 8];
+  if (n <= count) {
+    // uncoded fragment repeated after the parity
+    memset(line, 0, sizeof(line));
+    line[(n - 1) >> 3] |= 1 << ((n - 1) & 7);
+  } else {
+    fragMatrixLine(n, count, line);
+  }
+
+  uint8_t row[FUOTA_MAX_LOST / 8] = {};
+  uint16_t rank = 0;
+  for (uint16_t i = 0; i < count; i++) {
+    bool picked = line[i >> 3] & (1 << (i & 7));
+    if (received(i)) {
+      if (picked)
+        xorStored((uint32_t)i * size, data, size);
+    } else {
+      if (picked)
+        row[rank >> 3] |= 1 << (rank & 7);
+      rank++;
+    }
+  }
+
+  uint8_t rowLen = (lost + 7) / 8;
+  for (uint16_t p = 0; p < lost; p++) {
+    if (!(row[p >> 3] & (1 << (p & 7))))
+      continue;
+    uint32_t offset = rowOffset(p);
+    if (!(pivots[p >> 3] & (1 << (p & 7)))) {
+      hal_storage_write(offset, row, rowLen);
+      hal_storage_write(offset + rowLen, data, size);
+      pivots[p >> 3] |= 1 << (p & 7);
+      solved++;
+      if (solved == lost)
+        solve(data);
+      return;
+    }
+    uint8_t stored[FUOTA_MAX_LOST / 8];
+    hal_storage_read(offset, stored, rowLen);
+    for (uint8_t j = 0; j < rowLen; j++) {
+      row[j] ^= stored[j];
+    }
+    xorStored(offset + rowLen, data, size);
+  }
+  // combination of the rows stored, nothing new
+}
+
+// back substitution from the last row, work holds a fragment
+void FragReceiver::solve(uint8_t *work) {
+  uint8_t rowLen = (lost + 7) / 8;
+  for (uint16_t p = lost; p-- > 0;) {
+    uint8_t row[FUOTA_MAX_LOST / 8];
+    uint32_t offset = rowOffset(p);
+    hal_storage_read(offset, row, rowLen);
+    hal_storage_read(offset + rowLen, work, size);
+    // the unknowns after p are solved and written at their place
+    uint16_t rank = 0;
+    uint16_t at = 0;
+    for (uint16_t i = 0; i < count; i++) {
+      if (received(i))
+        continue;
+      if (rank == p) {
+        at = i;
+      } else if (rank > p && (row[rank >> 3] & (1 << (rank & 7)))) {
+        xorStored((uint32_t)i * size, work, size);
+      }
+      rank++;
+    }
+    hal_storage_write((uint32_t)at * size, work, size);
+  }
+  verify();
+}
+
+// CRC-32 of the file against the descriptor
+void FragReceiver::verify() {
+  uint32_t crc = 0xFFFFFFFF;
+  uint32_t length = fileLength();
+  uint8_t chunk[FRAG_CHUNK];
+  for (uint32_t offset = 0; offset < length; offset += FRAG_CHUNK) {
+    uint8_t len = length - offset < FRAG_CHUNK ? length - offset : FRAG_CHUNK;
+    hal_storage_read(offset, chunk, len);
+    for (uint8_t j = 0; j < len; j++) {
+      crc ^= chunk[j];
+      for (uint8_t k = 0; k < 8; k++) {
+        crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+      }
+    }
+  }
+  fileState = ~crc == descriptor ? FRAG_VERIFIED : FRAG_CORRUPTED;
+  PRINT_DEBUG_1("Frag file %s",
+                fileState == FRAG_VERIFIED ? "verified" : "corrupted");
+}
+
+// offset of the row p of the system, after the file
+uint32_t FragReceiver::rowOffset(uint16_t p) const {
+  return (uint32_t)count * size + (uint32_t)p * ((lost + 7) / 8 + size);
+}
+
+void FragReceiver::xorStored(uint32_t offset, uint8_t *data,
+                             uint8_t len) const {
+  uint8_t chunk[FRAG_CHUNK];
+  for (uint16_t i = 0; i < len; i += FRAG_CHUNK) {
+    uint8_t n = len - i < FRAG_CHUNK ? len - i : FRAG_CHUNK;
+    hal_storage_read(offset + i, chunk, n);
+    for (uint8_t j = 0; j < n; j++) {
+      data[i + j] ^= chunk[j];
+    }
+  }
+}
+
+#endif // FUOTA_MAX_FRAGS > 0
@@ -0,0 +1,80 @@
+//! \file
+//! Uplink of a buffer in fragments with parity, see FragSession.
+#include "lmic.h"
+#include "bufferpack.h"
+#include <string.h>
+
+#if UPLINK_FRAG_SIZE > 0 || FUOTA_MAX_FRAGS > 0
+
+// pseudo random sequence of the parity rows
+static uint32_t prbs23(uint32_t x) {
+  uint32_t b0 = x & 1;
+  uint32_t b1 = (x & 0x20) >> 5;
+  return (x >> 1) + ((b0 ^ b1) << 22);
+}
+
+// row n - m of the parity matrix, m/2 fragments drawn, repeats included
+void fragMatrixLine(uint16_t n, uint16_t m, uint8_t *row) {
+  memset(row, 0, (m + 7) / 8);
+  uint32_t pow2 = (m & (m - 1)) == 0 ? 1 : 0;
+  uint32_t x = 1 + 1001 * (uint32_t)(n - m);
+  for (uint16_t k = 0; k < m / 2; k++) {
+    uint32_t r = m;
+    while (r >= m) {
+      x = prbs23(x);
+      r = x % (m + pow2);
+    }
+    row[r >> 3] |= 1 << (r & 7);
+  }
+}
+
+#endif
+
+#if UPLINK_FRAG_SIZE > 0
+
+bool FragSession::start(const uint8_t *buf, uint16_t len, uint8_t fragLen,
+                        uint16_t parityCount, uint8_t sessionIndex) {
+  uint16_t frags = (len + fragLen - 1) / fragLen;
+  if (frags == 0 || frags > FRAG_MAX_COUNT ||
+      parityCount > FRAG_MAX_NUMBER - frags)
+    return false;
+  data = buf;
+  length = len;
+  size = fragLen;
+  count = frags;
+  parity = parityCount;
+  index = sessionIndex & 3;
+  next = 0;
+  return true;
+}
+
+// XOR the uncoded fragment i (0 based) in the payload, zero padded
+void FragSession::addUncoded(uint16_t i) {
+  uint16_t off = i * size;
+  uint8_t len = length - off < size ? length - off : size;
+  for (uint8_t j = 0; j < len; j++) {
+    frame[FRAG_HEADER_LEN + j] ^= data[off + j];
+  }
+}
+
+uint8_t FragSession::build() {
+  uint16_t n = next + 1;
+  wlsbf2(frame, ((uint16_t)index << 14) | n);
+  wlsbf2(frame + 2, count);
+  frame[4] = count * size - length;
+  memset(frame + FRAG_HEADER_LEN, 0, size);
+  if (n <= count) {
+    addUncoded(n - 1);
+  } else {
+    uint8_t row[FRAG_MAX_COUNT / 8];
+    fragMatrixLine(n, count, row);
+    for (uint16_t i = 0; i < count; i++) {
+      if (row[i >> 3] & (1 << (i & 7)))
+        addUncoded(i);
+    }
+  }
+  next++;
+  return FRAG_HEADER_LEN + size;
+}
+
+#endif // UPLINK_FRAG_SIZE > 0
@@ -0,0 +1,88 @@
+//! \file
+#include "lmic.h"
+#include <algorithm>
+
+// Minimum SNR to demodulate per SF, in dB * SNR_SCALEUP
+static CONST_TABLE(int8_t, SNR_FLOOR)[] = {
+    0,   // FSK -- no SNR reported
+    -30, // SF7  -7.5dB
+    -40, // SF8  -10dB
+    -50, // SF9  -12.5dB
+    -60, // SF10 -15dB
+    -70, // SF11 -17.5dB
+    -80, // SF12 -20dB
+};
+
+void LinkQuality::reset() {
+  std::fill(drRxCount, drRxCount + LQ_NUM_DR, 0);
+  // no information: start at 50%
+  std::fill(drDelivery, drDelivery + LQ_NUM_DR, LQ_PROB_MAX / 2);
+  std::fill(channelDelivery, channelDelivery + LQ_NUM_CHANNELS,
+            LQ_PROB_MAX / 2);
+  pendingDr = LQ_NUM_DR;
+}
+
+void LinkQuality::addReception(dr_t dr, int8_t snr) {
+  if (dr >= LQ_NUM_DR || !validDR(dr))
+    return;
+  rps_t rps = dndr2rps(dr);
+  // FSK reports no SNR
+  if (rps.sf == FSK)
+    return;
+  // dB * 16
+  int16_t sample = (snr - TABLE_GET_S1(SNR_FLOOR, rps.sf)) * 4;
+  if (drRxCount[dr] == 0) {
+    drMargin[dr] = sample;
+  } else {
+    drMargin[dr] += (sample - drMargin[dr]) / (1 << LQ_EWMA_SHIFT);
+  }
+  if (drRxCount[dr] < 0xFF)
+    drRxCount[dr]++;
+}
+
+uint8_t LinkQuality::updateProbability(uint8_t current, bool success) {
+  int16_t target = success ? LQ_PROB_MAX : 0;
+  int16_t delta = target - current;
+  // round away from current value so that 0 and LQ_PROB_MAX are reached
+  if (delta > 0)
+    delta += (1 << LQ_EWMA_SHIFT) - 1;
+  else
+    delta -= (1 << LQ_EWMA_SHIFT) - 1;
+  return current + delta / (1 << LQ_EWMA_SHIFT);
+}
+
+void LinkQuality::setUplink(dr_t dr, uint8_t chnl) {
+  pendingDr = dr;
+  pendingChnl = chnl;
+}
+
+void LinkQuality::uplinkDone(bool delivered) {
+  if (pendingDr >= LQ_NUM_DR)
+    return;
+  drDelivery[pendingDr] = updateProbability(drDelivery[pendingDr], delivered);
+  if (pendingChnl < LQ_NUM_CHANNELS) {
+    channelDelivery[pendingChnl] =
+        updateProbability(channelDelivery[pendingChnl], delivered);
+  }
+  pendingDr = LQ_NUM_DR;
+}
+
+int8_t LinkQuality::margin(dr_t dr) const {
+  if (dr >= LQ_NUM_DR || drRxCount[dr] == 0)
+    return LQ_MARGIN_UNKNOWN;
+  // round to nearest dB
+  int16_t m = drMargin[dr];
+  return (m + (m < 0 ? -8 : 8)) / 16;
+}
+
+uint8_t LinkQuality::deliveryProbability(dr_t dr) const {
+  if (dr >= LQ_NUM_DR)
+    return 0;
+  return drDelivery[dr];
+}
+
+uint8_t LinkQuality::channelDeliveryProbability(uint8_t chnl) const {
+  if (chnl >= LQ_NUM_CHANNELS)
+    return 0;
+  return channelDelivery[chnl];
+}
@@ -34,6 +34,8 @@
 #define BCN_GUARD_osticks OsDeltaTime::from_ms(BCN_GUARD_ms)
 #define BCN_WINDOW_osticks OsDeltaTime::from_ms(BCN_WINDOW_ms)
 #define AIRTIME_BCN_osticks OsDeltaTime::from_us(AIRTIME_BCN)
+#define BCN_DELAY_osticks OsDeltaTime::from_us(BCN_DELAY_us)
+#define BCN_SLOT_SPAN_osticks OsDeltaTime::from_us(BCN_SLOT_SPAN_us)
 
 Lmic LMIC;
 
@@ -73,6 +75,11 @@ int16_t getSensitivity(rps_t rps) {
 OsDeltaTime calcAirTime(rps_t rps, uint8_t plen) {
   uint8_t bw = rps.bw; // 0,1,2 = 125,250,500kHz
   uint8_t sf = rps.sf; // 0=FSK, 1..6 = SF7..12
+  if (sf == FSK) {
+    // preamble, sync word, length byte, payload and crc at 50kbps
+    return OsDeltaTime(((int32_t)plen + PAMBL_FSK + 3 + 1 + 2) * 8 *
+                       OSTICKS_PER_SEC / 50000);
+  }
   uint8_t sfx = 4 * (sf + (7 - SF7));
   uint8_t q = sfx - (sf >= SF11 ? 8 : 0);
   int16_t tmp = 8 * plen - sfx + 28 + (rps.nocrc ? 0 : 16) - (rps.ih ? 20 : 0);
@@ -121,19 +128,36 @@ extern inline bool sameSfBw(rps_t r1, rps_t r2);
 // END LORA
 // ================================================================================
 
-// Adjust DR for TX retries
-//  - indexed by retry count
-//  - return steps to lower DR
-static CONST_TABLE(uint8_t, DRADJUST)[2 + TXCONF_ATTEMPTS] = {
-    // normal frames - 1st try / no retry
-    0,
-    // confirmed frames
-    0, 0, 1, 0, 1, 0, 1, 0, 0};
+// Check the policy lets the current confirmed frame be sent again
+bool Lmic::retryAllowed() const {
+  if (txCnt >= retryPolicy.attempts)
+    return false;
+  if (retryPolicy.airtimeBudget == 0)
+    return true;
+  OsDeltaTime next = txAirtime;
+  next += txLastAirtime;
+  return !(next > OsDeltaTime::from_ms(retryPolicy.airtimeBudget));
+}
+
+// Span of the random delay before the next retry [s]
+uint8_t Lmic::retryBackoff() const {
+  // txCnt - 1 retries already sent
+  uint8_t doublings = txCnt - 1;
+  if (doublings > retryPolicy.backoffDoublings)
+    doublings = retryPolicy.backoffDoublings;
+  uint16_t span = retryPolicy.backoffSecs;
+  while (doublings-- > 0 && span < 0xFF)
+    span <<= 1;
+  return span < 0xFF ? span : 0xFF;
+}
 
 void Lmic::txDelay(OsTime const &reftime, uint8_t secSpan) {
-  auto delayRef = reftime + OsDeltaTime::rnd_delay(secSpan);
-  if (globalDutyRate == 0 || (delayRef - globalDutyAvail) > OsDeltaTime(0)) {
-    globalDutyAvail = delayRef;
+  delayTxUntil(reftime + OsDeltaTime::rnd_delay(secSpan));
+}
+
+void Lmic::delayTxUntil(OsTime const &time) {
+  if (globalDutyRate == 0 || (time - globalDutyAvail) > OsDeltaTime(0)) {
+    globalDutyAvail = time;
     opmode |= OP_RNDTX;
   }
 }
@@ -171,166 +195,404 @@ void Lmic::stateJustJoined() {
   seqnoUp = 0;
   rejoinCnt = 0;
   dnConf = 0;
-  ladrAns = 0;
-  devsAns = false;
-  rxTimingSetupAns = false;
-#if !defined(DISABLE_MCMD_SNCH_REQ)
-  snchAns = 0;
-#endif
-#if !defined(DISABLE_MCMD_DN2P_SET)
-  dn2Ans = 0;
-#endif
-#if !defined(DISABLE_MCMD_DCAP_REQ)
-  dutyCapAns = false;
-#endif
+  std::fill(macAns, macAns + MAC_CMD_COUNT, 0);
+  macAnsBlock = 0;
+  macAnsRepeatCount = 0;
+  macAnsSpill = false;
+  linkCheckSent = false;
+  dnEncrypted = false;
   upRepeat = 0;
   adrAckReq = LINK_CHECK_INIT;
   rx1DrOffset = 0;
   dn2Dr = DR_DNW2;
   dn2Freq = FREQ_DNW2;
+#if ENABLE_CLASS_B
+  bcnChFreq = 0;
+  pingChFreq = 0;
+  pingDr = DR_PING;
+#endif
+}
+
+// LinkADRReq LoRaWAN™ Specification §5.2
+// A block of commands is accepted or rejected as a whole: the channel masks
+// add up, the last command gives data rate, power and repetitions.
+uint8_t Lmic::validateLinkAdr(const uint8_t *cmd, uint8_t count) {
+  uint8_t status =
+      MCMD_LADR_ANS_POWACK | MCMD_LADR_ANS_CHACK | MCMD_LADR_ANS_DRACK;
+  // masks are tried on the live map, applyLinkAdr() restores it if rejected
+  regionLMic.saveChannelMap();
+  for (uint8_t i = 0; i < count; i++) {
+    const uint8_t *c = cmd + i * 5;
+    uint16_t chMask = rlsbf2(&c[2]); // list of enabled channels
+    uint8_t chMaskCntl = c[4] & MCMD_LADR_CHPAGE_MASK; // channel page
+    if (!regionLMic.mapChannels(chMaskCntl, chMask)) {
+      PRINT_DEBUG_1("ADR REQ Invalid map channel maskCtnl=%i, mask=%i",
+                    chMaskCntl, chMask);
+      status &= ~MCMD_LADR_ANS_CHACK;
+    }
+  }
+  const uint8_t *last = cmd + (count - 1) * 5;
+  dr_t dr = (dr_t)(last[1] >> MCMD_LADR_DR_SHIFT);
+  if (!validDR(dr)) {
+    PRINT_DEBUG_1("ADR REQ Invalid dr %i", dr);
+    status &= ~MCMD_LADR_ANS_DRACK;
+  }
+  return status;
+}
+
+void Lmic::applyLinkAdr(const uint8_t *cmd, uint8_t count, uint8_t status) {
+  if (status ==
+      (MCMD_LADR_ANS_POWACK | MCMD_LADR_ANS_CHACK | MCMD_LADR_ANS_DRACK)) {
+    // Nothing went wrong - use settings
+    const uint8_t *last = cmd + (count - 1) * 5;
+    uint8_t p1 = last[1]; // txpow + DR
+    dr_t dr = (dr_t)(p1 >> MCMD_LADR_DR_SHIFT);
+    upRepeat = last[4] & MCMD_LADR_REPEAT_MASK; // up repeat count
+    PRINT_DEBUG_1("ADR REQ Change dr to %i, power to %i", dr,
+                  p1 & MCMD_LADR_POW_MASK);
+    setDrTxpow(dr, regionLMic.pow2dBm(p1));
+  } else {
+    regionLMic.restoreChannelMap();
+  }
+  if (adrAckReq != LINK_CHECK_OFF) {
+    // force ack to NWK.
+    adrAckReq = 0;
+  }
+}
+
+// DutyCycleReq LoRaWAN™ Specification §5.3
+void Lmic::applyDutyCycle(const uint8_t *cmd, uint8_t count, uint8_t status) {
+  uint8_t cap = cmd[1];
+
+  // cap=0xFF is not in specification...
+  // A value cap=0xFF means device is OFF unless enabled again manually.
+  if (cap == 0xFF)
+    opmode |= OP_SHUTDOWN; // stop any sending
+
+  globalDutyRate = cap & 0xF;
+  globalDutyAvail = os_getTime();
+}
+
+// RXParamSetupReq LoRaWAN™ Specification §5.4
+uint8_t Lmic::validateRxParamSetup(const uint8_t *cmd, uint8_t count) {
+  dr_t dr = (dr_t)(cmd[1] & 0x0F);
+  uint8_t newRx1DrOffset = ((cmd[1] & 0x70) >> 4);
+  uint8_t status = 0;
+  if (regionLMic.validRx1DrOffset(newRx1DrOffset))
+    status |= MCMD_DN2P_ANS_RX1DrOffsetAck;
+  if (validDR(dr))
+    status |= MCMD_DN2P_ANS_DRACK;
+  if (regionLMic.convFreq(&cmd[2]) != 0)
+    status |= MCMD_DN2P_ANS_CHACK;
+  return status;
+}
+
+void Lmic::applyRxParamSetup(const uint8_t *cmd, uint8_t count,
+                             uint8_t status) {
+  if (status == (MCMD_DN2P_ANS_RX1DrOffsetAck | MCMD_DN2P_ANS_DRACK |
+                 MCMD_DN2P_ANS_CHACK)) {
+    dn2Dr = (dr_t)(cmd[1] & 0x0F);
+    dn2Freq = regionLMic.convFreq(&cmd[2]);
+    rx1DrOffset = ((cmd[1] & 0x70) >> 4);
+  }
+}
+
+// DevStatusAns LoRaWAN™ Specification §5.5
+void Lmic::encodeDevStatus(uint8_t *ans, uint8_t status) {
+  ans[0] = os_getBattLevel();
+  ans[1] = margin;
+}
+
+// NewChannelReq LoRaWAN™ Specification §5.6
+uint8_t Lmic::validateNewChannel(const uint8_t *cmd, uint8_t count) {
+  uint8_t chidx = cmd[1];                          // channel
+  uint32_t newfreq = regionLMic.convFreq(&cmd[2]); // freq
+  uint8_t drs = cmd[5];                            // datarate span
+  // the region checks and sets at once, nothing is left to apply
+  if (newfreq != 0 &&
+      regionLMic.setupChannel(chidx, newfreq,
+                              DR_RANGE_MAP(drs & 0xF, drs >> 4), -1))
+    return MCMD_SNCH_ANS_DRACK | MCMD_SNCH_ANS_FQACK;
+  return 0;
+}
+
+// RXTimingSetupReq LoRaWAN™ Specification §5.7
+void Lmic::applyRxTimingSetup(const uint8_t *cmd, uint8_t count,
+                              uint8_t status) {
+  uint8_t newDelay = cmd[1] & 0x0F;
+  if (newDelay == 0)
+    newDelay = 1;
+  rxDelay = OsDeltaTime::from_sec(newDelay);
+}
+
+// LinkCheckReq LoRaWAN™ Specification §5.1, without answer until one comes
+void Lmic::encodeLinkCheck(uint8_t *ans, uint8_t status) {
+  linkCheck.margin = 0;
+  linkCheck.gateways = 0;
+  linkCheckSent = true;
+}
+
+// DeviceTimeAns LoRaWAN™ Specification 1.0.3 §5.9, the time at the end of
+// the uplink
+void Lmic::applyDeviceTime(const uint8_t *cmd, uint8_t count,
+                           uint8_t status) {
+  wallClock.sync(txend, rlsbf4(cmd + 1), cmd[5]);
+  wallClockJob.setTimedCallback(
+      txend + OsDeltaTime::from_sec(WCLK_REBASE_PERIOD),
+      &Lmic::rebaseWallClock);
+#if ENABLE_CLASS_C && MC_GROUP_COUNT > 0
+  // the sessions were followed from their setup until now
+  scheduleMcSession();
+#endif
+}
+
+// the reference is at most two periods old, far from the wrap of OsTime
+void Lmic::rebaseWallClock() {
+  OsTime now = os_getTime();
+  wallClock.rebase(now);
+  wallClockJob.setTimedCallback(now + OsDeltaTime::from_sec(WCLK_REBASE_PERIOD),
+                                &Lmic::rebaseWallClock);
+}
+
+void Lmic::applyLinkCheck(const uint8_t *cmd, uint8_t count, uint8_t status) {
+  linkCheck.margin = cmd[1];
+  linkCheck.gateways = cmd[2];
+  PRINT_DEBUG_1("Link check, margin %d dB, %d gateways", cmd[1], cmd[2]);
+}
+
+#if ENABLE_CLASS_B
+// PingSlotInfoReq LoRaWAN™ Specification 1.0.3 class B, the periodicity
+// asked
+void Lmic::encodePingSlotInfo(uint8_t *ans, uint8_t status) {
+  ans[0] = pingExp;
+}
+
+// PingSlotInfoAns: the network knows the ping slots
+void Lmic::applyPingSlotInfo(const uint8_t *cmd, uint8_t count,
+                             uint8_t status) {
+  if (!(opmode & OP_PINGABLE))
+    return;
+  opmode |= OP_PINGINI;
+  if (opmode & OP_TRACK)
+    startPingSlots();
+}
+
+// PingSlotChannelReq LoRaWAN™ Specification 1.0.3 class B, a frequency
+// of 0 is the default one
+uint8_t Lmic::validatePingSlotChannel(const uint8_t *cmd, uint8_t count) {
+  uint8_t status = 0;
+  if (rlsbf3(&cmd[1]) == 0 || regionLMic.convFreq(&cmd[1]) != 0)
+    status |= MCMD_PING_ANS_FQACK;
+  if (validDR((dr_t)(cmd[4] & 0x0F)))
+    status |= MCMD_PING_ANS_DRACK;
+  return status;
+}
+
+void Lmic::applyPingSlotChannel(const uint8_t *cmd, uint8_t count,
+                                uint8_t status) {
+  if (status == (MCMD_PING_ANS_FQACK | MCMD_PING_ANS_DRACK)) {
+    pingChFreq = regionLMic.convFreq(&cmd[1]);
+    pingDr = (dr_t)(cmd[4] & 0x0F);
+  }
+}
+
+// BeaconTimingAns LoRaWAN™ Specification 1.0.2 class B, the next beacon
+// starts within the delay slot given after the uplink
+void Lmic::applyBeaconTiming(const uint8_t *cmd, uint8_t count,
+                             uint8_t status) {
+  if (bcnInfoTries == 0)
+    return;
+  bcnTimingKnown = true;
+  bcnTimingStart =
+      txend + OsDeltaTime::from_ms((int32_t)rlsbf2(&cmd[1]) * MCMD_BCNI_TUNIT);
+  bcnTimingChnl = cmd[3];
+}
+
+// BeaconFreqReq LoRaWAN™ Specification 1.0.3 class B, a frequency of 0
+// is the default one
+uint8_t Lmic::validateBeaconFreq(const uint8_t *cmd, uint8_t count) {
+  if (rlsbf3(&cmd[1]) == 0 || regionLMic.convFreq(&cmd[1]) != 0)
+    return MCMD_BeaconFreq_ANS_FQACK;
+  return 0;
+}
+
+void Lmic::applyBeaconFreq(const uint8_t *cmd, uint8_t count,
+                           uint8_t status) {
+  if (status == MCMD_BeaconFreq_ANS_FQACK)
+    bcnChFreq = regionLMic.convFreq(&cmd[1]);
+}
+#endif
+
+// Downlink MAC commands, in the order of their answers in the uplinks.
+// All commands of the specification are listed with their length, so that
+// the ones not handled are skipped.
+CONST_TABLE_MEMBER(Lmic::MacCommand, Lmic, MAC_COMMANDS)[MAC_CMD_COUNT] = {
+#if !defined(DISABLE_MCMD_DCAP_REQ)
+    {MCMD_DCAP_REQ, 2, 0, 1, nullptr, &Lmic::applyDutyCycle, nullptr},
+#else
+    {MCMD_DCAP_REQ, 2, 0, 0, nullptr, nullptr, nullptr},
+#endif
+#if !defined(DISABLE_MCMD_DN2P_SET)
+    {MCMD_DN2P_SET, 5, MAC_CMD_STICKY, 2, &Lmic::validateRxParamSetup,
+     &Lmic::applyRxParamSetup, nullptr},
+#else
+    {MCMD_DN2P_SET, 5, 0, 0, nullptr, nullptr, nullptr},
+#endif
+    {MCMD_DEVS_REQ, 1, 0, 3, nullptr, nullptr, &Lmic::encodeDevStatus},
+    {MCMD_LADR_REQ, 5, MAC_CMD_BLOCK, 2, &Lmic::validateLinkAdr,
+     &Lmic::applyLinkAdr, nullptr},
+    {MCMD_RXTimingSetup_REQ, 2, MAC_CMD_STICKY, 1, nullptr,
+     &Lmic::applyRxTimingSetup, nullptr},
+#if !defined(DISABLE_MCMD_SNCH_REQ)
+    {MCMD_SNCH_REQ, 6, MAC_CMD_REPEAT, 2, &Lmic::validateNewChannel, nullptr,
+     nullptr},
+#else
+    {MCMD_SNCH_REQ, 6, 0, 0, nullptr, nullptr, nullptr},
+#endif
+    {MCMD_LCHK_ANS, 3, MAC_CMD_REQUEST, 1, nullptr, &Lmic::applyLinkCheck,
+     &Lmic::encodeLinkCheck},
+    // NOT IMPLEMENTED / NOT NEED IN EU868
+    {MCMD_TxParamSetup_REQ, 2, 0, 0, nullptr, nullptr, nullptr},
+    {MCMD_DlChannel_REQ, 5, 0, 0, nullptr, nullptr, nullptr},
+    {MCMD_DeviceTime_ANS, 6, MAC_CMD_REQUEST, 1, nullptr,
+     &Lmic::applyDeviceTime, nullptr},
+#if ENABLE_CLASS_B
+    {MCMD_PING_INFO_ANS, 1, MAC_CMD_REQUEST, 2, nullptr,
+     &Lmic::applyPingSlotInfo, &Lmic::encodePingSlotInfo},
+    {MCMD_PING_SET, 5, 0, 2, &Lmic::validatePingSlotChannel,
+     &Lmic::applyPingSlotChannel, nullptr},
+    {MCMD_BCNI_ANS, 4, MAC_CMD_REQUEST, 1, nullptr, &Lmic::applyBeaconTiming,
+     nullptr},
+    {MCMD_BeaconFreq_REQ, 4, 0, 2, &Lmic::validateBeaconFreq,
+     &Lmic::applyBeaconFreq, nullptr},
+#else
+    {MCMD_PING_INFO_ANS, 1, 0, 0, nullptr, nullptr, nullptr},
+    {MCMD_PING_SET, 5, 0, 0, nullptr, nullptr, nullptr},
+    {MCMD_BCNI_ANS, 4, 0, 0, nullptr, nullptr, nullptr},
+    {MCMD_BeaconFreq_REQ, 4, 0, 0, nullptr, nullptr, nullptr},
+#endif
+};
+
+// Entry of MAC_COMMANDS for this CID, MAC_CMD_COUNT if unknown
+uint8_t Lmic::macCommandIndex(uint8_t cid) const {
+  uint8_t i = 0;
+  while (i < MAC_CMD_COUNT && TABLE_GET_STRUCT(MAC_COMMANDS, i).cid != cid) {
+    i++;
+  }
+  return i;
+}
+
+// Send the request of this MAC_COMMANDS entry with the next uplink
+void Lmic::queueMacRequest(uint8_t cid) {
+  uint8_t i = macCommandIndex(cid);
+  ASSERT(i < MAC_CMD_COUNT);
+  macAns[i] = MAC_ANS_PENDING;
 }
 
 void Lmic::parseMacCommands(const uint8_t *opts, uint8_t olen) {
   uint8_t oidx = 0;
   while (oidx < olen) {
-    switch (opts[oidx]) {
-    // LinkCheckReq LoRaWAN™ Specification §5.1
-    case MCMD_LCHK_ANS: {
-      // int gwmargin = opts[oidx+1];
-      // int ngws = opts[oidx+2];
-      oidx += 3;
-      continue;
+    uint8_t i = macCommandIndex(opts[oidx]);
+    if (i == MAC_CMD_COUNT) {
+      // unknown command, its length too
+      break;
     }
-    // LinkADRReq LoRaWAN™ Specification §5.2
-    case MCMD_LADR_REQ: {
-      // FIXME multiple LinkAdrReq not handled properly in continous block
-      // must be handle atomic.
-      uint8_t p1 = opts[oidx + 1];               // txpow + DR
-      uint16_t chMask = rlsbf2(&opts[oidx + 2]); // list of enabled channels
-      uint8_t chMaskCntl =
-          opts[oidx + 4] & MCMD_LADR_CHPAGE_MASK; // channel page
-      uint8_t nbTrans =
-          opts[oidx + 4] & MCMD_LADR_REPEAT_MASK; // up repeat count
-      oidx += 5;
-
-      ladrAns = 0x80 | // Include an answer into next frame up
-                MCMD_LADR_ANS_POWACK | MCMD_LADR_ANS_CHACK |
-                MCMD_LADR_ANS_DRACK;
-      if (!regionLMic.mapChannels(chMaskCntl, chMask)) {
-        PRINT_DEBUG_1("ADR REQ Invalid map channel maskCtnl=%i, mask=%i",
-                      chMaskCntl, chMask);
-        ladrAns &= ~MCMD_LADR_ANS_CHACK;
-      }
-      dr_t dr = (dr_t)(p1 >> MCMD_LADR_DR_SHIFT);
-      if (!validDR(dr)) {
-        PRINT_DEBUG_1("ADR REQ Invalid dr %i", dr);
-        ladrAns &= ~MCMD_LADR_ANS_DRACK;
-      }
-      if ((ladrAns & 0x7F) ==
-          (MCMD_LADR_ANS_POWACK | MCMD_LADR_ANS_CHACK | MCMD_LADR_ANS_DRACK)) {
-        // Nothing went wrong - use settings
-        upRepeat = nbTrans;
-        PRINT_DEBUG_1("ADR REQ Change dr to %i, power to %i", dr,
-                      p1 & MCMD_LADR_POW_MASK);
-        setDrTxpow(dr, regionLMic.pow2dBm(p1));
-      }
-      if (adrAckReq != LINK_CHECK_OFF) {
-        // force ack to NWK.
-        adrAckReq = 0;
+    MacCommand const cmd = TABLE_GET_STRUCT(MAC_COMMANDS, i);
+    if (olen - oidx < cmd.length) {
+      // truncated
+      break;
+    }
+    uint8_t count = 1;
+    if (cmd.flags & MAC_CMD_BLOCK) {
+      while (olen - oidx >= (count + 1) * cmd.length &&
+             opts[oidx + count * cmd.length] == cmd.cid) {
+        count++;
       }
-      continue;
     }
-    // DevStatusReq LoRaWAN™ Specification §5.5
-    case MCMD_DEVS_REQ: {
-      devsAns = true;
-      oidx += 1;
-      continue;
+    uint8_t status = 0;
+    if (cmd.validate) {
+      status = (this->*cmd.validate)(opts + oidx, count);
     }
-    // RXParamSetupReq LoRaWAN™ Specification §5.4
-    case MCMD_DN2P_SET: {
-#if !defined(DISABLE_MCMD_DN2P_SET)
-      dr_t dr = (dr_t)(opts[oidx + 1] & 0x0F);
-      uint8_t newRx1DrOffset = ((opts[oidx + 1] & 0x70) >> 4);
-      uint32_t newfreq = regionLMic.convFreq(&opts[oidx + 2]);
-      dn2Ans = 0x80; // answer pending
-      if (regionLMic.validRx1DrOffset(newRx1DrOffset))
-        dn2Ans |= MCMD_DN2P_ANS_RX1DrOffsetAck;
-      if (validDR(dr))
-        dn2Ans |= MCMD_DN2P_ANS_DRACK;
-      if (newfreq != 0)
-        dn2Ans |= MCMD_DN2P_ANS_CHACK;
-      if (dn2Ans == (0x80 | MCMD_DN2P_ANS_RX1DrOffsetAck | MCMD_DN2P_ANS_DRACK |
-                     MCMD_DN2P_ANS_CHACK)) {
-        dn2Dr = dr;
-        dn2Freq = newfreq;
-        rx1DrOffset = newRx1DrOffset;
-      }
-#endif // !DISABLE_MCMD_DN2P_SET
-      oidx += 5;
-      continue;
+    if (cmd.apply) {
+      (this->*cmd.apply)(opts + oidx, count, status);
     }
-    // DutyCycleReq LoRaWAN™ Specification §5.3
-    case MCMD_DCAP_REQ: {
-#if !defined(DISABLE_MCMD_DCAP_REQ)
-      uint8_t cap = opts[oidx + 1];
-
-      // cap=0xFF is not in specification...
-      // A value cap=0xFF means device is OFF unless enabled again manually.
-      if (cap == 0xFF)
-        opmode |= OP_SHUTDOWN; // stop any sending
-
-      globalDutyRate = cap & 0xF;
-      globalDutyAvail = os_getTime();
-      dutyCapAns = true;
-#endif // !DISABLE_MCMD_DCAP_REQ
-      oidx += 2;
-      continue;
+    if (cmd.ansLength && !(cmd.flags & MAC_CMD_REQUEST)) {
+      macAns[i] = MAC_ANS_PENDING | status;
+      if (cmd.flags & MAC_CMD_BLOCK) {
+        // one answer per command of the block
+        macAnsBlock = count;
+      } else if ((cmd.flags & MAC_CMD_REPEAT) &&
+                 macAnsRepeatCount < MAC_ANS_REPEAT_MAX) {
+        macAnsRepeat[macAnsRepeatCount++] = status;
+      }
     }
-    // NewChannelReq LoRaWAN™ Specification §5.6
-    case MCMD_SNCH_REQ: {
-#if !defined(DISABLE_MCMD_SNCH_REQ)
-      uint8_t chidx = opts[oidx + 1];                          // channel
-      uint32_t newfreq = regionLMic.convFreq(&opts[oidx + 2]); // freq
-      uint8_t drs = opts[oidx + 5];                            // datarate span
-      snchAns = 0x80;
-      if (newfreq != 0 &&
-          regionLMic.setupChannel(chidx, newfreq,
-                                  DR_RANGE_MAP(drs & 0xF, drs >> 4), -1))
-        snchAns |= MCMD_SNCH_ANS_DRACK | MCMD_SNCH_ANS_FQACK;
-#endif // !DISABLE_MCMD_SNCH_REQ
-      oidx += 6;
+    oidx += count * cmd.length;
+  }
+  if (oidx != olen) {
+    // corrupted frame or unknown command
+    PRINT_DEBUG_1("Parse of MAC command incompleted.");
+  }
+}
+
+// Number of answers pending for an entry of MAC_COMMANDS
+uint8_t Lmic::macAnswerCount(MacCommand const &cmd) const {
+  if (cmd.flags & MAC_CMD_BLOCK)
+    return macAnsBlock;
+  if (cmd.flags & MAC_CMD_REPEAT)
+    return macAnsRepeatCount;
+  return 1;
+}
+
+// Length of the answers pending, the sticky ones only if asked.
+uint8_t Lmic::macAnswersLength(bool sticky) const {
+  uint8_t length = 0;
+  for (uint8_t i = 0; i < MAC_CMD_COUNT; i++) {
+    if (!macAns[i]) {
       continue;
     }
-    // RXTimingSetupReq LoRaWAN™ Specification §5.7
-    case MCMD_RXTimingSetup_REQ: {
-      uint8_t newDelay = opts[oidx + 1] & 0x0F;
-      if (newDelay == 0)
-        newDelay = 1;
-      rxDelay = OsDeltaTime::from_sec(newDelay);
-      rxTimingSetupAns = true;
-      oidx += 2;
+    MacCommand const cmd = TABLE_GET_STRUCT(MAC_COMMANDS, i);
+    if (!sticky && (cmd.flags & MAC_CMD_STICKY)) {
       continue;
     }
-    case MCMD_TxParamSetup_REQ: {
-      // NOT IMPLEMENTED / NOT NEED IN EU868
-      oidx += 2;
+    length += macAnswerCount(cmd) * cmd.ansLength;
+  }
+  return length;
+}
+
+// Write the answers pending which fit in room, in the order of
+// MAC_COMMANDS. Return the length written.
+uint8_t Lmic::encodeMacAnswers(uint8_t *buf, uint8_t room) {
+  uint8_t end = 0;
+  for (uint8_t i = 0; i < MAC_CMD_COUNT; i++) {
+    if (!macAns[i]) {
       continue;
     }
-    case MCMD_PING_SET: {
-      oidx += 4;
+    MacCommand const cmd = TABLE_GET_STRUCT(MAC_COMMANDS, i);
+    uint8_t count = macAnswerCount(cmd);
+    if (end + count * cmd.ansLength > room) {
+      // left for the next uplink
       continue;
     }
-    case MCMD_BCNI_ANS: {
-      oidx += 4;
-      continue;
+    uint8_t status = macAns[i] & ~MAC_ANS_PENDING;
+    for (uint8_t n = 0; n < count; n++) {
+      if (cmd.flags & MAC_CMD_REPEAT)
+        status = macAnsRepeat[n];
+      buf[end] = cmd.cid;
+      if (cmd.encode) {
+        (this->*cmd.encode)(buf + end + 1, status);
+      } else if (cmd.ansLength > 1) {
+        buf[end + 1] = status;
+      }
+      end += cmd.ansLength;
     }
+    // sticky answers are cleared when a downlink is received
+    if (!(cmd.flags & MAC_CMD_STICKY)) {
+      macAns[i] = 0;
     }
-    break;
-  }
-  if (oidx != olen) {
-    // corrupted frame or unknown command
-    PRINT_DEBUG_1("Parse of MAC command incompleted.");
+    if (cmd.flags & MAC_CMD_REPEAT)
+      macAnsRepeatCount = 0;
   }
+  return end;
 }
 
 // ================================================================================
@@ -342,6 +604,8 @@ bool Lmic::decodeFrame() {
                            : ((txrxFlags & TXRX_DNW2) ? "RX2" : "Other");
 #endif
 
+  dnEncrypted = false;
+  dnGroup = MC_NO_GROUP;
   if (dataLen == 0) {
     PRINT_DEBUG_1("No downlink data, window=%s", window);
     return false;
@@ -368,8 +632,16 @@ bool Lmic::decodeFrame() {
   bool ackup = (fct & FCT_ACK) != 0 ? true : false; // ACK last up frame
   uint8_t poff = OFF_DAT_OPTS + olen;
   uint8_t pend = dlen - MIC_LEN; // MIC
+  // class B and C frames come out of the windows of the last uplink
+  bool inWindow = (txrxFlags & (TXRX_DNW1 | TXRX_DNW2)) != 0;
 
   if (addr != devaddr) {
+#if MC_GROUP_COUNT > 0
+    for (uint8_t id = 0; id < MC_GROUP_COUNT; id++) {
+      if (mcGroups[id].defined && mcGroups[id].addr == addr)
+        return decodeMulticast(id);
+    }
+#endif
     PRINT_DEBUG_1("Invalid address, window=%s", window);
     dataLen = 0;
     return false;
@@ -419,10 +691,27 @@ bool Lmic::decodeFrame() {
   if (adrAckReq != LINK_CHECK_OFF)
     adrAckReq = LINK_CHECK_INIT;
 
-  // Process OPTS
-  int16_t m = rssi - RSSI_OFF - getSensitivity(rps);
-  margin = m < 0 ? 0 : m > 254 ? 254 : m;
+  // Demodulation margin rounded to dB, 6 bit signed (LoRaWAN™ §5.5)
+  int8_t m = (snr + (snr < 0 ? -SNR_SCALEUP / 2 : SNR_SCALEUP / 2)) /
+             SNR_SCALEUP;
+  margin = (m < -32 ? -32 : m > 31 ? 31 : m) & 0x3F;
+  dr_t rxdr = (txrxFlags & TXRX_DNW1) ? dndr : dn2Dr;
+#if ENABLE_CLASS_B
+  if (txrxFlags & TXRX_PING)
+    rxdr = pingDr;
+#endif
+  linkQuality.addReception(rxdr, snr);
+  if (inWindow)
+    learnRxTiming(dlen);
+
+  // stop sending RXParamSetupAns and RXTimingSetupAns, before the
+  // commands of this downlink ask for them again
+  for (uint8_t i = 0; i < MAC_CMD_COUNT; i++) {
+    if (TABLE_GET_STRUCT(MAC_COMMANDS, i).flags & MAC_CMD_STICKY)
+      macAns[i] = 0;
+  }
 
+  // Process OPTS
   parseMacCommands(d + OFF_DAT_OPTS, olen);
 
   uint8_t port = -1;
@@ -430,14 +719,25 @@ bool Lmic::decodeFrame() {
     // Handle payload only if not a replay
     if (pend > poff) {
       port = d[poff++];
-      // Decrypt payload - if any
-      aes.framePayloadEncryption(port, devaddr, seqno, DIR_DOWN, d + poff,
-                                 pend - poff);
       txrxFlags |= TXRX_PORT;
       dataBeg = poff;
       dataLen = pend - poff;
       if (port == 0) {
+        aes.framePayloadEncryption(port, devaddr, seqno, DIR_DOWN, d + poff,
+                                   pend - poff);
         parseMacCommands(d + poff, pend - poff);
+#if APP_PACKAGES
+      } else if (isPackagePort(port)) {
+        aes.framePayloadEncryption(port, devaddr, seqno, DIR_DOWN, d + poff,
+                                   pend - poff);
+        receivePackage(port, d + poff, pend - poff);
+        // handled by the MAC, nothing for the application
+        txrxFlags = (txrxFlags & ~TXRX_PORT) | TXRX_NOPORT;
+        dataLen = 0;
+#endif
+      } else {
+        // decrypted by readDownlink(), if the application reads it
+        dnEncrypted = true;
       }
     } else {
       txrxFlags |= TXRX_NOPORT;
@@ -458,15 +758,19 @@ bool Lmic::decodeFrame() {
     // suspirious hack
   }
 
-  if (txCnt != 0) // we requested an ACK
-    txrxFlags |= ackup ? TXRX_ACK : TXRX_NACK;
-
-#if !defined(DISABLE_MCMD_DN2P_SET)
-  // stop sending RXParamSetupAns when receive dowlink message
-  dn2Ans = 0;
-#endif
-  // stop sending rxTimingSetupAns when receive dowlink message
-  rxTimingSetupAns = false;
+  if (inWindow) {
+    if (txCnt != 0) { // we requested an ACK
+      txrxFlags |= ackup ? TXRX_ACK : TXRX_NACK;
+      if (ackup) {
+        retryStats.delivered++;
+        retryStats.attempts += txCnt;
+      } else {
+        retryStats.failed++;
+      }
+    }
+    // any downlink proves the network heard the last uplink
+    linkQuality.uplinkDone(txCnt == 0 || ackup);
+  }
 
   PRINT_DEBUG_1("Received downlink, window=%s, port=%d, ack=%d", window, port,
                 ackup);
@@ -487,14 +791,28 @@ void Lmic::setupRx2() {
 void Lmic::schedRx12(OsDeltaTime const &delay, uint8_t dr) {
   PRINT_DEBUG_2("SchedRx RX1/2.");
 
-  // Half symbol time for the data rate.
+  // Half symbol time for the data rate (half a byte for FSK).
   OsDeltaTime hsym = regionLMic.dr2hsym(dr);
+  bool fsk = updr2rps(dr).sf == FSK;
+
+  // FSK counts bytes: wait for preamble and sync word
+  rxsyms = fsk ? RXLEN_FSK : MINRX_SYMS;
 
-  rxsyms = MINRX_SYMS;
+  // the frame is expected at txend + delay, plus the learned offset
+  rxWindowDelay = delay;
+  OsDeltaTime offset;
 
-  // If a clock error is specified, compensate for it by extending the
-  // receive window
-  if (clockError != 0) {
+  if (rxTiming.calibrated()) {
+    // open the window just wide enough for the measured jitter
+    offset = rxTiming.offset(delay);
+    OsDeltaTime margin = rxTiming.margin();
+    if ((255 - rxsyms) * hsym < margin)
+      rxsyms = 255;
+    else
+      rxsyms += margin / hsym;
+  } else if (clockError != 0) {
+    // If a clock error is specified, compensate for it by extending the
+    // receive window
     // Calculate how much the clock will drift maximally after delay has
     // passed. This indicates the amount of time we can be early
     // _or_ late.
@@ -513,14 +831,29 @@ void Lmic::schedRx12(OsDeltaTime const &delay, uint8_t dr) {
       rxsyms += drift / hsym;
   }
 
-  // Center the receive window on the center of the expected preamble
-  // (again note that hsym is half a sumbol time, so no /2 needed)
-  rxtime = txend + (delay + (PAMBL_SYMS - rxsyms) * hsym);
+  if (fsk) {
+    // Open the window PRERX_FSK bytes before the frame, plus the drift
+    rxtime = txend + (delay + offset) -
+             (2 * PRERX_FSK + rxsyms - RXLEN_FSK) * hsym;
+  } else {
+    // Center the receive window on the center of the expected preamble
+    // (again note that hsym is half a sumbol time, so no /2 needed)
+    rxtime = txend + (delay + offset + (PAMBL_SYMS - rxsyms) * hsym);
+  }
   PRINT_DEBUG_1("Rx delay : %i ms", (rxtime - txend).to_ms());
 
   osjob.setTimed(rxtime - RX_RAMPUP);
 }
 
+// Called with a valid downlink of length bytes, rxtime holds its end
+void Lmic::learnRxTiming(uint8_t length) {
+  OsTime expected = txend + rxWindowDelay;
+  OsDeltaTime error = (rxtime - calcAirTime(rps, length)) - expected;
+  rxTiming.addReception(error, rxWindowDelay);
+  PRINT_DEBUG_1("RX timing error: %li us, drift: %i ppm, jitter: %li us",
+                error.to_us(), rxTiming.drift(), rxTiming.jitter());
+}
+
 void Lmic::setupRx1() {
   txrxFlags = TXRX_DNW1;
   dataLen = 0;
@@ -596,6 +929,8 @@ bool Lmic::processJoinAccept() {
     return processJoinAcceptNoJoinFrame();
   }
 
+  learnRxTiming(dlen);
+
   uint32_t addr = rlsbf4(frame + OFF_JA_DEVADDR);
   devaddr = addr;
   netid = rlsbf4(&frame[OFF_JA_NETID]) & 0xFFFFFF;
@@ -688,6 +1023,9 @@ void Lmic::processRx1DnData() {
   if (!processDnData()) {
     osjob.setCallbackFuture(&Lmic::setupRx2DnData);
     schedRx12(rxDelay + OsDeltaTime::from_sec(DELAY_EXTDNW2), dn2Dr);
+#if ENABLE_CLASS_C
+    continuousRxUntil(&Lmic::openRx2);
+#endif
   }
 }
 
@@ -699,76 +1037,58 @@ void Lmic::setupRx1DnData() {
 void Lmic::updataDone() {
   osjob.setCallbackFuture(&Lmic::setupRx1DnData);
   txDone(rxDelay);
+#if ENABLE_CLASS_C
+  continuousRxUntil(&Lmic::openRx1);
+#endif
 }
 
 // ========================================
 
-void Lmic::buildDataFrame() {
+void Lmic::buildDataFrame(dr_t txdr) {
   bool txdata = ((opmode & (OP_TXDATA | OP_POLL)) != OP_POLL);
+  // the frame buffer no longer holds the last downlink
+  dnEncrypted = false;
 
-  // Piggyback MAC options
-  // Prioritize by importance
-  uint8_t end = OFF_DAT_OPTS;
-#if !defined(DISABLE_MCMD_DCAP_REQ)
-  if (dutyCapAns) {
-    frame[end] = MCMD_DCAP_ANS;
-    end += 1;
-    dutyCapAns = false;
+  if (timeSyncError != 0 &&
+      wallClock.error(os_getTime()) > (uint32_t)timeSyncError * 1000) {
+    requestDeviceTime();
   }
-#endif // !DISABLE_MCMD_DCAP_REQ
-#if !defined(DISABLE_MCMD_DN2P_SET)
-  // RXParamSetupAns LoRaWAN™ Specification §5.4
-  if (dn2Ans) {
-    frame[end + 0] = MCMD_DN2P_ANS;
-    frame[end + 1] = dn2Ans & ~MCMD_DN2P_ANS_RFU;
-    end += 2;
-    // dn2Ans reset when downlink packet receive
-  }
-#endif // !DISABLE_MCMD_DN2P_SET
-  // DevStatusAns LoRaWAN™ Specification §5.5
-  if (devsAns) { // answer to device status
-    frame[end + 0] = MCMD_DEVS_ANS;
-    frame[end + 1] = os_getBattLevel();
-    // TODO check margin calculation (normaly 6bit signed integer)
-    frame[end + 2] = margin;
-    end += 3;
-    devsAns = false;
-  }
-  if (ladrAns) { // answer to ADR change
-    frame[end + 0] = MCMD_LADR_ANS;
-    frame[end + 1] = ladrAns & ~MCMD_LADR_ANS_RFU;
-    end += 2;
-    ladrAns = 0;
-  }
-  if (rxTimingSetupAns) {
-    frame[end + 0] = MCMD_RXTimingSetup_ANS;
-    end += 1;
-    // rxTimingSetupAns reset when downlink packet receive
-  }
-#if !defined(DISABLE_MCMD_SNCH_REQ)
-  if (snchAns) {
-    frame[end + 0] = MCMD_SNCH_ANS;
-    frame[end + 1] = snchAns & ~MCMD_SNCH_ANS_RFU;
-    end += 2;
-    snchAns = 0;
-  }
-#endif // !DISABLE_MCMD_SNCH_REQ
-  ASSERT(end <= OFF_DAT_OPTS + 16);
 
-  uint8_t flen = end + (txdata ? 5 + pendTxLen : 4);
-  if (flen > MAX_LEN_FRAME) {
-    // Options and payload too big - delay payload
-    txdata = 0;
-    flen = end + 4;
-  }
+  uint8_t maxLen = regionLMic.maxFrameLen(txdr);
+  if (maxLen > MAX_LEN_FRAME)
+    maxLen = MAX_LEN_FRAME;
+  // room for the MAC answers after the header, the user data and the MIC
+  int16_t room = maxLen - OFF_DAT_OPTS - 4 - (txdata ? 1 + pendTxLen : 0);
+  if (room < 0)
+    room = 0;
+
+  // Without user data, answers too long for FOpts go in a port 0 payload
+  bool macPayload = !txdata && room > MAC_FOPTS_MAX + 1 &&
+                    macAnswersLength(true) > MAC_FOPTS_MAX;
+  // Piggyback MAC options, the ones which do not fit wait, user data never
+  uint8_t optsLen = 0;
+  if (!macPayload)
+    optsLen = encodeMacAnswers(frame + OFF_DAT_OPTS,
+                               room < MAC_FOPTS_MAX ? room : MAC_FOPTS_MAX);
+  uint8_t end = OFF_DAT_OPTS + optsLen;
+  uint8_t flen = end + 4;
+  txMacLen = optsLen;
+  // answers crowded out by user data are sent in a frame of their own
+  macAnsSpill = txdata && macAnswersLength(false) != 0;
+
   frame[OFF_DAT_HDR] = HDR_FTYPE_DAUP | HDR_MAJOR_V1;
   frame[OFF_DAT_FCT] =
-      (dnConf | adrEnabled | (adrAckReq >= 0 ? FCT_ADRARQ : 0) |
-       (end - OFF_DAT_OPTS));
+      (dnConf | adrEnabled | (adrAckReq >= 0 ? FCT_ADRARQ : 0) | optsLen);
+#if ENABLE_CLASS_B
+  // the network may use the ping slots
+  if ((opmode & (OP_TRACK | OP_PINGINI)) == (OP_TRACK | OP_PINGINI))
+    frame[OFF_DAT_FCT] |= FCT_CLASSB;
+#endif
   wlsbf4(frame + OFF_DAT_ADDR, devaddr);
 
   if (txCnt == 0) {
     seqnoUp += 1;
+    txAirtime = OsDeltaTime(0);
   } else {
   }
   wlsbf2(frame + OFF_DAT_SEQNO, seqnoUp - 1);
@@ -787,10 +1107,40 @@ void Lmic::buildDataFrame() {
     std::copy(pendTxData, pendTxData + pendTxLen, frame + end + 1);
     aes.framePayloadEncryption(pendTxPort, devaddr, seqnoUp - 1, DIR_UP,
                                frame + end + 1, pendTxLen);
+    flen += 1 + pendTxLen;
+  } else if (macPayload) {
+    frame[end] = 0;
+    txMacLen = encodeMacAnswers(frame + end + 1, room - 1);
+    aes.framePayloadEncryption(0, devaddr, seqnoUp - 1, DIR_UP,
+                               frame + end + 1, txMacLen);
+    flen += 1 + txMacLen;
   }
   aes.appendMic(devaddr, seqnoUp - 1, DIR_UP, frame, flen);
 
   dataLen = flen;
+  txOverhead = flen - (txdata ? pendTxLen : 0);
+}
+
+// The pending data is done, sent or not
+void Lmic::txDataDone() {
+  txDoneId = (opmode & OP_TXDATA) ? pendTxId : TXQ_NO_ID;
+  opmode &= ~OP_TXDATA;
+  releaseTxBuffer(txDoneId);
+#if TX_AGGREGATE_SIZE > 0
+  sealTxAggregate();
+#endif
+}
+
+// EV_TXCOMPLETE, and EV_FRAG_DONE after the last fragment of a session
+void Lmic::reportTxComplete() {
+#if UPLINK_FRAG_SIZE > 0
+  bool fragDone = txDoneId == TXQ_FRAG_ID && !fragSession.active();
+#endif
+  reportEvent(EV_TXCOMPLETE);
+#if UPLINK_FRAG_SIZE > 0
+  if (fragDone)
+    reportEvent(EV_FRAG_DONE);
+#endif
 }
 
 // ================================================================================
@@ -845,23 +1195,38 @@ bool Lmic::startJoining() {
 bool Lmic::processDnData() {
   ASSERT((opmode & OP_TXRXPEND) != 0);
 
-  if (!decodeFrame()) {
+  bool received = decodeFrame();
+#if MC_GROUP_COUNT > 0
+  if (received && dnGroup != MC_NO_GROUP) {
+    // not an answer to the uplink: the application gets it now, then the
+    // window goes on as an empty one, RX2 and the retries included
+    reportEvent(EV_RXCOMPLETE);
+    received = false;
+  }
+#endif
+  if (!received) {
     // first RX windows, do nothing wait for second windows.
     if ((txrxFlags & TXRX_DNW1) != 0)
       return false;
 
     // retry send if need
     if (txCnt != 0) {
-      if (txCnt < TXCONF_ATTEMPTS) {
+      linkQuality.uplinkDone(false);
+      // the ack may have been missed by a window too narrow
+      rxTiming.missed();
+      if (retryAllowed()) {
         txCnt += 1;
-        setDrTxpow(lowerDR(datarate, TABLE_GET_U1(DRADJUST, txCnt)),
-                   KEEP_TXPOW);
+        // not to a DR too slow for the data
+        if (((retryPolicy.drSteps >> (txCnt - 1)) & 1) &&
+            pendTxLen <= maxTxPayload(lowerDR(datarate, 1)))
+          setDrTxpow(lowerDR(datarate, 1), KEEP_TXPOW);
         // Schedule another retransmission
-        txDelay(rxtime, RETRY_PERIOD_secs);
+        txDelay(rxtime, retryBackoff());
         opmode &= ~OP_TXRXPEND;
         engineUpdate();
         return true;
       }
+      retryStats.failed++;
       txrxFlags = TXRX_NACK | TXRX_NOPORT;
     } else {
       // Nothing received - implies no port
@@ -872,13 +1237,40 @@ bool Lmic::processDnData() {
     dataBeg = dataLen = 0;
   }
 
-  opmode &= ~(OP_TXDATA | OP_TXRXPEND);
+  txDataDone();
+  opmode &= ~OP_TXRXPEND;
+  if (macAnsSpill && macAnswersLength(false) != 0)
+    opmode |= OP_POLL;
+  macAnsSpill = false;
+#if ENABLE_CLASS_B
+  if (bcnInfoTries > 0) {
+    // scan once the network gave the beacon timing, or ask again
+    if (!bcnTimingKnown && --bcnInfoTries > 0) {
+      queueMacRequest(MCMD_BCNI_ANS);
+      opmode |= OP_POLL;
+    } else {
+      bcnInfoTries = 0;
+      startScan();
+    }
+  }
+#endif
+  if (linkCheckSent) {
+    linkCheckSent = false;
+    if (linkCheckProbe && linkCheck.gateways == 0 && adrAckReq >= 0) {
+      // the probe went unanswered, do not wait LINK_CHECK_DEAD uplinks
+      adrAckReq = LINK_CHECK_DEAD + 1;
+    }
+    reportEvent(EV_LINK_CHECK);
+  }
+#if FUOTA_MAX_FRAGS > 0
+  reportFileDone();
+#endif
   if ((txrxFlags & (TXRX_DNW1 | TXRX_DNW2 | TXRX_PING)) != 0 &&
       (opmode & OP_LINKDEAD) != 0) {
     opmode &= ~OP_LINKDEAD;
     reportEvent(EV_LINK_ALIVE);
   }
-  reportEvent(EV_TXCOMPLETE);
+  reportTxComplete();
   // If we haven't heard from NWK in a while although we asked for a sign
   // assume link is dead - notify application and keep going
   if (adrAckReq > LINK_CHECK_DEAD) {
@@ -899,6 +1291,8 @@ bool Lmic::processDnData() {
     adrAckReq = LINK_CHECK_CONT;
     reportEvent(EV_LINK_DEAD);
   }
+  if (linkCheckProbe && adrAckReq >= 0)
+    requestLinkCheck();
   return true;
 }
 
@@ -908,6 +1302,16 @@ void Lmic::engineUpdate() {
   // Check for ongoing state: scan or TX/RX transaction
   if ((opmode & (OP_SCAN | OP_TXRXPEND | OP_SHUTDOWN)) != 0)
     return;
+#if UPLINK_QUEUE_SIZE > 0
+  // reportEvent() of an expired message went on with the next one
+  if ((opmode & OP_TXDATA) == 0 && nextQueuedTx())
+    return;
+#endif
+#if UPLINK_FRAG_SIZE > 0
+  // fragments go after the queued uplinks
+  if ((opmode & OP_TXDATA) == 0)
+    nextFragment();
+#endif
 
 #if !defined(DISABLE_JOIN)
   if (devaddr == 0 && (opmode & OP_JOINING) == 0) {
@@ -918,11 +1322,26 @@ void Lmic::engineUpdate() {
 
   OsTime now = os_getTime();
   OsTime txbeg = now;
+#if ENABLE_CLASS_B
+  // txbeg is the time of an uplink to send
+  bool txPending = false;
+#endif
 
   if ((opmode & (OP_JOINING | OP_REJOIN | OP_TXDATA | OP_POLL)) != 0) {
     // Need to TX some data...
     // Assuming txChnl points to channel which first becomes available again.
     bool jacc = ((opmode & (OP_JOINING | OP_REJOIN)) != 0 ? 1 : 0);
+    if (!jacc && (opmode & OP_TXDATA) != 0 &&
+        pendTxLen > maxTxPayload(datarate)) {
+      // the DR was lowered since the data was given
+      PRINT_DEBUG_1("Data of %d bytes too long for DR %d", pendTxLen,
+                    datarate);
+      txDataDone();
+      txrxFlags = TXRX_LENERR | TXRX_NOPORT;
+      dataBeg = dataLen = 0;
+      reportTxComplete();
+      return;
+    }
 #if LMIC_DEBUG_LEVEL > 1
     if (jacc)
       lmic_printf("%lu: Uplink join pending\n", os_getTime());
@@ -931,7 +1350,12 @@ void Lmic::engineUpdate() {
 #endif
     // Find next suitable channel and return availability time
     if ((opmode & OP_NEXTCHNL) != 0) {
+      uint8_t lastChnl = txChnl;
       txbeg = txend = regionLMic.nextTx(now, datarate, txChnl);
+      if (retryPolicy.newChannel && txCnt > 1 && txChnl == lastChnl) {
+        // the channel plan goes on with the next channel if there is one
+        txbeg = txend = regionLMic.nextTx(now, datarate, txChnl);
+      }
       opmode &= ~OP_NEXTCHNL;
       PRINT_DEBUG_2("Airtime available at %lu (channel duty limit)", txbeg);
     } else {
@@ -944,17 +1368,46 @@ void Lmic::engineUpdate() {
       txbeg = globalDutyAvail;
       PRINT_DEBUG_2("Airtime available at %lu (global duty limit)", txbeg);
     }
-    // Earliest possible time vs overhead to setup radio
-    if (txbeg - (now + TX_RAMPUP) < 0) {
+#if ENABLE_CLASS_B
+    // the transaction has to end before the beacon, else it waits for the
+    // next period, at a random time not to line up after the beacon
+    OsDeltaTime guard = jacc ? JOIN_GUARD_osticks : TXRX_GUARD_osticks;
+    if ((opmode & OP_TRACK) != 0 && txbeg + guard - bcnRxtime > 0) {
+      txDelay(bcnRxtime + BCN_RESERVE_osticks, 16);
+      goto checkrx;
+    }
+    txPending = true;
+#endif
+    // Earliest possible time vs overhead to setup radio, the job of txdelay
+    // runs at txbeg - TX_RAMPUP
+    if (txbeg - (now + TX_RAMPUP) <= 0) {
       PRINT_DEBUG_2("Ready for uplink");
+#if ENABLE_CLASS_C
+      // the uplink goes first, a frame being received is lost
+      stopContinuousRx();
+#endif
+#if UPLINK_QUEUE_SIZE > 0
+      // reportEvent() went on with the next message, if any
+      if (!jacc && expireQueuedTx(now))
+        return;
+#endif
       // We could send right now!
       txbeg = now;
       dr_t txdr = datarate;
+#if !defined(DISABLE_JOIN)
+      if ((opmode & OP_REJOIN) != 0)
+        txdr = lowerDR(txdr, rejoinCnt);
+#endif // !DISABLE_JOIN
+      if (lbtEnabled && !lbtClear && updr2rps(txdr).sf != FSK) {
+        // Listen before talk, engineUpdate is run again once done
+        startChannelActivityDetection(txdr);
+        return;
+      }
+      lbtClear = false;
 #if !defined(DISABLE_JOIN)
       if (jacc) {
         uint8_t ftype;
         if ((opmode & OP_REJOIN) != 0) {
-          txdr = lowerDR(txdr, rejoinCnt);
           ftype = HDR_FTYPE_REJOIN;
         } else {
           ftype = HDR_FTYPE_JREQ;
@@ -978,8 +1431,9 @@ void Lmic::engineUpdate() {
           osjob.setCallbackRunnable(&Lmic::runReset);
           return;
         }
-        buildDataFrame();
+        buildDataFrame(txdr);
         osjob.setCallbackFuture(&Lmic::updataDone);
+        linkQuality.setUplink(txdr, txChnl);
       }
       rps = updr2rps(txdr);
       rps.cr = errcr;
@@ -988,6 +1442,10 @@ void Lmic::engineUpdate() {
                    // txDone/setupRx1
       opmode = (opmode & ~(OP_POLL | OP_RNDTX)) | OP_TXRXPEND | OP_NEXTCHNL;
       OsDeltaTime airtime = calcAirTime(rps, dataLen);
+      if (!jacc) {
+        txAirtime += airtime;
+        txLastAirtime = airtime;
+      }
       regionLMic.updateTx(txbeg, globalDutyRate, airtime, txChnl, adrTxPow,
                           freq, txpow, globalDutyAvail);
       radio.tx(freq, rps, txpow);
@@ -1003,25 +1461,599 @@ void Lmic::engineUpdate() {
     //    txbeg += 1;  // TX delayed by one tick (insignificant amount of time)
   } else {
     // No TX pending - no scheduled RX
-    if ((opmode & OP_TRACK) == 0)
+    if ((opmode & OP_TRACK) == 0) {
+#if ENABLE_CLASS_C
+      startContinuousRx();
+#endif
       return;
+    }
   }
 
+#if ENABLE_CLASS_B
+checkrx:
+  // the next ping slot, else the beacon, unless the uplink comes first
+  if ((opmode & OP_PINGINI) != 0 && nextPingSlot(now + RX_RAMPUP)) {
+    if (txPending && txbeg - pingRxtime < 0)
+      goto txdelay;
+    osjob.setTimedCallback(pingRxtime - RX_RAMPUP, &Lmic::startRxPing);
+    return;
+  }
+  if (txPending && txbeg - bcnRxtime < 0)
+    goto txdelay;
+  osjob.setTimedCallback(bcnRxtime - RX_RAMPUP, &Lmic::startRxBeacon);
+  return;
+#endif
+
 txdelay:
+#if ENABLE_CLASS_C
+  if (classC && devaddr != 0 && (opmode & OP_TRACK) == 0) {
+    // osjob belongs to the radio, which listens until the uplink
+    txJob.setTimedCallback(txbeg - TX_RAMPUP, &Lmic::runEngineUpdate);
+    startContinuousRx();
+    return;
+  }
+#endif
   osjob.setTimedCallback(txbeg - TX_RAMPUP, &Lmic::runEngineUpdate);
 }
 
 void Lmic::setAdrMode(bool enabled) { adrEnabled = enabled ? FCT_ADREN : 0; }
 
+void Lmic::setRetryPolicy(RetryPolicy const &policy) {
+  retryPolicy = policy;
+  if (retryPolicy.attempts == 0)
+    retryPolicy.attempts = 1;
+  if (retryPolicy.attempts > RETRY_MAX_ATTEMPTS)
+    retryPolicy.attempts = RETRY_MAX_ATTEMPTS;
+}
+
+// ================================================================================
+// Listen before talk
+
+void Lmic::setLbtMode(bool enabled) { lbtEnabled = enabled; }
+
+void Lmic::startChannelActivityDetection(dr_t txdr) {
+  opmode |= OP_TXRXPEND;
+  osjob.setCallbackFuture(&Lmic::processChannelActivity);
+  radio.cad(regionLMic.getFreq(txChnl), updr2rps(txdr));
+}
+
+void Lmic::processChannelActivity() {
+  opmode &= ~OP_TXRXPEND;
+  lbtStats.cadCount++;
+  if (radio.cadDetected()) {
+    lbtStats.busyCount++;
+    if (++lbtBusy < LBT_MAX_BUSY) {
+      // Someone is talking: hop to another channel after a random backoff
+      OsDeltaTime backoff = (int16_t)(2 * (hal_rand1() % LBT_BACKOFF_SYMS)) *
+                            regionLMic.dr2hsym(datarate);
+      PRINT_DEBUG_1("Channel %d busy, backoff %i ms", txChnl, backoff.to_ms());
+      delayTxUntil(os_getTime() + backoff);
+      opmode |= OP_NEXTCHNL;
+      engineUpdate();
+      return;
+    }
+    // Channels stay busy, do not starve: send anyway
+    lbtStats.forcedCount++;
+  }
+  lbtClear = true;
+  lbtBusy = 0;
+  engineUpdate();
+}
+
+// ================================================================================
+// Class C
+
+#if ENABLE_CLASS_C
+void Lmic::setClassC(bool enabled) {
+  classC = enabled;
+  if (!enabled) {
+    stopContinuousRx();
+    txJob.clearCallback();
+  }
+#if MC_GROUP_COUNT > 0
+  scheduleMcSession();
+#endif
+  // a delayed uplink goes back to osjob, or moves to txJob
+  if (devaddr != 0)
+    engineUpdate();
+}
+
+// Listen on the RX2 parameters, or on those of a running class C multicast
+// session, until the next uplink. Nothing if the radio already listens, or
+// while class B looks for the beacon.
+void Lmic::startContinuousRx() {
+  if (!classC || devaddr == 0 || rxContinuous ||
+      (opmode & (OP_SCAN | OP_TRACK)) != 0)
+    return;
+  uint32_t rxFreq = dn2Freq;
+  dr_t dr = dn2Dr;
+#if MC_GROUP_COUNT > 0
+  uint32_t now = 0;
+  uint16_t ms;
+  bool synced = wallClock.gpsTime(os_getTime(), now, ms);
+  for (uint8_t id = 0; id < MC_GROUP_COUNT; id++) {
+    McGroup const &group = mcGroups[id];
+    // without the time, the session runs from its setup
+    if (group.defined && group.sessionClass == 'C' &&
+        (!synced || group.timeout == MC_TIMEOUT_NONE ||
+         now - group.sessionTime < (1UL << group.timeout))) {
+      rxFreq = group.freq;
+      dr = group.dr;
+      break;
+    }
+  }
+#endif
+  rxContinuous = true;
+  // freq and rps keep the parameters of the next RX window
+  PRINT_DEBUG_2("Continuous RX on %lu", rxFreq);
+  osjob.clearCallback();
+  osjob.setCallbackFuture(&Lmic::processContinuousRx);
+  radio.rxon(rxFreq, dndr2rps(dr), rxsyms, os_getTime());
+}
+
+#if MC_GROUP_COUNT > 0
+// Wake at the next start or end of a class C multicast session, for the
+// continuous RX to move to its channel or back. Without the time a session
+// runs from its setup, there is nothing to wait for.
+void Lmic::scheduleMcSession() {
+  mcSessionJob.clearCallback();
+  uint32_t now;
+  uint16_t ms;
+  if (!classC || !wallClock.gpsTime(os_getTime(), now, ms))
+    return;
+  uint32_t next = 0;
+  for (uint8_t id = 0; id < MC_GROUP_COUNT; id++) {
+    McGroup const &group = mcGroups[id];
+    if (!group.defined || group.sessionClass != 'C' ||
+        group.timeout == MC_TIMEOUT_NONE)
+      continue;
+    uint32_t since = now - group.sessionTime;
+    uint32_t wait;
+    if ((int32_t)since < 0)
+      wait = -since;
+    else if (since < (1UL << group.timeout))
+      wait = (1UL << group.timeout) - since;
+    else
+      continue;
+    if (next == 0 || wait < next)
+      next = wait;
+  }
+  if (next == 0)
+    return;
+  // OsTime spans less than a long session, a later edge is looked for again
+  if (next > WCLK_REBASE_PERIOD)
+    next = WCLK_REBASE_PERIOD;
+  mcSessionJob.setTimedCallback(os_getTime() + OsDeltaTime::from_sec(next) -
+                                    OsDeltaTime::from_ms(ms),
+                                &Lmic::runMcSession);
+}
+
+void Lmic::runMcSession() {
+  // the next startContinuousRx() picks the session if the radio is busy
+  if (rxContinuous) {
+    stopContinuousRx();
+    startContinuousRx();
+  }
+  scheduleMcSession();
+}
+#endif
+
+// Listen from the end of the uplink to its RX window, and between RX1 and
+// RX2: the timer of the window set on osjob moves to txJob
+void Lmic::continuousRxUntil(void (Lmic::*window)()) {
+  startContinuousRx();
+  if (rxContinuous)
+    txJob.setTimedCallback(rxtime - RX_RAMPUP, window);
+}
+
+void Lmic::openRx1() {
+  stopContinuousRx();
+  setupRx1DnData();
+}
+
+void Lmic::openRx2() {
+  stopContinuousRx();
+  setupRx2DnData();
+}
+
+// Leave the continuous RX to use the radio
+void Lmic::stopContinuousRx() {
+  if (!rxContinuous)
+    return;
+  rxContinuous = false;
+  // a frame received but not processed yet is dropped
+  osjob.clearCallback();
+  radio.standby();
+}
+
+// Frame of the continuous RX, the radio sleeps since
+void Lmic::processContinuousRx() {
+  rxContinuous = false;
+  // the uplink waits for its RX window, txJob opens it
+  bool const waiting = (opmode & OP_TXRXPEND) != 0;
+  txrxFlags = 0;
+  if (decodeFrame()) {
+    reportEvent(EV_RXCOMPLETE);
+#if FUOTA_MAX_FRAGS > 0
+    reportFileDone();
+#endif
+    // an uplink started since (answer of a confirmed frame) has the radio
+    if (waiting && (opmode & OP_TXRXPEND) != 0)
+      startContinuousRx();
+  } else if (waiting) {
+    startContinuousRx();
+  } else {
+    // listen again
+    engineUpdate();
+  }
+}
+#endif // ENABLE_CLASS_C
+
+// ================================================================================
+// Class B
+
+#if ENABLE_CLASS_B
+// CRC-16/XMODEM of the fields of a beacon
+static uint16_t beaconCrc(const uint8_t *buf, uint8_t len) {
+  uint16_t crc = 0;
+  for (uint8_t i = 0; i < len; i++) {
+    crc ^= (uint16_t)buf[i] << 8;
+    for (uint8_t k = 0; k < 8; k++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+// Largest drift of the clock over span, before the beacon period is known
+static OsDeltaTime beaconDrift(OsDeltaTime const &span) {
+  return OsDeltaTime::from_us((int64_t)span.to_ms() * BCN_CLOCK_PPM / 1000);
+}
+
+bool Lmic::enableTracking(uint8_t tryBcnInfo) {
+  if (devaddr == 0 || bcnInfoTries != 0 ||
+      (opmode & (OP_SCAN | OP_TRACK | OP_JOINING | OP_TXRXPEND |
+                 OP_SHUTDOWN)) != 0)
+    return false;
+#if ENABLE_CLASS_C
+  if (classC)
+    return false;
+#endif
+  bcnTimingKnown = false;
+  if (tryBcnInfo == 0) {
+    startScan();
+    return true;
+  }
+  // the scan starts at the end of a transaction, see processDnData()
+  bcnInfoTries = tryBcnInfo;
+  queueMacRequest(MCMD_BCNI_ANS);
+  opmode |= OP_POLL;
+  engineUpdate();
+  return true;
+}
+
+void Lmic::disableTracking() {
+  bcnInfoTries = 0;
+  opmode &= ~(OP_SCAN | OP_TRACK);
+  if ((opmode & OP_TXRXPEND) == 0) {
+    // the scan, or the timer of a beacon or ping slot window
+    osjob.clearCallback();
+    radio.sleep();
+  }
+  engineUpdate();
+}
+
+void Lmic::setPingable(uint8_t periodicity) {
+  pingExp = periodicity & 0x07;
+  opmode = (opmode | OP_PINGABLE) & ~OP_PINGINI;
+  queueMacRequest(MCMD_PING_INFO_ANS);
+  opmode |= OP_POLL;
+  if ((opmode & (OP_SCAN | OP_TRACK)) != 0 || bcnInfoTries != 0 ||
+      !enableTracking(0))
+    engineUpdate();
+}
+
+void Lmic::stopPingable() {
+  opmode &= ~(OP_PINGABLE | OP_PINGINI);
+  if ((opmode & (OP_TRACK | OP_TXRXPEND)) == OP_TRACK) {
+    // a ping slot may be scheduled
+    osjob.clearCallback();
+    engineUpdate();
+  }
+}
+
+// Look for the beacon around the time given by BeaconTimingAns or by the
+// wall clock, else for as many beacon periods as there are beacon channels
+void Lmic::startScan() {
+  OsTime now = os_getTime();
+  OsTime from = now;
+  bcnRxtime = now + (int16_t)BCN_CHNL_COUNT * BCN_INTV_osticks +
+              AIRTIME_BCN_osticks;
+  // GPS time of the beacon expected, for its channel
+  uint32_t time = 0;
+  uint32_t gps;
+  uint16_t ms;
+  if (bcnTimingKnown) {
+    // within the slot of MCMD_BCNI_TUNIT given, the channel is the one of
+    // a period of its number
+    OsTime start = bcnTimingStart;
+    time = (uint32_t)bcnTimingChnl * BCN_INTV_sec;
+    if (start - now < 0) {
+      // missed, the next one
+      start += BCN_INTV_osticks;
+      time += BCN_INTV_sec;
+    }
+    OsDeltaTime drift = beaconDrift(start - now);
+    from = start - drift;
+    bcnRxtime = start + OsDeltaTime::from_ms(MCMD_BCNI_TUNIT) + drift +
+                AIRTIME_BCN_osticks;
+  } else if (wallClock.gpsTime(now, gps, ms) &&
+             wallClock.error(now) < BCN_INTV_us / 2) {
+    time = gps - gps % BCN_INTV_sec + BCN_INTV_sec;
+    OsTime start = now + OsDeltaTime::from_ms((time - gps) * 1000 - ms) +
+                   BCN_DELAY_osticks;
+    OsDeltaTime error =
+        OsDeltaTime::from_us(wallClock.error(now)) + beaconDrift(start - now);
+    from = start - error;
+    bcnRxtime = start + error + AIRTIME_BCN_osticks;
+  }
+  if (from - now < 0)
+    from = now;
+  bcnTimingKnown = false;
+  freq = beaconFreq(time);
+  rps = dndr2rps(DR_BCN);
+  rps.ih = LEN_BCN;
+  opmode = (opmode | OP_SCAN) & ~OP_TRACK;
+  PRINT_DEBUG_1("Beacon scan on %lu until %lu", freq, bcnRxtime.tick());
+  osjob.setTimedCallback(from, &Lmic::startScanRx);
+}
+
+// Listen until the end of the scan, in bcnRxtime
+void Lmic::startScanRx() {
+  // the frame buffer no longer holds the last downlink
+  dnEncrypted = false;
+  dataLen = 0;
+  osjob.setTimedCallback(bcnRxtime, &Lmic::processScan);
+  radio.rxon(freq, rps, MINRX_SYMS, os_getTime());
+}
+
+// Frame of the scan, or its end
+void Lmic::processScan() {
+  BeaconInfo info = bcnInfo;
+  bool found = decodeBeacon(info);
+  // the beacon is not a downlink for readDownlink()
+  dataLen = 0;
+  if (found) {
+    bcnInfo = info;
+    opmode = (opmode & ~OP_SCAN) | OP_TRACK;
+    syncBeacon();
+    scheduleBeacon();
+    if (opmode & OP_PINGINI)
+      startPingSlots();
+    reportEvent(EV_BEACON_FOUND);
+    return;
+  }
+  if (os_getTime() - bcnRxtime < 0) {
+    // another frame
+    startScanRx();
+    return;
+  }
+  radio.sleep();
+  opmode &= ~OP_SCAN;
+  reportEvent(EV_SCAN_TIMEOUT);
+}
+
+// Beacon of the frame buffer into info, false if it is not one
+bool Lmic::decodeBeacon(BeaconInfo &info) const {
+  const uint8_t *d = frame;
+  if (dataLen != LEN_BCN ||
+      rlsbf2(&d[OFF_BCN_CRC1]) != beaconCrc(d, OFF_BCN_CRC1))
+    return false;
+  uint32_t time = rlsbf4(&d[OFF_BCN_TIME]);
+  if (time % BCN_INTV_sec != 0)
+    return false;
+  info.time = time;
+  // rxtime is the end of the beacon
+  info.start = rxtime - AIRTIME_BCN_osticks - BCN_DELAY_osticks;
+  info.rssi = rssi - RSSI_OFF;
+  info.snr = snr;
+  info.flags = BCN_PARTIAL;
+  if (rlsbf2(&d[OFF_BCN_CRC2]) ==
+      beaconCrc(&d[OFF_BCN_INFO], OFF_BCN_CRC2 - OFF_BCN_INFO)) {
+    info.info = d[OFF_BCN_INFO];
+    // 24 bits signed
+    info.lat = (int32_t)(rlsbf3(&d[OFF_BCN_LAT]) << 8) >> 8;
+    info.lon = (int32_t)(rlsbf3(&d[OFF_BCN_LON]) << 8) >> 8;
+    info.flags |= BCN_FULL;
+  }
+  return true;
+}
+
+// The length of the period is measured again from the beacon of bcnInfo
+void Lmic::syncBeacon() {
+  bcnPeriod = BCN_INTV_osticks;
+  bcnPeriodError = beaconDrift(BCN_INTV_osticks);
+  missedBcns = 0;
+}
+
+// Window of the beacon after the one of bcnInfo, false if too wide to keep
+// tracking
+bool Lmic::scheduleBeacon() {
+  OsDeltaTime error;
+  OsTime start =
+      beaconPeriodTime(BCN_INTV_osticks + BCN_DELAY_osticks, error);
+  rxWindow(start, error, DR_BCN, bcnRxtime, bcnRxsyms);
+  return bcnRxsyms <= MAX_RXSYMS && missedBcns <= MAX_MISSED_BCNS;
+}
+
+void Lmic::startRxBeacon() {
+  opmode |= OP_TXRXPEND;
+  // the frame buffer no longer holds the last downlink
+  dnEncrypted = false;
+  dataLen = 0;
+  freq = beaconFreq(bcnInfo.time + BCN_INTV_sec);
+  rps = dndr2rps(DR_BCN);
+  rps.ih = LEN_BCN;
+  osjob.setCallbackFuture(&Lmic::processBeacon);
+  radio.rx(freq, rps, bcnRxsyms, bcnRxtime);
+}
+
+// End of the beacon window: the beacon received corrects the length of the
+// period, a beacon missed widens the next window
+void Lmic::processBeacon() {
+  opmode &= ~OP_TXRXPEND;
+  BeaconInfo info = bcnInfo;
+  bool received = decodeBeacon(info);
+  // the beacon is not a downlink for readDownlink()
+  dataLen = 0;
+  if ((opmode & OP_TRACK) == 0) {
+    // stopped during the window
+    engineUpdate();
+    return;
+  }
+  OsTime expected = bcnInfo.start + bcnPeriod;
+  uint32_t time = bcnInfo.time + BCN_INTV_sec;
+  ev_t ev = EV_BEACON_TRACKED;
+  if (received && info.time == time) {
+    // the error of the prediction, shared by the periods since the last
+    // beacon received
+    int32_t error = (info.start - expected).tick() / (missedBcns + 1);
+    bcnPeriod += OsDeltaTime(error);
+    bcnPeriodError = OsDeltaTime(
+        (bcnPeriodError.tick() + (error < 0 ? -error : error)) / 2);
+    OsDeltaTime floor =
+        OsDeltaTime::from_us((int32_t)BCN_INTV_sec * BCN_MIN_PPM);
+    if (bcnPeriodError < floor)
+      bcnPeriodError = floor;
+    missedBcns = 0;
+    bcnInfo = info;
+  } else if (received) {
+    // the network time jumped, the period is measured again
+    bcnInfo = info;
+    syncBeacon();
+  } else {
+    bcnInfo.start = expected;
+    bcnInfo.time = time;
+    bcnInfo.flags = 0;
+    missedBcns++;
+    ev = EV_BEACON_MISSED;
+  }
+  if (!scheduleBeacon()) {
+    PRINT_DEBUG_1("Beacon lost after %d missed", missedBcns);
+    opmode &= ~OP_TRACK;
+    reportEvent(EV_LOST_TSYNC);
+    return;
+  }
+  if (opmode & OP_PINGINI)
+    startPingSlots();
+  reportEvent(ev);
+}
+
+// Ping slots of the beacon period of bcnInfo
+void Lmic::startPingSlots() {
+  pingOffset = Aes::pingOffset(bcnInfo.time, devaddr, (uint16_t)32 << pingExp);
+  pingIndex = 0;
+}
+
+// Window of the next ping slot not before cando, false if none is left in
+// the beacon period
+bool Lmic::nextPingSlot(OsTime const &cando) {
+  uint16_t period = (uint16_t)32 << pingExp;
+  while (pingIndex < (128 >> pingExp)) {
+    int16_t slot = pingOffset + pingIndex * period;
+    OsDeltaTime error;
+    OsTime time = beaconPeriodTime(
+        BCN_RESERVE_osticks + slot * BCN_SLOT_SPAN_osticks, error);
+    rxWindow(time, error, pingDr, pingRxtime, pingRxsyms);
+    if (pingRxtime - cando >= 0)
+      return true;
+    pingIndex++;
+  }
+  return false;
+}
+
+void Lmic::startRxPing() {
+  opmode |= OP_TXRXPEND;
+  txrxFlags = TXRX_PING;
+  dataLen = 0;
+  freq = pingChFreq != 0 ? pingChFreq
+                         : regionLMic.pingFreq(bcnInfo.time, devaddr);
+  rps = dndr2rps(pingDr);
+  osjob.setCallbackFuture(&Lmic::processPing);
+  radio.rx(freq, rps, pingRxsyms, pingRxtime);
+}
+
+// End of a ping slot window
+void Lmic::processPing() {
+  opmode &= ~OP_TXRXPEND;
+  if (decodeFrame()) {
+    reportEvent(EV_RXCOMPLETE);
+#if FUOTA_MAX_FRAGS > 0
+    reportFileDone();
+#endif
+  } else {
+    // the next slot
+    engineUpdate();
+  }
+}
+
+// Local time of offset into the beacon period of bcnInfo, at the length of
+// period measured. error gets the uncertainty of the prediction.
+OsTime Lmic::beaconPeriodTime(OsDeltaTime const &offset,
+                              OsDeltaTime &error) const {
+  int32_t intv = BCN_INTV_osticks.tick();
+  int32_t ticks = offset.tick();
+  error = OsDeltaTime((int64_t)bcnPeriodError.tick() *
+                      (ticks + (int64_t)missedBcns * intv) / intv);
+  return bcnInfo.start +
+         OsDeltaTime(ticks + (int64_t)ticks * (bcnPeriod.tick() - intv) / intv);
+}
+
+// Window of a frame starting at time within error, as schedRx12() does
+void Lmic::rxWindow(OsTime const &time, OsDeltaTime const &error, dr_t dr,
+                    OsTime &start, uint8_t &syms) const {
+  OsDeltaTime hsym = regionLMic.dr2hsym(dr);
+  syms = MINRX_SYMS;
+  if ((255 - syms) * hsym < error)
+    syms = 255;
+  else
+    syms += error / hsym;
+  start = time + (PAMBL_SYMS - syms) * hsym;
+}
+
+// Beacon channel of the period at time, unless the network set one
+uint32_t Lmic::beaconFreq(uint32_t time) const {
+  return bcnChFreq != 0 ? bcnChFreq : regionLMic.beaconFreq(time);
+}
+#endif // ENABLE_CLASS_B
+
 void Lmic::shutdown() {
   osjob.clearCallback();
-  radio.rst();
+  radio.sleep();
+#if ENABLE_CLASS_C
+  rxContinuous = false;
+  txJob.clearCallback();
+#if MC_GROUP_COUNT > 0
+  mcSessionJob.clearCallback();
+#endif
+#endif
   opmode |= OP_SHUTDOWN;
 }
 
 void Lmic::reset() {
-  radio.rst();
+  radio.sleep();
   osjob.clearCallback();
+#if ENABLE_CLASS_C
+  rxContinuous = false;
+  txJob.clearCallback();
+#if MC_GROUP_COUNT > 0
+  mcSessionJob.clearCallback();
+#endif
+#endif
+#if ENABLE_CLASS_B
+  bcnInfoTries = 0;
+  bcnTimingKnown = false;
+#endif
   rps.rawValue = 0;
   devaddr = 0;
   devNonce = hal_rand2();
@@ -1033,6 +2065,28 @@ void Lmic::reset() {
   rxDelay = OsDeltaTime::from_sec(DELAY_DNW1);
 
   regionLMic.initDefaultChannels(true);
+  linkQuality.reset();
+  rxTiming.reset();
+  lbtClear = false;
+  lbtBusy = 0;
+#if UPLINK_QUEUE_SIZE > 0
+  txQueue.clear();
+#endif
+#if UPLINK_FRAG_SIZE > 0
+  fragSession.stop();
+#endif
+#if TX_AGGREGATE_SIZE > 0
+  txAggregate.clear();
+  aggregateJob.clearCallback();
+  aggregateId = TXQ_NO_ID;
+  aggregateDue = false;
+#endif
+#if APP_PACKAGES
+  pkgAnsId = TXQ_NO_ID;
+#endif
+#if MC_GROUP_COUNT > 0
+  std::fill(mcGroups, mcGroups + MC_GROUP_COUNT, McGroup{});
+#endif
 }
 
 void Lmic::init(void) {
@@ -1042,12 +2096,19 @@ void Lmic::init(void) {
 }
 
 void Lmic::clrTxData(void) {
+  if (opmode & OP_TXDATA)
+    releaseTxBuffer(pendTxId);
   opmode &= ~(OP_TXDATA | OP_TXRXPEND | OP_POLL);
   pendTxLen = 0;
   if ((opmode & (OP_JOINING | OP_SCAN)) != 0) // do not interfere with JOINING
     return;
   osjob.clearCallback();
-  radio.rst();
+  radio.sleep();
+#if ENABLE_CLASS_C
+  rxContinuous = false;
+  // the RX window of the uplink is not opened
+  txJob.clearCallback();
+#endif
   engineUpdate();
 }
 
@@ -1059,19 +2120,522 @@ void Lmic::setTxData(void) {
 }
 
 //
-int8_t Lmic::setTxData2(uint8_t port, uint8_t *data, uint8_t dlen,
+int8_t Lmic::setTxData2(uint8_t port, const uint8_t *data, uint8_t dlen,
                         bool confirmed) {
-  if (dlen > sizeof(pendTxData))
+  // a queued message taken by the MAC is sent first, it has its own event
+  if ((opmode & OP_TXDATA) != 0 && pendTxId != TXQ_NO_ID)
+    return -1;
+  if (dlen > maxTxPayload(datarate))
     return -2;
+  // without data, the buffer of the previous call is sent again
   if (data)
-    std::copy(data, data + dlen, pendTxData);
+    pendTxData = data;
+  if (!pendTxData && dlen != 0)
+    return -2;
   pendTxConf = confirmed;
   pendTxPort = port;
   pendTxLen = dlen;
+  pendTxId = TXQ_NO_ID;
   setTxData();
   return 0;
 }
 
+#if UPLINK_QUEUE_SIZE > 0
+int8_t Lmic::queueTxData(uint8_t port, const uint8_t *data, uint8_t dlen,
+                         bool confirmed, uint8_t priority,
+                         OsDeltaTime const &lifetime) {
+  int8_t id = pushTxQueue(port, data, dlen, confirmed, priority, lifetime);
+  if (id >= 0)
+    engineUpdate();
+  return id;
+}
+
+int8_t Lmic::pushTxQueue(uint8_t port, const uint8_t *data, uint8_t dlen,
+                         bool confirmed, uint8_t priority,
+                         OsDeltaTime const &lifetime) {
+  if (dlen > maxTxPayload(datarate) || (!data && dlen != 0))
+    return -2;
+  OsTime now = os_getTime();
+  UplinkMessage msg;
+  msg.data = data;
+  msg.queued = now;
+  msg.deadline = now + lifetime;
+  msg.length = dlen;
+  msg.port = port;
+  msg.priority = priority;
+  msg.id = txQueueId;
+  msg.confirmed = confirmed;
+  msg.expires = lifetime.tick() != 0;
+  if (!txQueue.push(msg))
+    return -1;
+  // ids stay positive, TXQ_NO_ID is never given
+  txQueueId = (txQueueId + 1) & 0x7F;
+  return msg.id;
+}
+
+// Take the next queued uplink as the pending data. A message which expired
+// in the queue is reported instead, true then.
+bool Lmic::nextQueuedTx() {
+  UplinkMessage msg;
+  if (txQueue.popExpired(os_getTime(), msg)) {
+    PRINT_DEBUG_1("Uplink %d expired in the queue", msg.id);
+    txDoneId = msg.id;
+    releaseTxBuffer(txDoneId);
+#if TX_AGGREGATE_SIZE > 0
+    sealTxAggregate();
+#endif
+    reportEvent(EV_TXEXPIRED);
+    return true;
+  }
+  if (!txQueue.pop(msg))
+    return false;
+  pendTxData = msg.data;
+  pendTxConf = msg.confirmed;
+  pendTxPort = msg.port;
+  pendTxLen = msg.length;
+  pendTxId = msg.id;
+  pendTxDeadline = msg.deadline;
+  pendTxExpires = msg.expires;
+  opmode |= OP_TXDATA;
+  if ((opmode & OP_JOINING) == 0)
+    txCnt = 0;
+  return false;
+}
+
+// Drop the queued data which waited for the duty cycle past its deadline,
+// the retries of data already sent go on
+bool Lmic::expireQueuedTx(OsTime const &now) {
+  if ((opmode & OP_TXDATA) == 0 || txCnt != 0 || pendTxId >= TXQ_FRAG_ID ||
+      !pendTxExpires || now - pendTxDeadline < 0)
+    return false;
+  PRINT_DEBUG_1("Uplink %d expired", pendTxId);
+  txQueue.countExpired();
+  txDataDone();
+  reportEvent(EV_TXEXPIRED);
+  return true;
+}
+#endif
+
+#if UPLINK_FRAG_SIZE > 0
+int8_t Lmic::sendFragmented(uint8_t port, const uint8_t *buf, uint16_t len,
+                            uint8_t lossPercent) {
+  if (fragSession.active())
+    return -1;
+  // fragments sized for the current DR
+  uint8_t fragLen = maxTxPayload(datarate);
+  if (fragLen <= FRAG_HEADER_LEN || lossPercent >= 100)
+    return -2;
+  fragLen -= FRAG_HEADER_LEN;
+  if (fragLen > UPLINK_FRAG_SIZE)
+    fragLen = UPLINK_FRAG_SIZE;
+  uint32_t frags = ((uint32_t)len + fragLen - 1) / fragLen;
+  uint32_t parity = 0;
+  if (lossPercent != 0) {
+    // the lost share of all fragments, with a margin for the spread of the
+    // losses and for the rows of the code which are not independent
+    parity = (frags * lossPercent + 99 - lossPercent) / (100 - lossPercent) +
+             frags / 4 + 4;
+  }
+  if (frags + parity > FRAG_MAX_NUMBER ||
+      !fragSession.start(buf, len, fragLen, parity, fragIndex))
+    return -2;
+  fragPort = port;
+  fragIndex++;
+  engineUpdate();
+  return 0;
+}
+
+// Take the next fragment as the pending data
+void Lmic::nextFragment() {
+  if (!fragSession.active())
+    return;
+  pendTxLen = fragSession.build();
+  pendTxData = fragSession.fragment();
+  pendTxConf = false;
+  pendTxPort = fragPort;
+  pendTxId = TXQ_FRAG_ID;
+  opmode |= OP_TXDATA;
+  if ((opmode & OP_JOINING) == 0)
+    txCnt = 0;
+}
+#endif
+
+#if TX_AGGREGATE_SIZE > 0
+void Lmic::setAggregation(uint8_t port, OsDeltaTime const &latency) {
+  aggregatePort = port;
+  aggregateLatency = latency;
+}
+
+int8_t Lmic::aggregateTxData(uint8_t source, const uint8_t *data,
+                             uint8_t dlen) {
+  uint8_t maxLen = aggregateMaxLen();
+  if (source > AGG_SOURCE_MAX || dlen > AGG_RECORD_MAX || 1 + dlen > maxLen)
+    return -2;
+  if (txAggregate.pending() + 1 + dlen > maxLen) {
+    // the open payload is complete without this record
+    aggregateDue = true;
+    sealTxAggregate();
+  }
+  bool first = txAggregate.pending() == 0;
+  if (!txAggregate.add(source, data, dlen))
+    return -1;
+  if (first)
+    aggregateJob.setTimedCallback(os_getTime() + aggregateLatency,
+                                  &Lmic::flushTxData);
+  // no room left for another record
+  if (txAggregate.pending() + 2 > maxLen)
+    aggregateDue = true;
+  sealTxAggregate();
+  engineUpdate();
+  return 0;
+}
+
+void Lmic::flushTxData() {
+  aggregateDue = txAggregate.pending() != 0;
+  sealTxAggregate();
+  engineUpdate();
+}
+
+// Largest aggregated payload at the current DR
+uint8_t Lmic::aggregateMaxLen() const {
+  uint8_t maxLen = maxTxPayload(datarate);
+  return maxLen < TX_AGGREGATE_SIZE ? maxLen : TX_AGGREGATE_SIZE;
+}
+
+// Queue the open records as a payload, if due and the last one is sent
+void Lmic::sealTxAggregate() {
+  if (!aggregateDue || txAggregate.sealed() ||
+      txQueue.depth() == UPLINK_QUEUE_SIZE)
+    return;
+  uint8_t len = txAggregate.seal(aggregateMaxLen());
+  if (len != 0) {
+    int8_t id = pushTxQueue(aggregatePort, txAggregate.payload(), len, false,
+                            0, OsDeltaTime(0));
+    if (id >= 0) {
+      aggregateId = id;
+    } else {
+      // never sent, the records are lost rather than blocking the buffer
+      PRINT_DEBUG_1("Aggregated payload of %d bytes not queued", len);
+      txAggregate.release();
+    }
+  }
+  // records left over by a lower DR follow right after
+  aggregateDue = txAggregate.pending() != 0;
+}
+#endif
+
+// The uplink of the given id is done or dropped, its buffer is free again
+void Lmic::releaseTxBuffer(uint8_t id) {
+#if TX_AGGREGATE_SIZE > 0
+  if (txAggregate.sealed() && id == aggregateId) {
+    txAggregate.release();
+    aggregateId = TXQ_NO_ID;
+  }
+#endif
+#if APP_PACKAGES
+  if (id == pkgAnsId)
+    pkgAnsId = TXQ_NO_ID;
+#endif
+}
+
+#if APP_PACKAGES
+bool Lmic::isPackagePort(uint8_t port) const {
+#if FUOTA_MAX_FRAGS > 0
+  if (port == FRAG_PORT)
+    return true;
+#endif
+#if MC_GROUP_COUNT > 0
+  if (port == MC_SETUP_PORT)
+    return true;
+#endif
+  return false;
+}
+
+// Commands of an application package, decrypted. The answers go up on the
+// same port, dropped if those of the last package downlink are not sent.
+void Lmic::receivePackage(uint8_t port, uint8_t *buf, uint8_t len) {
+  // answers are unconfirmed, their uplink is over once a downlink comes
+  if (pkgAnsId == pendTxId && (opmode & OP_TXDATA))
+    pkgAnsId = TXQ_NO_ID;
+  uint8_t room = pkgAnsId == TXQ_NO_ID ? PKG_ANS_LEN : 0;
+  uint8_t ansLen = 0;
+#if FUOTA_MAX_FRAGS > 0
+  if (port == FRAG_PORT) {
+    bool receiving = fragReceiver.state() == FRAG_RECEIVING;
+    ansLen = fragReceiver.receive(buf, len, pkgAns, room);
+    FragState state = fragReceiver.state();
+    if (receiving && (state == FRAG_VERIFIED || state == FRAG_CORRUPTED))
+      fileDone = true;
+  }
+#endif
+#if MC_GROUP_COUNT > 0
+  if (port == MC_SETUP_PORT)
+    ansLen = receiveMcSetup(buf, len, pkgAns, room);
+#endif
+  if (ansLen != 0) {
+    int8_t id = pushTxQueue(port, pkgAns, ansLen, false, 0, OsDeltaTime(0));
+    pkgAnsId = id >= 0 ? id : TXQ_NO_ID;
+  }
+}
+#endif
+
+#if FUOTA_MAX_FRAGS > 0
+// EV_UPDATE_READY or EV_UPDATE_FAILED once the file of the session is done
+void Lmic::reportFileDone() {
+  if (!fileDone)
+    return;
+  fileDone = false;
+  reportEvent(fragReceiver.state() == FRAG_VERIFIED ? EV_UPDATE_READY
+                                                    : EV_UPDATE_FAILED);
+}
+
+bool Lmic::installUpdate() {
+  if (fragReceiver.state() != FRAG_VERIFIED)
+    return false;
+  hal_storage_install(fragReceiver.fileLength());
+  return true;
+}
+#endif
+
+#if MC_GROUP_COUNT > 0
+// Remote multicast setup package, return the length of the answers
+uint8_t Lmic::receiveMcSetup(const uint8_t *buf, uint8_t len, uint8_t *ans,
+                             uint8_t room) {
+  uint8_t ansLen = 0;
+  uint8_t i = 0;
+  while (i < len) {
+    uint8_t cid = buf[i];
+    uint8_t cmdLen;
+    if (cid == MC_PACKAGE_VERSION) {
+      cmdLen = 1;
+    } else if (cid == MC_GROUP_STATUS || cid == MC_GROUP_DELETE) {
+      cmdLen = 2;
+    } else if (cid == MC_GROUP_SETUP) {
+      cmdLen = 30;
+    } else if (cid == MC_CLASS_C_SESSION || cid == MC_CLASS_B_SESSION) {
+      cmdLen = 11;
+    } else {
+      // unknown command, the rest cannot be parsed
+      break;
+    }
+    if (len - i < cmdLen)
+      break;
+
+    const uint8_t *cmd = buf + i + 1;
+    uint8_t out[2 + 5 * MC_GROUP_COUNT];
+    uint8_t outLen = 2;
+    out[0] = cid;
+    if (cid == MC_PACKAGE_VERSION) {
+      // package identifier and version
+      out[1] = 2;
+      out[2] = 1;
+      outLen = 3;
+    } else if (cid == MC_GROUP_STATUS) {
+      uint8_t total = 0;
+      uint8_t found = 0;
+      for (uint8_t id = 0; id < MC_GROUP_COUNT; id++) {
+        if (!mcGroups[id].defined)
+          continue;
+        total++;
+        if (cmd[0] & (1 << id)) {
+          found |= 1 << id;
+          out[outLen] = id;
+          wlsbf4(out + outLen + 1, mcGroups[id].addr);
+          outLen += 5;
+        }
+      }
+      out[1] = (total << 4) | found;
+    } else if (cid == MC_GROUP_SETUP) {
+      uint8_t id = cmd[0] & 0x03;
+      out[1] = id;
+      if (id >= MC_GROUP_COUNT) {
+        out[1] |= 0x04;
+      } else {
+        McGroup &group = mcGroups[id];
+        group.addr = rlsbf4(cmd + 1);
+        aes.multicastKeys(cmd + 5, group.addr, group.nwkSKey, group.appSKey);
+        group.minFCnt = rlsbf4(cmd + 21);
+        group.maxFCnt = rlsbf4(cmd + 25);
+        group.seqnoDn = group.minFCnt;
+        group.sessionClass = 0;
+        group.defined = true;
+        PRINT_DEBUG_1("Multicast group %d, address %lx", id, group.addr);
+      }
+    } else if (cid == MC_GROUP_DELETE) {
+      uint8_t id = cmd[0] & 0x03;
+      out[1] = id;
+      if (id >= MC_GROUP_COUNT || !mcGroups[id].defined) {
+        out[1] |= 0x04;
+      } else {
+        mcGroups[id].defined = false;
+        mcGroups[id].sessionClass = 0;
+      }
+    } else {
+      outLen = 1 + mcSession(cmd, cid == MC_CLASS_C_SESSION ? 'C' : 'B',
+                             out + 1);
+    }
+    if (room - ansLen >= outLen) {
+      std::copy(out, out + outLen, ans + ansLen);
+      ansLen += outLen;
+    }
+    i += cmdLen;
+  }
+  return ansLen;
+}
+
+// Downlink of the multicast group id in the frame: unconfirmed, without
+// MAC commands nor ack, checked with the keys and counter of the group.
+// It leaves the state of the device address alone.
+bool Lmic::decodeMulticast(uint8_t id) {
+  McGroup &group = mcGroups[id];
+  uint8_t *d = frame;
+  uint8_t dlen = dataLen;
+  uint8_t poff = OFF_DAT_OPTS;
+  uint8_t pend = dlen - MIC_LEN;
+  uint32_t seqno = rlsbf2(&d[OFF_DAT_SEQNO]);
+  seqno = group.seqnoDn + (uint16_t)(seqno - group.seqnoDn);
+  if ((d[0] & HDR_FTYPE) != HDR_FTYPE_DADN ||
+      (d[OFF_DAT_FCT] & (FCT_OPTLEN | FCT_ACK)) != 0 || pend <= poff ||
+      d[poff] == 0 || seqno < group.seqnoDn || seqno > group.maxFCnt ||
+      !Aes::verifyMicWithKey(group.nwkSKey, group.addr, seqno, DIR_DOWN, d,
+                             dlen)) {
+    PRINT_DEBUG_1("Invalid multicast downlink, group %d", id);
+    dataLen = 0;
+    return false;
+  }
+  group.seqnoDn = seqno + 1;
+  dnGroup = id;
+  uint8_t port = d[poff++];
+  txrxFlags |= TXRX_PORT;
+  dataBeg = poff;
+  dataLen = pend - poff;
+#if APP_PACKAGES
+  if (isPackagePort(port)) {
+    Aes::framePayloadEncryptionWithKey(group.appSKey, group.addr, seqno,
+                                       DIR_DOWN, d + poff, dataLen);
+    receivePackage(port, d + poff, dataLen);
+    txrxFlags = (txrxFlags & ~TXRX_PORT) | TXRX_NOPORT;
+    dataLen = 0;
+    return true;
+  }
+#endif
+  // decrypted by readDownlink(), if the application reads it
+  dnEncrypted = true;
+  PRINT_DEBUG_1("Received multicast downlink, group=%d, port=%d", id, port);
+  return true;
+}
+
+bool Lmic::setMcGroup(uint8_t id, devaddr_t addr, const uint8_t *nwkSKey,
+                      const uint8_t *appSKey, uint32_t freq, dr_t dr) {
+  if (id >= MC_GROUP_COUNT)
+    return false;
+  McGroup &group = mcGroups[id];
+  group = McGroup{};
+  group.addr = addr;
+  std::copy(nwkSKey, nwkSKey + 16, group.nwkSKey);
+  std::copy(appSKey, appSKey + 16, group.appSKey);
+  group.maxFCnt = 0xFFFFFFFF;
+  group.freq = freq;
+  group.dr = dr;
+  if (freq != 0) {
+    group.sessionClass = 'C';
+    group.timeout = MC_TIMEOUT_NONE;
+  }
+  group.defined = true;
+#if ENABLE_CLASS_C
+  // the radio moves to the session at once
+  runMcSession();
+#endif
+  return true;
+}
+
+void Lmic::clearMcGroup(uint8_t id) {
+  if (id >= MC_GROUP_COUNT)
+    return;
+  mcGroups[id] = McGroup{};
+#if ENABLE_CLASS_C
+  runMcSession();
+#endif
+}
+
+// McClassCSessionReq or McClassBSessionReq, write the status and the time
+// to the start in ans, return their length
+uint8_t Lmic::mcSession(const uint8_t *cmd, uint8_t sessionClass,
+                        uint8_t *ans) {
+  uint8_t id = cmd[0] & 0x03;
+  uint32_t newFreq = regionLMic.convFreq(cmd + 6);
+  dr_t dr = (dr_t)(cmd[9] & 0x0F);
+  ans[0] = id;
+  // the multicast ping slots of class B are not scheduled, class C only
+  // listens with setClassC(): a session which would not be followed is
+  // refused as a group undefined, the answer has no other bit for it
+  bool served = false;
+#if ENABLE_CLASS_C
+  served = sessionClass == 'C' && classC;
+#endif
+  if (id >= MC_GROUP_COUNT || !mcGroups[id].defined || !served)
+    ans[0] |= 0x10;
+  if (newFreq == 0)
+    ans[0] |= 0x08;
+  if (!validDR(dr))
+    ans[0] |= 0x04;
+  if (ans[0] & 0x1C)
+    return 1;
+
+  McGroup &group = mcGroups[id];
+  group.sessionTime = rlsbf4(cmd + 1);
+  group.timeout = cmd[5] & 0x0F;
+  group.periodicity = sessionClass == 'B' ? (cmd[5] >> 4) & 0x07 : 0;
+  group.freq = newFreq;
+  group.dr = dr;
+  group.sessionClass = sessionClass;
+  // a start in the past is now, the network time is asked for if unknown
+  uint32_t now = 0;
+  uint16_t ms;
+  int32_t toStart = 0;
+  if (wallClock.gpsTime(os_getTime(), now, ms))
+    toStart = group.sessionTime - now;
+  else
+    requestDeviceTime();
+  toStart = std::max<int32_t>(toStart, 0);
+  // TimeToStart has 24 bits
+  wlsbf3(ans + 1, std::min<int32_t>(toStart, 0xFFFFFF));
+#if ENABLE_CLASS_C
+  scheduleMcSession();
+#endif
+  return 4;
+}
+#endif
+
+uint8_t Lmic::maxTxPayload(dr_t dr) const {
+  uint8_t maxLen = regionLMic.maxFrameLen(dr);
+  if (maxLen > MAX_LEN_FRAME)
+    maxLen = MAX_LEN_FRAME;
+  return maxLen - OFF_DAT_OPTS - 1 - MIC_LEN;
+}
+
+Downlink Lmic::readDownlink() {
+#if MC_GROUP_COUNT > 0
+  if (dnEncrypted && dnGroup != MC_NO_GROUP) {
+    McGroup const &group = mcGroups[dnGroup];
+    Aes::framePayloadEncryptionWithKey(group.appSKey, group.addr,
+                                       group.seqnoDn - 1, DIR_DOWN,
+                                       frame + dataBeg, dataLen);
+    dnEncrypted = false;
+  }
+#endif
+  if (dnEncrypted) {
+    // the frame is the last downlink, seqnoDn follows it
+    aes.framePayloadEncryption(frame[dataBeg - 1], devaddr, seqnoDn - 1,
+                               DIR_DOWN, frame + dataBeg, dataLen);
+    dnEncrypted = false;
+  }
+  Downlink dn = {txrxFlags, 0, dataLen, frame + dataBeg, dnGroup};
+  if (txrxFlags & TXRX_PORT)
+    dn.port = frame[dataBeg - 1];
+  return dn;
+}
+
 // Send a payload-less message to signal device is alive
 void Lmic::sendAlive() {
   opmode |= OP_POLL;
@@ -1127,11 +2691,21 @@ void Lmic::setLinkCheckMode(bool enabled) {
   adrAckReq = enabled ? LINK_CHECK_INIT : LINK_CHECK_OFF;
 }
 
+// With the link check validation, once ADRACKREQ is set every uplink also
+// carries a LinkCheckReq. Each one without answer lowers the datarate at
+// once instead of after LINK_CHECK_DEAD uplinks.
+void Lmic::setLinkCheckProbe(bool enabled) { linkCheckProbe = enabled; }
+
+// The gateways count of EV_LINK_CHECK is 0 if the network did not answer
+// in the RX windows of the uplink.
+void Lmic::requestLinkCheck() { queueMacRequest(MCMD_LCHK_REQ); }
+
+// The time comes in getWallClock() if the network answers.
+void Lmic::requestDeviceTime() { queueMacRequest(MCMD_DeviceTime_REQ); }
+
 // Sets the max clock error to compensate for (defaults to 0, which
 // allows for +/- 640 at SF7BW250). MAX_CLOCK_ERROR represents +/-100%,
 // so e.g. for a +/-1% error you would pass MAX_CLOCK_ERROR * 1 / 100.
 void Lmic::setClockError(uint8_t error) { clockError = error; }
 
-void Lmic::nextTask() { osjob.setRunnable(); }
-
-Lmic::Lmic() : radio(frame, dataLen, txend, rxtime) {}
\ No newline at end of file
+Lmic::Lmic() : radio(frame, dataLen, txend, rxtime, rssi, snr, osjob) {}
\ No newline at end of file
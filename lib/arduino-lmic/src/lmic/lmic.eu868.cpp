@@ -18,9 +18,8 @@
 
 #define DNW2_SAFETY_ZONE OsDeltaTime::from_ms(3000)
 
-#define maxFrameLen(dr)                                                        \
-  ((dr) <= DR_SF9 ? TABLE_GET_U1(maxFrameLens, (dr)) : 0xFF)
-CONST_TABLE(uint8_t, maxFrameLens)[] = {64, 64, 64, 123};
+// longest frame per DR, from the payload sizes compatible with a repeater
+CONST_TABLE(uint8_t, maxFrameLens)[] = {64, 64, 64, 128, 235, 235, 235, 235};
 
 CONST_TABLE(uint8_t, _DR2RPS_CRC)
 [] = {ILLEGAL_RPS,
@@ -72,6 +71,19 @@ OsDeltaTime LmicEu868::dr2hsym(dr_t dr) {
 
 bool LmicEu868::validRx1DrOffset(uint8_t drOffset) { return drOffset < 6; }
 
+uint8_t LmicEu868::maxFrameLen(dr_t dr) {
+  return dr <= DR_FSK ? TABLE_GET_U1(maxFrameLens, dr) : 0xFF;
+}
+
+// single beacon and ping slot channel
+uint32_t LmicEu868::beaconFreq(uint32_t) {
+  return FREQ_BCN;
+}
+
+uint32_t LmicEu868::pingFreq(uint32_t, devaddr_t) {
+  return FREQ_PING;
+}
+
 // ================================================================================
 //
 // BEG: EU868 related stuff
@@ -189,6 +201,10 @@ uint8_t LmicEu868::mapChannels(uint8_t chMaskCntl, uint16_t chMask) {
   return 1;
 }
 
+void LmicEu868::saveChannelMap() { savedChannelMap = channelMap; }
+
+void LmicEu868::restoreChannelMap() { channelMap = savedChannelMap; }
+
 void LmicEu868::updateTx(OsTime const &txbeg, uint8_t globalDutyRate,
                          OsDeltaTime const &airtime, uint8_t txChnl,
                          int8_t adrTxPow, uint32_t &freq, int8_t &txpow,
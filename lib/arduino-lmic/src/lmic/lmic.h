@@ -25,10 +25,11 @@
 #define LMIC_VERSION_MINOR 5
 #define LMIC_VERSION_BUILD 1431528305
 
-enum { MAX_FRAME_LEN = 64 };   //!< Library cap on max frame length
 enum { TXCONF_ATTEMPTS = 8 };  //!< Transmit attempts for confirmed frames
-enum { MAX_MISSED_BCNS = 20 }; // threshold for triggering rejoin requests
+enum { MAX_MISSED_BCNS = 20 }; // beacons missed before losing the sync
 enum { MAX_RXSYMS = 100 };     // stop tracking beacon beyond this
+enum { BCN_CLOCK_PPM = 200 };  // clock error until the beacon period is known
+enum { BCN_MIN_PPM = 20 };     // error left on the beacon period measured
 
 enum { TIME_RESYNC = 6 * 128 }; // secs
 enum {
@@ -41,6 +42,12 @@ enum { TXRX_BCNEXT_secs = 2 }; // secs - earliest start after beacon time
 enum {
   RETRY_PERIOD_secs = 3
 }; // secs - random period for retrying a confirmed send
+enum {
+  LBT_MAX_BUSY = 4 // busy channels found before sending anyway
+};
+enum {
+  LBT_BACKOFF_SYMS = 32 // max random backoff after a busy channel in symbols
+};
 
 // Keep in sync with evdefs.hpp::drChange
 enum { DRCHG_SET, DRCHG_NOJACC, DRCHG_NOACK, DRCHG_NOADRACK, DRCHG_NWKCMD };
@@ -54,7 +61,7 @@ enum {
   OP_SCAN = 0x0001,    // radio scan to find a beacon
   OP_TRACK = 0x0002,   // track my networks beacon (netid)
   OP_JOINING = 0x0004, // device joining in progress (blocks other activities)
-  OP_TXDATA = 0x0008,  // TX user data (buffered in pendTxData)
+  OP_TXDATA = 0x0008,  // TX user data (buffer given to setTxData2)
   OP_POLL =
       0x0010, // send empty UP frame to ACK confirmed DN/fetch more DN data
   OP_REJOIN = 0x0020,   // occasionally send JOIN REQUEST
@@ -74,7 +81,9 @@ enum {
   TXRX_NOPORT =
       0x20, // set if a frame with a port was RXed, clr if no frame/no port
   TXRX_PORT = 0x10, // set if a frame with a port was RXed,
-                    // LMIC.frame[LMIC.dataBeg-1] => port
+                    // see LMIC.readDownlink()
+  // data dropped, too long for the DR of the uplink
+  TXRX_LENERR = 0x08,
   TXRX_DNW1 = 0x01, // received in 1st DN slot
   TXRX_DNW2 = 0x02, // received in 2dn DN slot
   TXRX_PING = 0x04
@@ -95,7 +104,14 @@ enum _ev_t {
   EV_RESET,
   EV_RXCOMPLETE,
   EV_LINK_DEAD,
-  EV_LINK_ALIVE
+  EV_LINK_ALIVE,
+  EV_LINK_CHECK,
+  EV_FRAG_DONE,
+  EV_UPDATE_READY,
+  EV_UPDATE_FAILED,
+  // a queued uplink waited for the duty cycle past its deadline and was
+  // dropped, see Lmic::getTxMessageId()
+  EV_TXEXPIRED
 };
 typedef enum _ev_t ev_t;
 
@@ -119,6 +135,7 @@ enum { MAX_CHANNELS = 16 }; //!< Max supported channels
 enum { MAX_BANDS = 4 };
 
 enum { LIMIT_CHANNELS = (1 << 4) }; // EU868 will never have more channels
+enum { LQ_NUM_CHANNELS = MAX_CHANNELS }; // channels tracked by LinkQuality
 //! \internal
 struct band_t {
   uint16_t txcap;   // duty cycle limitation: 1/txcap
@@ -136,6 +153,12 @@ public:
   static OsDeltaTime dr2hsym(dr_t dr);
   static uint32_t convFreq(const uint8_t *ptr);
   static bool validRx1DrOffset(uint8_t drOffset);
+  // longest frame allowed by the regional parameters at this DR
+  static uint8_t maxFrameLen(dr_t dr);
+  // default beacon and ping slot frequencies of the beacon period at time
+  // [GPS s]
+  static uint32_t beaconFreq(uint32_t time);
+  static uint32_t pingFreq(uint32_t time, devaddr_t devaddr);
 
   void initDefaultChannels(bool join);
   bool setupChannel(uint8_t channel, uint32_t newfreq, uint16_t drmap,
@@ -144,10 +167,14 @@ public:
   void handleCFList(const uint8_t *ptr);
 
   uint8_t mapChannels(uint8_t chpage, uint16_t chmap);
+  // keep the enabled channels, to undo a rejected LinkADRReq block
+  void saveChannelMap();
+  void restoreChannelMap();
   void updateTx(OsTime const &txbeg, uint8_t globalDutyRate,
                 OsDeltaTime const &airtime, uint8_t txChnl, int8_t adrTxPow,
                 uint32_t &freq, int8_t &txpow, OsTime &globalDutyAvail);
   OsTime nextTx(OsTime const &now, dr_t datarate, uint8_t &txChnl);
+  uint32_t getFreq(uint8_t channel) const;
   void setRx1Params(uint8_t txChnl, uint8_t rx1DrOffset, dr_t &dndr,
                     uint32_t &freq);
 #if !defined(DISABLE_JOIN)
@@ -161,8 +188,8 @@ private:
   band_t bands[MAX_BANDS]{};
   ChannelDetail channels[MAX_CHANNELS] = {};
   uint16_t channelMap = 0;
+  uint16_t savedChannelMap = 0;
 
-  uint32_t getFreq(uint8_t channel) const;
   uint8_t getBand(uint8_t channel) const;
   bool setupBand(uint8_t bandidx, int8_t txpow, uint16_t txcap);
 };
@@ -175,6 +202,8 @@ enum {
   MAX_XCHANNELS = 2
 }; // extra channels in RAM, channels 0-71 are immutable
 enum { MAX_TXPOW_125kHz = 30 };
+// channels tracked by LinkQuality
+enum { LQ_NUM_CHANNELS = 72 + MAX_XCHANNELS };
 
 class LmicUs915 {
 public:
@@ -183,6 +212,12 @@ public:
   static OsDeltaTime dr2hsym(dr_t dr);
   static uint32_t convFreq(const uint8_t *ptr);
   static bool validRx1DrOffset(uint8_t drOffset);
+  // longest frame allowed by the regional parameters at this DR
+  static uint8_t maxFrameLen(dr_t dr);
+  // default beacon and ping slot frequencies of the beacon period at time
+  // [GPS s]
+  static uint32_t beaconFreq(uint32_t time);
+  static uint32_t pingFreq(uint32_t time, devaddr_t devaddr);
 
   void initDefaultChannels(bool join);
   bool setupChannel(uint8_t channel, uint32_t newfreq, uint16_t drmap,
@@ -191,10 +226,14 @@ public:
   void handleCFList(const uint8_t *ptr);
 
   uint8_t mapChannels(uint8_t chpage, uint16_t chmap);
+  // keep the enabled channels, to undo a rejected LinkADRReq block
+  void saveChannelMap();
+  void restoreChannelMap();
   void updateTx(OsTime const &txbeg, uint8_t globalDutyRate,
                 OsDeltaTime const &airtime, uint8_t txChnl, int8_t adrTxPow,
                 uint32_t &freq, int8_t &txpow, OsTime &globalDutyAvail);
   OsTime nextTx(OsTime const &now, dr_t datarate, uint8_t &txChnl);
+  uint32_t getFreq(uint8_t channel) const;
   void setRx1Params(uint8_t txChnl, uint8_t rx1DrOffset, dr_t &dndr,
                     uint32_t &freq);
 #if !defined(DISABLE_JOIN)
@@ -210,6 +249,7 @@ private:
   uint16_t
       xchDrMap[MAX_XCHANNELS]; // extra channel datarate ranges  ---XXX: ditto
   uint16_t channelMap[(72 + MAX_XCHANNELS + 15) / 16]; // enabled bits
+  uint16_t savedChannelMap[(72 + MAX_XCHANNELS + 15) / 16];
   uint16_t chRnd;
 
   void enableChannel(uint8_t channel);
@@ -230,6 +270,599 @@ enum {
   LINK_CHECK_OFF = -128
 }; // link check disabled
 
+enum {
+  // data rates tracked by LinkQuality
+  LQ_NUM_DR = 16,
+  // weight of a new sample in LinkQuality averages is 1/2^LQ_EWMA_SHIFT
+  LQ_EWMA_SHIFT = 3,
+  // returned by LinkQuality::margin() when nothing was received at this DR
+  LQ_MARGIN_UNKNOWN = -128,
+  // delivery probability scale (LQ_PROB_MAX => 100%)
+  LQ_PROB_MAX = 255
+};
+
+//! \brief Link quality estimation.
+//! Every valid downlink gives a SNR sample, turned into a demodulation
+//! margin (SNR above the floor of the spreading factor it was received
+//! with). Every uplink whose fate is known (confirmed frame acked or not,
+//! any downlink heard after it) gives a delivery sample. Both are smoothed
+//! by an exponentially weighted moving average, per data rate and, for
+//! delivery, per channel.
+class LinkQuality {
+public:
+  void reset();
+
+  // record a valid downlink received at dr with packet snr (dB * 4)
+  void addReception(dr_t dr, int8_t snr);
+  // remember the uplink just sent, its fate is given by uplinkDone()
+  void setUplink(dr_t dr, uint8_t chnl);
+  // resolve the pending uplink as delivered or lost
+  void uplinkDone(bool delivered);
+
+  // estimated demodulation margin in dB at dr, LQ_MARGIN_UNKNOWN if unknown
+  int8_t margin(dr_t dr) const;
+  // estimated delivery probability at dr (0..LQ_PROB_MAX)
+  uint8_t deliveryProbability(dr_t dr) const;
+  // estimated delivery probability on channel (0..LQ_PROB_MAX)
+  uint8_t channelDeliveryProbability(uint8_t chnl) const;
+
+private:
+  // EWMA of the margin in dB * 16, valid if rxCount > 0
+  int16_t drMargin[LQ_NUM_DR];
+  uint8_t drRxCount[LQ_NUM_DR];
+  uint8_t drDelivery[LQ_NUM_DR];
+  uint8_t channelDelivery[LQ_NUM_CHANNELS];
+
+  // data rate of the uplink waiting for its outcome, LQ_NUM_DR if none
+  dr_t pendingDr = LQ_NUM_DR;
+  uint8_t pendingChnl = 0;
+
+  static uint8_t updateProbability(uint8_t current, bool success);
+};
+
+enum {
+  // downlinks needed before the RX windows follow the learned timing
+  RXT_MIN_SAMPLES = 4,
+  // weight of a new sample in RxTiming averages is 1/2^RXT_EWMA_SHIFT
+  RXT_EWMA_SHIFT = 3,
+  // margin of the windows on each side, in mean deviations
+  RXT_JITTER_FACTOR = 4,
+  // largest jitter kept [us]
+  RXT_JITTER_MAX = 100000
+};
+
+//! \brief RX window timing learned from the downlinks.
+//! Every valid downlink gives the error between the start of its preamble
+//! (end of reception minus air time) and the start expected from the end
+//! of the uplink and the window delay. The error is modelled as a drift,
+//! proportional to the delay, plus a jitter (gateway timing, interrupt
+//! latency) tracked as the mean absolute deviation from the prediction.
+class RxTiming {
+public:
+  void reset();
+
+  // frame start measured minus expected, delay after the end of uplink
+  void addReception(OsDeltaTime const &error, OsDeltaTime const &delay);
+  // no downlink in a window where one was due: widen the windows
+  void missed();
+
+  // enough downlinks to size the windows
+  bool calibrated() const { return samples >= RXT_MIN_SAMPLES; };
+  uint8_t sampleCount() const { return samples; };
+  // frame start error per delay [ppm], positive when frames come late
+  int16_t drift() const;
+  // mean deviation of the frame start from the prediction [us]
+  int32_t jitter() const;
+
+  // expected error of the frame start after delay
+  OsDeltaTime offset(OsDeltaTime const &delay) const;
+  // half width of the window to open around the expected start
+  OsDeltaTime margin() const;
+
+private:
+  // averages of drift [ppm * 16] and jitter [us * 16]
+  int32_t driftAvg;
+  int32_t jitterAvg;
+  uint8_t samples;
+};
+
+enum {
+  // GPS epoch, 1980-01-06, in Unix time [s]
+  GPS_UNIX_OFFSET = 315964800,
+  // UTC is behind GPS time by the leap seconds since 1980 (18 since 2017)
+  GPS_LEAP_SECONDS = 18,
+  // resolution of the DeviceTimeAns time, 1/256 s [us]
+  WCLK_SYNC_ERROR = 3906,
+  // clock drift assumed before one is measured [ppm]
+  WCLK_DRIFT_MAX = 100,
+  // weight of a new sample in WallClock averages is 1/2^WCLK_EWMA_SHIFT
+  WCLK_EWMA_SHIFT = 2,
+  // the reference of the clock is moved forward after this [s]
+  WCLK_REBASE_PERIOD = 3600
+};
+
+//! \brief Wall clock disciplined by DeviceTimeAns.
+//! Each answer gives the GPS time at the end of the uplink which carried
+//! the request. Between them the OsTime elapsed since the last reference
+//! is corrected by the drift, learned from the error of the prediction at
+//! each sync. The error estimate grows from the resolution of the answer
+//! at the rate of the drift uncertainty. OsTime wraps after some hours,
+//! rebase() has to be called more often than that: Lmic does it every
+//! WCLK_REBASE_PERIOD once synced.
+class WallClock {
+public:
+  // GPS time [s, 1/256 s] at the end of the uplink at time
+  void sync(OsTime const &time, uint32_t seconds, uint8_t fraction);
+  // move the reference forward to time if it is getting old
+  void rebase(OsTime const &time);
+
+  bool synced() const { return syncs != 0; };
+  uint8_t syncCount() const { return syncs; };
+  // GPS time at time [s, ms], false if never synced
+  bool gpsTime(OsTime const &time, uint32_t &seconds, uint16_t &ms) const;
+  // UTC at time, as Unix time [s, ms], false if never synced
+  bool utcTime(OsTime const &time, uint32_t &seconds, uint16_t &ms) const;
+  // local clock slower than the network clock by this [ppm]
+  int16_t drift() const { return (driftAvg + 8) / 16; };
+  // estimated error of the time at time [us], 0xFFFFFFFF if never synced
+  uint32_t error(OsTime const &time) const;
+
+private:
+  // time since the reference, corrected by the drift [us]
+  int64_t elapsed(OsTime const &time) const;
+
+  // local time of the reference and network time there [s, us]
+  OsTime refTime;
+  uint32_t refSeconds = 0;
+  uint32_t refUs = 0;
+  // error of the reference time [us]
+  uint32_t refError = 0;
+  // local time from the last sync to the reference [ms]
+  uint32_t sinceSync = 0;
+  // drift average and mean deviation [ppm * 16]
+  int32_t driftAvg = 0;
+  int32_t driftDev = 0;
+  // drift uncertainty [ppm]
+  uint16_t driftError = WCLK_DRIFT_MAX;
+  uint8_t driftSamples = 0;
+  uint8_t syncs = 0;
+};
+
+// group of a downlink sent to the device address
+enum { MC_NO_GROUP = 0xFF };
+
+//! \brief Application payload of the last downlink, see
+//! Lmic::readDownlink(). The data stays in the frame buffer, valid until
+//! the next uplink is built.
+struct Downlink {
+  // TXRX_* flags of the transaction
+  uint8_t flags;
+  // port of the frame, valid with TXRX_PORT
+  uint8_t port;
+  uint8_t length;
+  const uint8_t *data;
+  // multicast group which the frame was sent to, or MC_NO_GROUP
+  uint8_t group;
+};
+
+#if !defined(UPLINK_QUEUE_SIZE)
+#define UPLINK_QUEUE_SIZE 4
+#endif
+
+// id of an uplink given to setTxData2() rather than queued
+enum { TXQ_NO_ID = 0xFF };
+// id of the uplinks of a fragmentation session
+enum { TXQ_FRAG_ID = 0xFE };
+
+#if UPLINK_QUEUE_SIZE > 0
+// Uplink waiting in the UplinkQueue
+struct UplinkMessage {
+  // buffer of the application, unchanged until the message is done
+  const uint8_t *data;
+  OsTime queued;
+  // dropped if not taken by then, if expires is set
+  OsTime deadline;
+  uint8_t length;
+  uint8_t port;
+  uint8_t priority;
+  uint8_t id;
+  bool confirmed;
+  bool expires;
+};
+
+//! \brief Bounded queue of uplinks, see Lmic::queueTxData().
+//! The MAC takes the message of highest priority, the oldest first, each
+//! time the previous uplink is done. Messages past their deadline are
+//! dropped instead of being sent late.
+class UplinkQueue {
+public:
+  // false if the queue is full
+  bool push(UplinkMessage const &msg);
+  // take the next message, false if none. The expired ones are left to
+  // popExpired(), which the MAC calls first.
+  bool pop(UplinkMessage &msg);
+  // take a message past its deadline, false if none
+  bool popExpired(OsTime const &now, UplinkMessage &msg);
+  void clear();
+
+  uint8_t depth() const { return count; };
+  // time the oldest message has waited, 0 if the queue is empty
+  OsDeltaTime age(OsTime const &now) const;
+  // messages dropped past their deadline
+  uint16_t expiredCount() const { return expired; };
+  // a message taken expired before it could be sent
+  void countExpired();
+
+private:
+  UplinkMessage messages[UPLINK_QUEUE_SIZE];
+  uint8_t count = 0;
+  uint16_t expired = 0;
+};
+#endif // UPLINK_QUEUE_SIZE > 0
+
+#if !defined(TX_AGGREGATE_SIZE)
+#define TX_AGGREGATE_SIZE 0
+#endif
+
+#if TX_AGGREGATE_SIZE > 0
+#if UPLINK_QUEUE_SIZE == 0 || TX_AGGREGATE_SIZE > 255
+#error TX_AGGREGATE_SIZE needs UPLINK_QUEUE_SIZE and at most 255 bytes
+#endif
+
+// record header of the PayloadAggregator
+enum { AGG_SOURCE_MAX = 7, AGG_RECORD_MAX = 31, AGG_LEN_MASK = 0x1F };
+
+//! \brief Small records packed in one payload, see Lmic::aggregateTxData().
+//! Each record is a header byte, the source in the 3 high bits and the
+//! length in the 5 low bits, followed by its data: the network side splits
+//! a payload by walking the headers. The sealed payload stays at the start
+//! of the buffer until sent, the records added meanwhile follow it.
+class PayloadAggregator {
+public:
+  // false if the buffer is full
+  bool add(uint8_t source, const uint8_t *data, uint8_t len);
+  // seal the first records fitting in maxLen, return the payload length.
+  // A first record longer than maxLen is dropped.
+  uint8_t seal(uint8_t maxLen);
+  // the sealed payload is sent, its room is free again
+  void release();
+  void clear();
+
+  const uint8_t *payload() const { return buffer; };
+  bool sealed() const { return sealedLen != 0; };
+  // bytes of the records not sealed yet
+  uint8_t pending() const { return openLen; };
+  // records dropped, too long for the payload when sealed
+  uint16_t droppedCount() const { return dropped; };
+
+private:
+  uint8_t buffer[TX_AGGREGATE_SIZE];
+  uint8_t sealedLen = 0;
+  uint8_t openLen = 0;
+  uint16_t dropped = 0;
+};
+#endif // TX_AGGREGATE_SIZE > 0
+
+#if !defined(UPLINK_FRAG_SIZE)
+#define UPLINK_FRAG_SIZE 0
+#endif
+
+#if UPLINK_FRAG_SIZE > 0
+#if UPLINK_FRAG_SIZE > 250
+#error Illegal UPLINK_FRAG_SIZE - must be in range [1:250].
+#endif
+
+enum {
+  // fragment header: index of the session and fragment number, fragments
+  // count, padding of the last uncoded fragment
+  FRAG_HEADER_LEN = 5,
+  // uncoded fragments of a session, bounded by the row built for a parity
+  FRAG_MAX_COUNT = 256,
+  // uncoded and parity fragments of a session, N is 14 bits on air
+  FRAG_MAX_NUMBER = 0x3FFF,
+};
+
+//! \brief Buffer sent as fragments with parity, see Lmic::sendFragmented().
+//! The M uncoded fragments are followed by parity fragments, each the XOR
+//! of about M/2 of them chosen as in the LoRaWAN fragmented data block
+//! transport, so the receiver rebuilds the buffer from most sets of a bit
+//! more than M fragments. Each fragment starts with the index of the
+//! session in the 2 high bits and the fragment number N (1 based) in the
+//! 14 low bits, then M, both little endian, then the padding byte.
+class FragSession {
+public:
+  // false if the buffer needs more than FRAG_MAX_COUNT fragments, or the
+  // parity more than FRAG_MAX_NUMBER in all
+  bool start(const uint8_t *buf, uint16_t len, uint8_t fragLen,
+             uint16_t parityCount, uint8_t sessionIndex);
+  void stop() { next = total(); };
+  // build the next fragment, return its length with the header
+  uint8_t build();
+
+  bool active() const { return next < total(); };
+  const uint8_t *fragment() const { return frame; };
+  uint16_t uncoded() const { return count; };
+  uint16_t total() const { return count + parity; };
+  // fragments built so far
+  uint16_t sent() const { return next; };
+
+private:
+  void addUncoded(uint16_t i);
+
+  const uint8_t *data = nullptr;
+  uint16_t length = 0;
+  uint16_t count = 0;
+  uint16_t parity = 0;
+  uint16_t next = 0;
+  uint8_t size = 0;
+  uint8_t index = 0;
+  uint8_t frame[FRAG_HEADER_LEN + UPLINK_FRAG_SIZE];
+};
+#endif // UPLINK_FRAG_SIZE > 0
+
+#if !defined(FUOTA_MAX_FRAGS)
+#define FUOTA_MAX_FRAGS 0
+#endif
+#if !defined(FUOTA_MAX_LOST)
+#define FUOTA_MAX_LOST 64
+#endif
+#if !defined(MC_GROUP_COUNT)
+#define MC_GROUP_COUNT 0
+#endif
+#if MC_GROUP_COUNT > 4
+#error Illegal MC_GROUP_COUNT - must be in range [0:4].
+#endif
+
+// application packages handled by the MAC, their answers go up on the
+// uplink queue
+#define APP_PACKAGES (FUOTA_MAX_FRAGS > 0 || MC_GROUP_COUNT > 0)
+#if APP_PACKAGES && UPLINK_QUEUE_SIZE == 0
+#error FUOTA_MAX_FRAGS and MC_GROUP_COUNT need UPLINK_QUEUE_SIZE
+#endif
+#if !defined(ENABLE_CLASS_C)
+#define ENABLE_CLASS_C 0
+#endif
+#if !defined(ENABLE_CLASS_B)
+#define ENABLE_CLASS_B 0
+#endif
+// answers to the commands of a downlink of an application package
+enum { PKG_ANS_LEN = 24 };
+
+// remote multicast setup package
+enum {
+  MC_SETUP_PORT = 200,
+  MC_PACKAGE_VERSION = 0x00,
+  MC_GROUP_STATUS = 0x01,
+  MC_GROUP_SETUP = 0x02,
+  MC_GROUP_DELETE = 0x03,
+  MC_CLASS_C_SESSION = 0x04,
+  MC_CLASS_B_SESSION = 0x05,
+};
+
+// fragmented data block transport package
+enum {
+  FRAG_PORT = 201,
+  FRAG_PACKAGE_VERSION = 0x00,
+  FRAG_SESSION_STATUS = 0x01,
+  FRAG_SESSION_SETUP = 0x02,
+  FRAG_SESSION_DELETE = 0x03,
+  FRAG_DATA_FRAGMENT = 0x08,
+};
+
+#if MC_GROUP_COUNT > 0
+// McGroup::timeout of a session which does not end
+enum { MC_TIMEOUT_NONE = 0xFF };
+
+// Multicast group given by the network with McGroupSetupReq, or by
+// Lmic::setMcGroup()
+struct McGroup {
+  uint32_t addr;
+  // frame counters accepted, and the next one expected
+  uint32_t minFCnt;
+  uint32_t maxFCnt;
+  uint32_t seqnoDn;
+  uint8_t nwkSKey[16];
+  uint8_t appSKey[16];
+  // class B or C session: start in GPS seconds, RX channel and DR
+  uint32_t sessionTime;
+  uint32_t freq;
+  dr_t dr;
+  // 2^timeout seconds (class C) or beacon periods (class B), or
+  // MC_TIMEOUT_NONE for a session of Lmic::setMcGroup()
+  uint8_t timeout;
+  // ping slot period of class B
+  uint8_t periodicity;
+  // 'B' or 'C' once a session is set, 0 before
+  uint8_t sessionClass;
+  bool defined;
+};
+#endif
+
+#if ENABLE_CLASS_B
+enum {
+  // BeaconInfo::flags
+  BCN_PARTIAL = 0x01, // time of the beacon received
+  BCN_FULL = 0x02,    // gateway specific part received too
+};
+
+// Last beacon of the network, see Lmic::getBeaconInfo()
+struct BeaconInfo {
+  // local time of the start of the beacon period
+  OsTime start;
+  // GPS time of the beacon period [s]
+  uint32_t time;
+  // RSSI [dBm] and SNR [dB * SNR_SCALEUP] of the beacon
+  int16_t rssi;
+  int8_t snr;
+  // gateway specific part: info descriptor, latitude and longitude
+  uint8_t info;
+  int32_t lat;
+  int32_t lon;
+  // BCN_* flags of the beacon, 0 if missed
+  uint8_t flags;
+};
+#endif
+
+#if UPLINK_FRAG_SIZE > 0 || FUOTA_MAX_FRAGS > 0
+// set in row the uncoded fragments (0 based) XORed in the parity fragment
+// n (1 based, above m) of a session of m uncoded fragments. row has m bits.
+void fragMatrixLine(uint16_t n, uint16_t m, uint8_t *row);
+#endif
+
+#if FUOTA_MAX_FRAGS > 0
+#if FUOTA_MAX_FRAGS % 8 != 0 || FUOTA_MAX_FRAGS > 4096
+#error Illegal FUOTA_MAX_FRAGS - must be a multiple of 8 in range [8:4096].
+#endif
+#if FUOTA_MAX_LOST % 8 != 0 || FUOTA_MAX_LOST > FUOTA_MAX_FRAGS
+#error Illegal FUOTA_MAX_LOST - must be a multiple of 8, FUOTA_MAX_FRAGS max.
+#endif
+
+enum FragState : uint8_t {
+  FRAG_IDLE,
+  FRAG_RECEIVING,
+  // file complete, its CRC-32 is the descriptor of the session
+  FRAG_VERIFIED,
+  FRAG_CORRUPTED,
+};
+
+//! \brief File sent in fragments with parity on port 201 (LoRaWAN
+//! fragmented data block transport), rebuilt in the storage of the HAL
+//! with a few bytes of RAM.
+//! The uncoded fragments are written at their place. The first parity
+//! fragment fixes the set of the missing ones: each parity fragment, less
+//! the received fragments it covers, is reduced by the rows stored so far
+//! and stored after the file as a new row of a triangular system. Once
+//! there are as many rows as fragments lost, the system is solved from its
+//! last row up, into the file. The descriptor of the session is the CRC-32
+//! of the file, checked at the end.
+class FragReceiver {
+public:
+  // handle the commands of a downlink of port 201, buf is modified. Write
+  // the answers in ans, return their length
+  uint8_t receive(uint8_t *buf, uint8_t len, uint8_t *ans, uint8_t room);
+
+  FragState state() const { return fileState; };
+  // multicast groups of the session, bit per McGroupID
+  uint8_t groups() const { return groupMask; };
+  uint32_t fileLength() const { return (uint32_t)count * size - padding; };
+  uint16_t uncoded() const { return count; };
+  // fragments still needed to rebuild the file
+  uint16_t missing() const;
+
+private:
+  uint8_t setup(const uint8_t *cmd);
+  void addFragment(uint16_t n, uint8_t *data);
+  void addParity(uint16_t n, uint8_t *data);
+  void solve(uint8_t *work);
+  void verify();
+  bool received(uint16_t i) const { return got[i >> 3] & (1 << (i & 7)); };
+  uint32_t rowOffset(uint16_t p) const;
+  void xorStored(uint32_t offset, uint8_t *data, uint8_t len) const;
+
+  uint32_t descriptor = 0;
+  uint16_t count = 0;
+  // fragments received, and the distinct uncoded ones among them
+  uint16_t frags = 0;
+  uint16_t have = 0;
+  // fragments lost at the first parity, rows of the system stored
+  uint16_t lost = 0;
+  uint16_t solved = 0;
+  uint8_t size = 0;
+  uint8_t padding = 0;
+  uint8_t index = 0;
+  uint8_t groupMask = 0;
+  // parity fragments received, the missing set is fixed
+  bool parityPhase = false;
+  // more fragments lost than FUOTA_MAX_LOST or than the storage can hold
+  bool tooMany = false;
+  FragState fileState = FRAG_IDLE;
+  uint8_t got[FUOTA_MAX_FRAGS / 8];
+  uint8_t pivots[FUOTA_MAX_LOST / 8];
+};
+#endif // FUOTA_MAX_FRAGS > 0
+
+// Listen before talk statistics
+struct LbtStats {
+  // channel activity detections run before an uplink
+  uint16_t cadCount;
+  // detections which found the channel busy
+  uint16_t busyCount;
+  // uplinks sent after LBT_MAX_BUSY busy channels in a row
+  uint16_t forcedCount;
+};
+
+enum {
+  // limit of RetryPolicy::attempts, one bit of RetryPolicy::drSteps each
+  RETRY_MAX_ATTEMPTS = 16
+};
+
+//! \brief Retry policy of confirmed uplinks.
+//! A confirmed frame without acknowledgement is sent again, up to attempts
+//! times in all, after a random delay doubled by each retry as long as
+//! backoffDoublings allows. Set the policy with Lmic::setRetryPolicy(), the
+//! default is TXCONF_ATTEMPTS attempts, a delay of up to RETRY_PERIOD_secs
+//! and the DR lowered for every other retry.
+struct RetryPolicy {
+  // transmissions of a frame, the first one included
+  uint8_t attempts;
+  // random delay before the first retry is up to this [s]
+  uint8_t backoffSecs;
+  // times the span of the random delay is doubled for the next retries
+  uint8_t backoffDoublings;
+  // bit n set: attempt n (the first one is 0) is sent one DR lower
+  uint16_t drSteps;
+  // send a retry on another channel than the previous attempt if the
+  // channel plan has one available
+  bool newChannel;
+  // no retry once the attempts of a frame would exceed this airtime [ms],
+  // the next attempt taken as long as the last one, 0 for no limit
+  uint16_t airtimeBudget;
+};
+
+// Confirmed uplink statistics
+struct RetryStats {
+  // frames acknowledged
+  uint16_t delivered;
+  // frames given up
+  uint16_t failed;
+  // attempts of the frames acknowledged, the average is attempts/delivered
+  uint32_t attempts;
+};
+
+enum {
+  // MAC commands known to the parser, entries of Lmic::MAC_COMMANDS
+  MAC_CMD_COUNT = 14,
+  // FOpts room for the answers
+  MAC_FOPTS_MAX = 15,
+  // answers kept for a MAC_CMD_REPEAT command, as many as a downlink of
+  // the frame buffer holds
+  MAC_ANS_REPEAT_MAX = 8
+};
+
+// MacCommand flags
+enum {
+  // consecutive commands are validated and applied together
+  MAC_CMD_BLOCK = 0x01,
+  // the answer goes in every uplink until a downlink is received
+  MAC_CMD_STICKY = 0x02,
+  // the device sends a request, queued by the application, which the
+  // command from the network answers
+  MAC_CMD_REQUEST = 0x04,
+  // each command of a downlink gets its own answer and status
+  MAC_CMD_REPEAT = 0x08
+};
+
+// Answer to the last LinkCheckReq, see Lmic::requestLinkCheck()
+struct LinkCheck {
+  // demodulation margin of the uplink at the best gateway [dB]
+  uint8_t margin;
+  // gateways which received the uplink, 0 without answer
+  uint8_t gateways;
+};
+
+// set in Lmic::macAns with the status of an answer to send
+enum { MAC_ANS_PENDING = 0x80 };
+
 class Lmic {
 public:
   Radio radio;
@@ -240,7 +873,9 @@ private:
   OsTime txend;
   OsTime rxtime;
   uint32_t freq = 0;
+  // last packet RSSI [dBm] + RSSI_OFF
   int8_t rssi = 0;
+  // last packet SNR [dB] * SNR_SCALEUP
   int8_t snr = 0;
   // radio parameters set
   rps_t rps;
@@ -272,6 +907,25 @@ private:
 
   uint8_t clockError = 0; // Inaccuracy in the clock. CLOCK_ERROR_MAX
                           // represents +/-100% error
+  // RX window timing, used instead of clockError once calibrated
+  RxTiming rxTiming;
+  // delay from the end of uplink to the frame of the window scheduled
+  OsDeltaTime rxWindowDelay;
+
+  // listen before talk with a CAD before each uplink
+  bool lbtEnabled = false;
+  // CAD found the channel free for the pending uplink
+  bool lbtClear = false;
+  // busy channels found in a row for the pending uplink
+  uint8_t lbtBusy = 0;
+  LbtStats lbtStats = {};
+
+  RetryPolicy retryPolicy = {TXCONF_ATTEMPTS, RETRY_PERIOD_secs, 0, 0x54,
+                             false, 0};
+  RetryStats retryStats = {};
+  // airtime of all the attempts of the current frame, and of the last one
+  OsDeltaTime txAirtime;
+  OsDeltaTime txLastAirtime;
 
   // pending data length
   uint8_t pendTxLen = 0;
@@ -279,8 +933,91 @@ private:
   bool pendTxConf;
   // pending data port
   uint8_t pendTxPort;
-  // pending data
-  uint8_t pendTxData[MAX_LEN_PAYLOAD];
+  // pending data, in the buffer of the application
+  const uint8_t *pendTxData = nullptr;
+  // id of the pending data, and of the data of the last EV_TXCOMPLETE
+  uint8_t pendTxId = TXQ_NO_ID;
+  uint8_t txDoneId = TXQ_NO_ID;
+#if UPLINK_QUEUE_SIZE > 0
+  UplinkQueue txQueue;
+  uint8_t txQueueId = 0;
+  // deadline of the pending data if it is a queued message which expires
+  OsTime pendTxDeadline;
+  bool pendTxExpires = false;
+#endif
+#if UPLINK_FRAG_SIZE > 0
+  FragSession fragSession;
+  uint8_t fragPort = 0;
+  // index of the next session, 2 bits on air
+  uint8_t fragIndex = 0;
+#endif
+#if TX_AGGREGATE_SIZE > 0
+  PayloadAggregator txAggregate;
+  OsJobType<Lmic> aggregateJob{*this, OSS};
+  OsDeltaTime aggregateLatency = OsDeltaTime::from_sec(60);
+  uint8_t aggregatePort = 1;
+  // queue id of the sealed payload
+  uint8_t aggregateId = TXQ_NO_ID;
+  // the open records are sealed as soon as the buffer allows
+  bool aggregateDue = false;
+#endif
+#if APP_PACKAGES
+  // answers of the last package downlink, queued on its port
+  uint8_t pkgAns[PKG_ANS_LEN];
+  uint8_t pkgAnsId = TXQ_NO_ID;
+#endif
+#if FUOTA_MAX_FRAGS > 0
+  FragReceiver fragReceiver;
+  // the file of the session is complete, EV_UPDATE_* due
+  bool fileDone = false;
+#endif
+#if MC_GROUP_COUNT > 0
+  McGroup mcGroups[MC_GROUP_COUNT] = {};
+#endif
+  // payload of the last downlink left encrypted until read
+  bool dnEncrypted = false;
+  // multicast group of the last downlink, MC_NO_GROUP if none
+  uint8_t dnGroup = MC_NO_GROUP;
+#if ENABLE_CLASS_C
+  bool classC = false;
+  // the radio is in the continuous RX, osjob waits for its frame
+  bool rxContinuous = false;
+  // wakes the MAC for a delayed uplink while the radio listens
+  OsJobType<Lmic> txJob{*this, OSS};
+#if MC_GROUP_COUNT > 0
+  // wakes the MAC at the start or the end of a class C multicast session
+  OsJobType<Lmic> mcSessionJob{*this, OSS};
+#endif
+#endif
+#if ENABLE_CLASS_B
+  BeaconInfo bcnInfo = {};
+  // local length of a beacon period learned from the beacons, and its
+  // uncertainty
+  OsDeltaTime bcnPeriod;
+  OsDeltaTime bcnPeriodError;
+  uint8_t missedBcns = 0;
+  // window of the next beacon, end of the scan while scanning
+  OsTime bcnRxtime;
+  uint8_t bcnRxsyms = 0;
+  // BeaconTimingReq left to send before the scan
+  uint8_t bcnInfoTries = 0;
+  // start of the next beacon and its channel, given by BeaconTimingAns
+  bool bcnTimingKnown = false;
+  OsTime bcnTimingStart;
+  uint8_t bcnTimingChnl = 0;
+  // beacon and ping slot parameters set by the network, 0 for the defaults
+  uint32_t bcnChFreq = 0;
+  uint32_t pingChFreq = 0;
+  dr_t pingDr = DR_PING;
+  // a ping slot every 2^pingExp s, the first one pingOffset slots after
+  // the beacon reserved time
+  uint8_t pingExp = 0;
+  uint16_t pingOffset = 0;
+  // next ping slot of the beacon period, and its window
+  uint8_t pingIndex = 0;
+  OsTime pingRxtime;
+  uint8_t pingRxsyms = 0;
+#endif
 
   // last generated nonce
   // set at random value at reset.
@@ -302,39 +1039,69 @@ private:
   // // Rx delay after TX, init at reset
   OsDeltaTime rxDelay;
 
+  // demodulation margin of last downlink, 6 bit signed as in DevStatusAns
   uint8_t margin = 0;
-  // link adr adapt answer pending, init after join
-  // use bit 15 as flag, other as value for acq
-  uint8_t ladrAns;
-  // device status answer pending, init after join
-  bool devsAns;
-  // RX timing setup answer pending, init after join
-  bool rxTimingSetupAns;
+  LinkQuality linkQuality;
+  // answers pending per MAC_COMMANDS entry: MAC_ANS_PENDING | status, init
+  // after join
+  uint8_t macAns[MAC_CMD_COUNT];
+  // number of answers due for the last block of commands
+  uint8_t macAnsBlock;
+  // statuses of the answers due for the MAC_CMD_REPEAT command, in the order
+  // of the commands received
+  uint8_t macAnsRepeat[MAC_ANS_REPEAT_MAX];
+  uint8_t macAnsRepeatCount;
+  // LinkCheckReq sent, EV_LINK_CHECK due at the end of the transaction
+  bool linkCheckSent = false;
+  // probe the link with LinkCheckReq instead of waiting LINK_CHECK_DEAD
+  bool linkCheckProbe = false;
+  LinkCheck linkCheck = {};
+  WallClock wallClock;
+  // moves the reference of wallClock forward before OsTime wraps
+  OsJobType<Lmic> wallClockJob{*this, OSS};
+  // DeviceTimeReq sent when the clock error is above this [ms], 0 never
+  uint16_t timeSyncError = 0;
+  // answers left out by the user data of the last uplink
+  bool macAnsSpill = false;
+  // bytes of MAC answers in the last uplink, in FOpts or port 0 payload
+  uint8_t txMacLen = 0;
+  // bytes of the last uplink which are not application payload
+  uint8_t txOverhead = 0;
   // adr Mode, init at reset
   uint8_t adrEnabled;
-#if !defined(DISABLE_MCMD_DCAP_REQ)
-  // have to ACK duty cycle settings, init after join
-  bool dutyCapAns;
-#endif
-#if !defined(DISABLE_MCMD_SNCH_REQ)
-  // answer set new channel, init afet join.
-  uint8_t snchAns;
-#endif
   // 1 RX window DR offset
   uint8_t rx1DrOffset;
   // 2nd RX window (after up stream), init at reset
   uint8_t dn2Dr;
   uint32_t dn2Freq;
-#if !defined(DISABLE_MCMD_DN2P_SET)
-  // 0=no answer pend, 0x80+ACKs, init after join
-  uint8_t dn2Ans;
-#endif
+
+  //! \brief MAC command sent by the network server.
+  //! The parser looks its CID up in MAC_COMMANDS, checks the parameters
+  //! with validate() then uses them with apply(), given the status found,
+  //! which is also the answer. Commands without handlers are skipped by
+  //! their length, an unknown CID ends the parse.
+  struct MacCommand {
+    uint8_t cid;
+    // length with the CID
+    uint8_t length;
+    uint8_t flags;
+    // length of the answer with the CID, 0 if none
+    uint8_t ansLength;
+    // check count consecutive commands, return the answer status
+    uint8_t (Lmic::*validate)(const uint8_t *cmd, uint8_t count);
+    // use count consecutive commands validated with status
+    void (Lmic::*apply)(const uint8_t *cmd, uint8_t count, uint8_t status);
+    // write the answer after the CID, nullptr if it is the status alone
+    void (Lmic::*encode)(uint8_t *ans, uint8_t status);
+  };
+  static const MacCommand RESOLVE_TABLE(MAC_COMMANDS)[MAC_CMD_COUNT];
 
 public:
   // Public part of MAC state
   uint8_t txCnt = 0;
   uint8_t txrxFlags = 0; // transaction flags (TX-RX combo)
-  uint8_t dataBeg = 0;   // 0 or start of data (dataBeg-1 is port)
+  // 0 or start of data (dataBeg-1 is port), encrypted until readDownlink()
+  uint8_t dataBeg = 0;
   uint8_t dataLen = 0;   // 0 no data or zero length data, >0 byte count of data
   uint8_t frame[MAX_LEN_FRAME];
 
@@ -353,11 +1120,13 @@ private:
   void setupRx1();
   void setupRx2();
   void schedRx12(OsDeltaTime const &delay, uint8_t dr);
+  void learnRxTiming(uint8_t length);
 
   void txDone(OsDeltaTime const &delay);
 
   void runReset();
   void runEngineUpdate();
+  void rebaseWallClock();
 
 #if !defined(DISABLE_JOIN)
   void onJoinFailed();
@@ -385,13 +1154,106 @@ private:
 
   void reportEvent(ev_t ev);
 
-  void buildDataFrame();
+  void buildDataFrame(dr_t txdr);
+  void txDataDone();
+  void reportTxComplete();
+#if UPLINK_FRAG_SIZE > 0
+  void nextFragment();
+#endif
+#if UPLINK_QUEUE_SIZE > 0
+  int8_t pushTxQueue(uint8_t port, const uint8_t *data, uint8_t dlen,
+                     bool confirmed, uint8_t priority,
+                     OsDeltaTime const &lifetime);
+  bool nextQueuedTx();
+  bool expireQueuedTx(OsTime const &now);
+#endif
+#if TX_AGGREGATE_SIZE > 0
+  uint8_t aggregateMaxLen() const;
+  void sealTxAggregate();
+#endif
+  void releaseTxBuffer(uint8_t id);
+#if APP_PACKAGES
+  bool isPackagePort(uint8_t port) const;
+  void receivePackage(uint8_t port, uint8_t *buf, uint8_t len);
+#endif
+#if MC_GROUP_COUNT > 0
+  uint8_t receiveMcSetup(const uint8_t *buf, uint8_t len, uint8_t *ans,
+                         uint8_t room);
+  uint8_t mcSession(const uint8_t *cmd, uint8_t sessionClass, uint8_t *ans);
+  bool decodeMulticast(uint8_t id);
+#endif
+#if FUOTA_MAX_FRAGS > 0
+  void reportFileDone();
+#endif
+#if ENABLE_CLASS_C
+  void startContinuousRx();
+  void stopContinuousRx();
+  void processContinuousRx();
+  void continuousRxUntil(void (Lmic::*window)());
+  void openRx1();
+  void openRx2();
+#if MC_GROUP_COUNT > 0
+  void scheduleMcSession();
+  void runMcSession();
+#endif
+#endif
+#if ENABLE_CLASS_B
+  void startScan();
+  void startScanRx();
+  void processScan();
+  bool decodeBeacon(BeaconInfo &info) const;
+  void syncBeacon();
+  bool scheduleBeacon();
+  void startRxBeacon();
+  void processBeacon();
+  void startPingSlots();
+  bool nextPingSlot(OsTime const &cando);
+  void startRxPing();
+  void processPing();
+  OsTime beaconPeriodTime(OsDeltaTime const &offset,
+                          OsDeltaTime &error) const;
+  void rxWindow(OsTime const &time, OsDeltaTime const &error, dr_t dr,
+                OsTime &start, uint8_t &syms) const;
+  uint32_t beaconFreq(uint32_t time) const;
+#endif
   void engineUpdate();
   void parseMacCommands(const uint8_t *opts, uint8_t olen);
+  uint8_t encodeMacAnswers(uint8_t *buf, uint8_t room);
+  uint8_t macAnswerCount(MacCommand const &cmd) const;
+  uint8_t macAnswersLength(bool sticky) const;
+  uint8_t validateLinkAdr(const uint8_t *cmd, uint8_t count);
+  void applyLinkAdr(const uint8_t *cmd, uint8_t count, uint8_t status);
+  void applyDutyCycle(const uint8_t *cmd, uint8_t count, uint8_t status);
+  uint8_t validateRxParamSetup(const uint8_t *cmd, uint8_t count);
+  void applyRxParamSetup(const uint8_t *cmd, uint8_t count, uint8_t status);
+  void encodeDevStatus(uint8_t *ans, uint8_t status);
+  uint8_t validateNewChannel(const uint8_t *cmd, uint8_t count);
+  void applyRxTimingSetup(const uint8_t *cmd, uint8_t count, uint8_t status);
+  void applyDeviceTime(const uint8_t *cmd, uint8_t count, uint8_t status);
+  void encodeLinkCheck(uint8_t *ans, uint8_t status);
+  void applyLinkCheck(const uint8_t *cmd, uint8_t count, uint8_t status);
+#if ENABLE_CLASS_B
+  void encodePingSlotInfo(uint8_t *ans, uint8_t status);
+  void applyPingSlotInfo(const uint8_t *cmd, uint8_t count, uint8_t status);
+  uint8_t validatePingSlotChannel(const uint8_t *cmd, uint8_t count);
+  void applyPingSlotChannel(const uint8_t *cmd, uint8_t count,
+                            uint8_t status);
+  void applyBeaconTiming(const uint8_t *cmd, uint8_t count, uint8_t status);
+  uint8_t validateBeaconFreq(const uint8_t *cmd, uint8_t count);
+  void applyBeaconFreq(const uint8_t *cmd, uint8_t count, uint8_t status);
+#endif
+  uint8_t macCommandIndex(uint8_t cid) const;
+  void queueMacRequest(uint8_t cid);
   bool decodeFrame();
   bool processDnData();
 
+  bool retryAllowed() const;
+  uint8_t retryBackoff() const;
   void txDelay(OsTime const &reftime, uint8_t secSpan);
+  void delayTxUntil(OsTime const &time);
+
+  void startChannelActivityDetection(dr_t txdr);
+  void processChannelActivity();
 
   void setDrJoin(dr_t dr);
 
@@ -399,11 +1261,29 @@ public:
   // set default/start DR/txpow
   void setDrTxpow(uint8_t dr, int8_t pow);
   void setLinkCheckMode(bool enabled);
+  // on link loss, probe with LinkCheckReq before each step of recovery
+  void setLinkCheckProbe(bool enabled);
+  // send a LinkCheckReq with the next uplink, the answer comes with
+  // EV_LINK_CHECK
+  void requestLinkCheck();
+  LinkCheck const &getLinkCheck() const { return linkCheck; };
+  // send a DeviceTimeReq with the next uplink
+  void requestDeviceTime();
+  // keep the clock error below maxError [ms] with DeviceTimeReq sent
+  // along the uplinks, 0 to stop
+  void setTimeSync(uint16_t maxError) { timeSyncError = maxError; };
+  WallClock const &getWallClock() const { return wallClock; };
   void setSession(uint32_t netid, devaddr_t devaddr, uint8_t *nwkSKey,
                   uint8_t *artKey);
 
   // set ADR mode (if mobile turn off)
   void setAdrMode(bool enabled);
+  // listen before talk: check channel activity before each LoRa uplink
+  void setLbtMode(bool enabled);
+  LbtStats const &getLbtStats() const { return lbtStats; };
+  void setRetryPolicy(RetryPolicy const &policy);
+  RetryPolicy const &getRetryPolicy() const { return retryPolicy; };
+  RetryStats const &getRetryStats() const { return retryStats; };
 
 #if !defined(DISABLE_JOIN)
   bool startJoining();
@@ -417,19 +1297,109 @@ public:
 
   void clrTxData();
   void setTxData();
-  int8_t setTxData2(uint8_t port, uint8_t *data, uint8_t dlen, bool confirmed);
+  // longest data at a DR, without MAC answers in FOpts
+  uint8_t maxTxPayload(dr_t dr) const;
+  // data is not copied, it has to stay unchanged until EV_TXCOMPLETE.
+  // Return 0, -1 while a queued message is being sent, -2 if too long for
+  // the current DR.
+  int8_t setTxData2(uint8_t port, const uint8_t *data, uint8_t dlen,
+                    bool confirmed);
+  // payload of the last downlink, decrypted on the first read
+  Downlink readDownlink();
+#if UPLINK_QUEUE_SIZE > 0
+  // queue an uplink, data is not copied and has to stay unchanged until
+  // the EV_TXCOMPLETE of its id. Return the id, -1 if the queue is full,
+  // -2 if too long for the current DR. A lifetime of 0 never expires.
+  int8_t queueTxData(uint8_t port, const uint8_t *data, uint8_t dlen,
+                     bool confirmed, uint8_t priority = 0,
+                     OsDeltaTime const &lifetime = OsDeltaTime(0));
+  UplinkQueue const &getTxQueue() const { return txQueue; };
+#endif
+#if UPLINK_FRAG_SIZE > 0
+  // send len bytes of buf in fragments on port, with the parity to recover
+  // from the loss of lossPercent of them. buf is not copied, it has to stay
+  // unchanged until EV_FRAG_DONE. Return 0, -1 if a session is running,
+  // -2 if too long or the fragments with parity above FRAG_MAX_NUMBER.
+  int8_t sendFragmented(uint8_t port, const uint8_t *buf, uint16_t len,
+                        uint8_t lossPercent);
+  // no more fragments, EV_FRAG_DONE comes after the one pending if any
+  void stopFragmented() { fragSession.stop(); };
+  FragSession const &getFragSession() const { return fragSession; };
+#endif
+#if TX_AGGREGATE_SIZE > 0
+  // aggregated payloads go on port, sealed at most latency after their
+  // first record
+  void setAggregation(uint8_t port, OsDeltaTime const &latency);
+  // add a record to the next aggregated payload, data is copied. Return 0,
+  // -1 if the buffer is full, -2 if too long or source above AGG_SOURCE_MAX
+  int8_t aggregateTxData(uint8_t source, const uint8_t *data, uint8_t dlen);
+  // seal the records added so far without waiting for the latency
+  void flushTxData();
+  PayloadAggregator const &getTxAggregate() const { return txAggregate; };
+#endif
+#if FUOTA_MAX_FRAGS > 0
+  FragReceiver const &getFragReceiver() const { return fragReceiver; };
+  // hand the file of EV_UPDATE_READY over to the bootloader with
+  // hal_storage_install(), false if it is not verified
+  bool installUpdate();
+#endif
+#if MC_GROUP_COUNT > 0
+  // receive the downlinks of the multicast group id on addr, keys are
+  // copied. A freq other than 0 opens a class C session on freq and dr
+  // which does not end, setClassC() listens there. With 0 the group waits
+  // for a McClassCSessionReq of the network. A frame of the group in the RX
+  // windows of an uplink comes with EV_RXCOMPLETE. False if id is not below
+  // MC_GROUP_COUNT.
+  bool setMcGroup(uint8_t id, devaddr_t addr, const uint8_t *nwkSKey,
+                  const uint8_t *appSKey, uint32_t freq, dr_t dr);
+  void clearMcGroup(uint8_t id);
+  McGroup const &getMcGroup(uint8_t id) const { return mcGroups[id]; };
+#endif
+#if ENABLE_CLASS_C
+  // class C: listen on the RX2 parameters, or those of a running class C
+  // multicast session, when not sending, also before and between the RX
+  // windows of an uplink. The downlinks received outside of the RX windows
+  // come with EV_RXCOMPLETE. Not while the beacon is tracked.
+  void setClassC(bool enabled);
+#endif
+#if ENABLE_CLASS_B
+  // class B: find the beacon, then track it. tryBcnInfo BeaconTimingReq
+  // go up with the next uplinks first to narrow the scan, 0 scans at once.
+  // The scan ends with EV_BEACON_FOUND or EV_SCAN_TIMEOUT, then each
+  // beacon comes with EV_BEACON_TRACKED or EV_BEACON_MISSED until
+  // EV_LOST_TSYNC. False without session, during a transaction, with
+  // class C or if already tracking.
+  bool enableTracking(uint8_t tryBcnInfo);
+  void disableTracking();
+  // open a ping slot every 2^periodicity s (0-7) once the network answered
+  // PingSlotInfoReq, tracking the beacon if not done yet. The downlinks of
+  // the ping slots come with EV_RXCOMPLETE.
+  void setPingable(uint8_t periodicity);
+  void stopPingable();
+  BeaconInfo const &getBeaconInfo() const { return bcnInfo; };
+#endif
+  // id of the uplink of the last EV_TXCOMPLETE or EV_TXEXPIRED, TXQ_NO_ID
+  // if not queued, TXQ_FRAG_ID for a fragment
+  uint8_t getTxMessageId() const { return txDoneId; };
   void sendAlive();
   void setClockError(uint8_t error);
 
   uint16_t getOpMode() { return opmode; };
+  // RSSI of last received packet in dBm
+  int16_t getRssi() const { return rssi - RSSI_OFF; };
+  // SNR of last received packet in dB * SNR_SCALEUP
+  int8_t getSnr() const { return snr; };
+  LinkQuality const &getLinkQuality() const { return linkQuality; };
+  RxTiming const &getRxTiming() const { return rxTiming; };
+  // MAC answers bytes of the last uplink
+  uint8_t getTxMacLen() const { return txMacLen; };
+  // header, MIC, port and MAC answers bytes of the last uplink
+  uint8_t getTxOverhead() const { return txOverhead; };
 
   void setEventCallBack(eventCallback_t callback) { eventCallBack = callback; };
   void setDevEuiCallback(keyCallback_t callback) { devEuiCallBack = callback; };
   void setArtEuiCallback(keyCallback_t callback) { artEuiCallBack = callback; };
 
-  // for radio to wakeup processing.
-  void nextTask();
-
   Lmic();
 };
 // The state of LMIC MAC layer is encapsulated in this class.
@@ -18,8 +18,6 @@
 
 #define DNW2_SAFETY_ZONE OsDeltaTime::from_ms(750)
 
-#define maxFrameLen(dr)                                                        \
-  ((dr) <= DR_SF11CR ? TABLE_GET_U1(maxFrameLens, (dr)) : 0xFF)
 CONST_TABLE(uint8_t, maxFrameLens)
 [] = {24, 66, 142, 255, 255, 255, 255, 255, 66, 142};
 
@@ -74,6 +72,22 @@ OsDeltaTime LmicUs915::dr2hsym(dr_t dr) {
 
 bool LmicUs915::validRx1DrOffset(uint8_t drOffset) { return drOffset < 4; }
 
+uint8_t LmicUs915::maxFrameLen(dr_t dr) {
+  return dr <= DR_SF11CR ? TABLE_GET_U1(maxFrameLens, dr) : 0xFF;
+}
+
+// channels hopping every beacon period, shifted by devaddr for the ping
+// slots
+uint32_t LmicUs915::beaconFreq(uint32_t time) {
+  return US915_500kHz_DNFBASE +
+         (time / BCN_INTV_sec) % BCN_CHNL_COUNT * US915_500kHz_DNFSTEP;
+}
+
+uint32_t LmicUs915::pingFreq(uint32_t time, devaddr_t devaddr) {
+  return US915_500kHz_DNFBASE + (time / BCN_INTV_sec + devaddr) %
+                                    BCN_CHNL_COUNT * US915_500kHz_DNFSTEP;
+}
+
 // ================================================================================
 //
 // BEG: US915 related stuff
@@ -159,23 +173,27 @@ uint8_t LmicUs915::mapChannels(uint8_t chMaskCntl, uint16_t chMask) {
   return 1;
 }
 
+void LmicUs915::saveChannelMap() {
+  std::copy(channelMap, channelMap + sizeof(channelMap) / sizeof(channelMap[0]),
+            savedChannelMap);
+}
+
+void LmicUs915::restoreChannelMap() {
+  std::copy(savedChannelMap,
+            savedChannelMap + sizeof(channelMap) / sizeof(channelMap[0]),
+            channelMap);
+}
+
 void LmicUs915::updateTx(OsTime const &txbeg, uint8_t globalDutyRate,
                          OsDeltaTime const &airtime, uint8_t txChnl,
                          int8_t adrTxPow, uint32_t &freq, int8_t &txpow,
                          OsTime &globalDutyAvail) {
-  uint8_t chnl = txChnl;
-  if (chnl < 64) {
-    freq = US915_125kHz_UPFBASE + chnl * US915_125kHz_UPFSTEP;
+  freq = getFreq(txChnl);
+  if (txChnl < 64) {
     txpow = 30;
     return;
   }
   txpow = 26;
-  if (chnl < 64 + 8) {
-    freq = US915_500kHz_UPFBASE + (chnl - 64) * US915_500kHz_UPFSTEP;
-  } else {
-    ASSERT(chnl < 64 + 8 + MAX_XCHANNELS);
-    freq = xchFreq[chnl - 72];
-  }
 
   // Update global duty cycle stats
   if (globalDutyRate != 0) {
@@ -183,6 +201,15 @@ void LmicUs915::updateTx(OsTime const &txbeg, uint8_t globalDutyRate,
   }
 }
 
+uint32_t LmicUs915::getFreq(uint8_t chnl) const {
+  if (chnl < 64)
+    return US915_125kHz_UPFBASE + chnl * US915_125kHz_UPFSTEP;
+  if (chnl < 64 + 8)
+    return US915_500kHz_UPFBASE + (chnl - 64) * US915_500kHz_UPFSTEP;
+  ASSERT(chnl < 64 + 8 + MAX_XCHANNELS);
+  return xchFreq[chnl - 72];
+}
+
 // US does not have duty cycling - return now as earliest TX time
 OsTime LmicUs915::nextTx(OsTime const &now, dr_t datarate, uint8_t &txChnl) {
   if (chRnd == 0)
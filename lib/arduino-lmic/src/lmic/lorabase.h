@@ -42,9 +42,16 @@ enum { ILLEGAL_RPS = 0xFF };
 enum { DR_PAGE_EU868 = 0x00 };
 enum { DR_PAGE_US915 = 0x10 };
 
-// Global maximum frame length
+#if !defined(FRAME_BUFFER_SIZE)
+#define FRAME_BUFFER_SIZE 64
+#endif
+#if FRAME_BUFFER_SIZE < 64 || FRAME_BUFFER_SIZE > 255
+#error Illegal FRAME_BUFFER_SIZE - must be in range [64:255].
+#endif
+
 enum { STD_PREAMBLE_LEN = 8 };
-enum { MAX_LEN_FRAME = 64 };
+// Global maximum frame length, longer frames of the region are not sent
+enum { MAX_LEN_FRAME = FRAME_BUFFER_SIZE };
 enum { LEN_DEVNONCE = 2 };
 enum { LEN_ARTNONCE = 3 };
 enum { LEN_NETID = 3 };
@@ -66,6 +73,7 @@ enum { BCN_WINDOW_ms = BCN_INTV_ms - (int)BCN_GUARD_ms - (int)BCN_RESERVE_ms };
 enum { BCN_RESERVE_us = 2120000 };
 enum { BCN_GUARD_us = 3000000 };
 enum { BCN_SLOT_SPAN_us = 30000 };
+enum { BCN_DELAY_us = 1500 }; // beacon sent this late in its period
 
 #if defined(CFG_eu868) // ==============================================
 
@@ -111,13 +119,14 @@ enum { DR_DNW2 = DR_SF12 };
 enum { CHNL_BCN = 5 };
 enum { FREQ_BCN = EU868_F6 };
 enum { DR_BCN = DR_SF9 };
-enum { AIRTIME_BCN = 144384 }; // micros
+enum { AIRTIME_BCN = 152576 }; // micros
+enum { BCN_CHNL_COUNT = 1 };   // beacon channels
 
 enum {
   // Beacon frame format EU SF9
-  OFF_BCN_NETID = 0,
-  OFF_BCN_TIME = 3,
-  OFF_BCN_CRC1 = 7,
+  OFF_BCN_RFU = 0,
+  OFF_BCN_TIME = 2,
+  OFF_BCN_CRC1 = 6,
   OFF_BCN_INFO = 8,
   OFF_BCN_LAT = 9,
   OFF_BCN_LON = 12,
@@ -162,27 +171,28 @@ enum {
 enum {
   FREQ_PING = US915_500kHz_DNFBASE + CHNL_PING * US915_500kHz_DNFSTEP
 };                            // default ping freq
-enum { DR_PING = DR_SF10CR }; // default ping DR
+enum { DR_PING = DR_SF12CR }; // default ping DR
 enum { CHNL_DNW2 = 0 };
 enum { FREQ_DNW2 = US915_500kHz_DNFBASE + CHNL_DNW2 * US915_500kHz_DNFSTEP };
 enum { DR_DNW2 = DR_SF12CR };
 enum {
   CHNL_BCN = 0
 }; // used only for default init of state (rotating beacon scheme)
-enum { DR_BCN = DR_SF10CR };
-enum { AIRTIME_BCN = 72192 }; // micros
+enum { DR_BCN = DR_SF12CR };
+enum { AIRTIME_BCN = 305152 }; // micros
+enum { BCN_CHNL_COUNT = 8 };   // beacon channels, one per period in turn
 
 enum {
-  // Beacon frame format US SF10
-  OFF_BCN_NETID = 0,
-  OFF_BCN_TIME = 3,
-  OFF_BCN_CRC1 = 7,
-  OFF_BCN_INFO = 9,
-  OFF_BCN_LAT = 10,
-  OFF_BCN_LON = 13,
-  OFF_BCN_RFU1 = 16,
-  OFF_BCN_CRC2 = 17,
-  LEN_BCN = 19
+  // Beacon frame format US SF12
+  OFF_BCN_RFU = 0,
+  OFF_BCN_TIME = 5,
+  OFF_BCN_CRC1 = 9,
+  OFF_BCN_INFO = 11,
+  OFF_BCN_LAT = 12,
+  OFF_BCN_LON = 15,
+  OFF_BCN_RFU1 = 18,
+  OFF_BCN_CRC2 = 21,
+  LEN_BCN = 23
 };
 
 #endif // ===================================================
@@ -222,7 +232,10 @@ enum {
   DIR_UP = 0,
   DIR_DOWN = 1,
 };
-enum { MAX_LEN_PAYLOAD = MAX_LEN_FRAME - (int)OFF_DAT_OPTS - 4 };
+// application payload in a frame without FOpts, after the port
+enum {
+  MAX_LEN_PAYLOAD = MAX_LEN_FRAME - (int)OFF_DAT_OPTS - 1 - (int)MIC_LEN
+};
 enum {
   // Bitfields in frame format octet
   HDR_FTYPE = 0xE0,
@@ -272,11 +285,13 @@ enum {
   MCMD_SNCH_ANS = 0x07, // -  set new channel    : u1: 7-2=RFU, 1/0:DR/freq ACK
   // Ack to new RX 1 timing.
   MCMD_RXTimingSetup_ANS = 0x08,
+  // network time request : -
+  MCMD_DeviceTime_REQ = 0x0D,
   // Class B
-  MCMD_PING_IND =
-      0x10, // -  pingability indic  : u1: 7=RFU, 6-4:interval, 3-0:datarate
-  MCMD_PING_ANS = 0x11, // -  ack ping freq      : u1: 7-1:RFU, 0:freq ok
+  MCMD_PING_IND = 0x10, // -  pingability indic  : u1: 7-3:RFU, 2-0:period
+  MCMD_PING_ANS = 0x11, // -  ack ping freq      : u1: 7-2:RFU, 1:DR, 0:freq
   MCMD_BCNI_REQ = 0x12, // -  next beacon start  : -
+  MCMD_BeaconFreq_ANS = 0x13, // -  ack beacon freq : u1: 7-1:RFU, 0:freq ok
 };
 
 // MAC downlink commands
@@ -298,10 +313,16 @@ enum {
   MCMD_RXTimingSetup_REQ = 0x08,
   //  set the maximum allowed dwell time
   MCMD_TxParamSetup_REQ = 0x09,
+  // change the RX1 frequency of a channel: u1:chidx, u3:freq
+  MCMD_DlChannel_REQ = 0x0A,
+  // network time       : u4:GPS seconds, u1:fraction 1/256 s
+  MCMD_DeviceTime_ANS = 0x0D,
   // Class B
-  MCMD_PING_SET = 0x11, // set ping freq      : u3: freq
+  MCMD_PING_INFO_ANS = 0x10, // ack pingability   : -
+  MCMD_PING_SET = 0x11,      // set ping freq      : u3: freq, u1:DR
   MCMD_BCNI_ANS =
       0x12, // next beacon start  : u2: delay(in TUNIT millis), u1:channel
+  MCMD_BeaconFreq_REQ = 0x13, // set beacon freq    : u3: freq
 };
 
 enum {
@@ -324,7 +345,12 @@ enum {
   MCMD_SNCH_ANS_DRACK = 0x02, // 0=unknown data rate
   MCMD_SNCH_ANS_FQACK = 0x01, // 0=rejected channel frequency
 };
-enum { MCMD_PING_ANS_RFU = 0xFE, MCMD_PING_ANS_FQACK = 0x01 };
+enum {
+  MCMD_PING_ANS_RFU = 0xFC,   // RFU bits
+  MCMD_PING_ANS_DRACK = 0x02, // 0=unknown data rate
+  MCMD_PING_ANS_FQACK = 0x01, // 0=rejected ping frequency
+};
+enum { MCMD_BeaconFreq_ANS_FQACK = 0x01 }; // 0=rejected beacon frequency
 
 enum {
   MCMD_DEVS_EXT_POWER = 0x00,   // external power supply
@@ -403,7 +429,7 @@ inline dr_t lowerDR(dr_t dr, uint8_t n) {
 // ================================================================================
 
 // Calculate airtime
-OsDeltaTime calcAirTime(uint8_t plen);
+OsDeltaTime calcAirTime(rps_t rps, uint8_t plen);
 // Sensitivity at given SF/BW
 int16_t getSensitivity(rps_t rps);
 
@@ -128,6 +128,9 @@ OsDeltaTime OsScheduler::runloopOnce() {
   }
   if (runnablejobs) {
     return 0;
+  } else if (!scheduledjobs) {
+    // nothing to do until an interrupt
+    return OsDeltaTime::from_sec(60 * 60);
   } else {
     // return the number of milisecond to wait ()
     return scheduledjobs->deadline - hal_ticks();
@@ -79,6 +79,9 @@ uint8_t os_getBattLevel(void);
 #define TABLE_GET_S4(table, index) table_get_s4(RESOLVE_TABLE(table), index)
 #define TABLE_GET_U1_TWODIM(table, index1, index2)                             \
   table_get_u1(RESOLVE_TABLE(table)[index1], index2)
+// copy of a whole element, for tables of structs
+#define TABLE_GET_STRUCT(table, index)                                         \
+  table_get_struct(RESOLVE_TABLE(table), index)
 
 #if defined(__AVR__)
 #include <avr/pgmspace.h>
@@ -97,8 +100,17 @@ TABLE_GETTER(_s1, int8_t, byte);
 TABLE_GETTER(_u4, uint32_t, dword);
 TABLE_GETTER(_s4, int32_t, dword);
 
+template <class T> inline T table_get_struct(const T *table, size_t index) {
+  T value;
+  memcpy_P(&value, &table[index], sizeof(T));
+  return value;
+}
+
 // For AVR, store constants in PROGMEM, saving on RAM usage
 #define CONST_TABLE(type, name) const type PROGMEM RESOLVE_TABLE(name)
+// Define a table declared as static member of cls
+#define CONST_TABLE_MEMBER(type, cls, name)                                    \
+  const type PROGMEM cls::RESOLVE_TABLE(name)
 
 #define lmic_printf(fmt, ...) printf_P(PSTR(fmt), ##__VA_ARGS__)
 
@@ -115,9 +127,13 @@ inline uint32_t table_get_u4(const uint32_t *table, size_t index) {
 inline int32_t table_get_s4(const int32_t *table, size_t index) {
   return table[index];
 }
+template <class T> inline T table_get_struct(const T *table, size_t index) {
+  return table[index];
+}
 
 // Declare a table
 #define CONST_TABLE(type, name) const type RESOLVE_TABLE(name)
+#define CONST_TABLE_MEMBER(type, cls, name) const type cls::RESOLVE_TABLE(name)
 #define lmic_printf printf
 #endif
 
@@ -5,30 +5,408 @@
 #include "osticks.h"
 #include <stdint.h>
 
-class Radio {
+// Radio drivers. The MAC uses the type Radio, chosen at compile time from
+// the following implementations, which all provide the same members:
+//
+//   void init();                  reset and configure the chip, then sleep
+//   void sleep();                 abort any operation and sleep
+//   void standby();               abort any operation and stay in standby
+//   void tx(freq, rps, txpow);    send frame
+//   void rx(freq, rps, rxsyms, rxtime);    single rx at rxtime
+//   void rxon(freq, rps, rxsyms, rxtime);  continuous rx
+//   void cad(freq, rps);          channel activity detection
+//   void sniff(freq, rps, interval);       low power listening
+//   bool cadDetected();           result of the last cad
+//   void irq_handler(dio, trigger);        called by the HAL on a DIO edge
+//   void init_random(randbuf);    fill randbuf with 15 random bytes
+//   uint8_t rssi();               current RSSI [dBm] + 157, while rx() or
+//                                 rxon() listen (0 on the SX126x otherwise)
+//   uint8_t txCurrent(txpow);     supply current [mA] to send at txpow
+//
+// Once an operation is over, its results (frame length, tx end, rx time,
+// packet RSSI and SNR) are stored in the references given at construction
+// and the completion job is made runnable.
+//
+// Low power listening (LoRa only): the receiver wakes every interval for a
+// CAD and only stays in RX if it detects a preamble. The completion job
+// runs once a frame is received, sleep() stops listening, no other
+// operation may be started meanwhile. Senders have to use a preamble
+// longer than the interval, setTxPreamble(sniffPreamble(rps, interval)).
+//
+// Drivers which can measure the frequency error of received frames feed it
+// to addFreqError(), all drivers program correctedFreq(freq). They record
+// their operations with journalBegin() and journalEnd(), and the LoRa
+// frames sent and received with captureFrame().
 
+// preamble of LoRaWAN frames [symbols]
+enum { LORA_PREAMBLE = 8 };
+// time allowed to the receiver to lock on a detected preamble [symbols]
+enum { SNIFF_RX_SYMS = 8 };
+
+#if !defined(RADIO_JOURNAL_SIZE)
+#define RADIO_JOURNAL_SIZE 0
+#endif
+
+// Radio operations recorded in the journal
+enum {
+  RADIO_EV_TX,         // frame sent
+  RADIO_EV_RX,         // frame received
+  RADIO_EV_RX_TIMEOUT, // nothing received in the window
+  RADIO_EV_CAD,        // channel activity detection
+  RADIO_EV_ABORT,      // operation stopped by sleep() or standby()
+};
+
+struct RadioEvent {
+  // TX start, RX window opening or CAD start
+  OsTime start;
+  // measured until the IRQ: compare TX and RX with calcAirTime(rps, length)
+  OsDeltaTime duration;
+  uint32_t freq;
+  rps_t rps;
+  uint8_t op;
+  // IRQ flags of the chip at the end
+  uint16_t flags;
+  uint8_t length;
+  // packet RSSI [dBm] + RSSI_OFF and SNR [dB] * SNR_SCALEUP of RX
+  int8_t rssi;
+  int8_t snr;
+};
+
+#if RADIO_JOURNAL_SIZE > 0
+// Ring of the last radio operations, the oldest are overwritten.
+class RadioJournal {
+public:
+  void begin(uint8_t op, uint32_t freq, rps_t rps, OsTime const &start);
+  // end the operation begun, op may differ from the one of begin()
+  void end(uint8_t op, uint16_t flags, OsTime const &time, uint8_t length,
+           int8_t rssi, int8_t snr);
+
+  // copy up to max events, oldest first, return the number copied
+  uint8_t snapshot(RadioEvent *dest, uint8_t max) const;
+  // take out the oldest event, false if there is none
+  bool read(RadioEvent &event);
+  void clear();
+  // events overwritten before being read
+  uint16_t lost() const { return overwritten; };
+
+private:
+  RadioEvent events[RADIO_JOURNAL_SIZE];
+  uint8_t first = 0;
+  uint8_t count = 0;
+  uint16_t overwritten = 0;
+  // operation in progress
+  RadioEvent current;
+  bool pending = false;
+};
+#endif
+
+#if !defined(RADIO_CAPTURE_SIZE)
+#define RADIO_CAPTURE_SIZE 0
+#endif
+
+// pcap file header and record header [bytes]
+enum { PCAP_FILE_HEADER_LEN = 24, PCAP_RECORD_HEADER_LEN = 16 };
+// LoRaTap version 0 header [bytes]
+enum { LORATAP_HEADER_LEN = 15 };
+
+#if RADIO_CAPTURE_SIZE > 0
+// Byte stream of the LoRa frames sent and received, as pcap records with a
+// LoRaTap header (link type 270), which Wireshark decodes up to the
+// LoRaWAN MAC. Records are only copied in the buffer from the interrupt,
+// the application drains it to its sink (serial port, file) with read(),
+// after writing fileHeader() once.
+class RadioCapture {
+public:
+  static void fileHeader(uint8_t header[PCAP_FILE_HEADER_LEN]);
+
+  // time is the TX start or the RX end, rssi [dBm] + RSSI_OFF and snr
+  // [dB] * SNR_SCALEUP are only used if rx
+  void record(bool rx, uint32_t freq, rps_t rps, int8_t rssi, int8_t snr,
+              OsTime const &time, const uint8_t *frame, uint8_t length);
+
+  // take out up to max bytes of the stream, return the number taken
+  uint16_t read(uint8_t *dest, uint16_t max);
+  void clear();
+  // records dropped because the buffer was full
+  uint16_t lost() const { return dropped; };
+
+private:
+  uint8_t buffer[RADIO_CAPTURE_SIZE];
+  uint16_t first = 0;
+  uint16_t count = 0;
+  uint16_t dropped = 0;
+
+  void put(uint8_t byte);
+  void putLe32(uint32_t value);
+};
+#endif
+
+// State shared by the radio drivers
+class RadioState {
+public:
+  bool cadDetected() const { return channelBusy; };
+
+  // estimated offset of the crystal [ppb], positive if it runs fast
+  int32_t freqOffset() const { return oscOffset; };
+  // number of frequency errors in the estimate, a restored offset counts
+  // as one
+  uint16_t freqErrorCount() const { return freqErrors; };
+  // restore an offset saved with freqOffset(), e.g. across power cycles
+  void setFreqOffset(int32_t offset) {
+    oscOffset = offset;
+    freqErrors = 1;
+  };
+
+  // preamble of the LoRa frames sent [symbols], 0 for LORA_PREAMBLE
+  void setTxPreamble(uint16_t symbols) { txPreamble = symbols; };
+  // preamble a receiver sniffing every interval is sure to catch
+  static uint16_t sniffPreamble(rps_t rps, OsDeltaTime const &interval);
+
+#if RADIO_JOURNAL_SIZE > 0
+  RadioJournal journal;
+#endif
+#if RADIO_CAPTURE_SIZE > 0
+  RadioCapture capture;
+#endif
+
+protected:
+  RadioState(uint8_t *frame, uint8_t &frameLength, OsTime &txEnd,
+             OsTime &rxTime, int8_t &rssi, int8_t &snr, OsJobBase &done)
+      : framePtr(frame), frameLength(frameLength), txEnd(txEnd),
+        rxTime(rxTime), packetRssi(rssi), packetSnr(snr), done(done){};
+
+  uint8_t *framePtr = nullptr;
+  uint8_t &frameLength;
+
+  OsTime &txEnd;
+  OsTime &rxTime;
+  // packet RSSI [dBm] + RSSI_OFF
+  int8_t &packetRssi;
+  // packet SNR [dB] * SNR_SCALEUP
+  int8_t &packetSnr;
+  // run when an operation is over
+  OsJobBase &done;
+
+  rps_t currentRps;
+  uint32_t currentFreq = 0;
+  // result of last channel activity detection
+  bool channelBusy = false;
+
+  int32_t oscOffset = 0;
+  uint16_t freqErrors = 0;
+
+  uint16_t txPreamble = 0;
+  enum { SNIFF_OFF, SNIFF_CAD, SNIFF_RX };
+  uint8_t sniffState = SNIFF_OFF;
+  OsDeltaTime sniffInterval;
+  // time of the next wake up
+  OsTime sniffNext;
+
+  uint16_t txPreambleSyms() const {
+    return txPreamble ? txPreamble : (uint16_t)LORA_PREAMBLE;
+  };
+  // nothing caught, set sniffNext to the next wake up
+  void sniffSchedule();
+
+  // frequency to program to get freq on air
+  uint32_t correctedFreq(uint32_t freq) const;
+  // error: received signal above the receiver [Hz], on channel freq
+  void addFreqError(int32_t error, uint32_t freq);
+
+  void journalBegin(uint8_t op, uint32_t freq, rps_t rps,
+                    OsTime const &start) {
+#if RADIO_JOURNAL_SIZE > 0
+    journal.begin(op, freq, rps, start);
+#endif
+  };
+  // length, RSSI and SNR are taken from the results
+  void journalEnd(uint8_t op, uint16_t flags, OsTime const &time) {
+#if RADIO_JOURNAL_SIZE > 0
+    journal.end(op, flags, time, frameLength, packetRssi, packetSnr);
+#endif
+  };
+  // frame of the current operation, rx true to add RSSI and SNR
+  void captureFrame(bool rx, uint32_t freq, rps_t rps, OsTime const &time) {
+#if RADIO_CAPTURE_SIZE > 0
+    if (rps.sf != FSK && frameLength > 0) {
+      capture.record(rx, freq, rps, packetRssi, packetSnr, time, framePtr,
+                     frameLength);
+    }
+#endif
+  };
+};
+
+// SX1272/SX1273
+struct Sx1272 {
+  enum { VERSION = 0x22 };
+  // level of the RST pin to reset the chip
+  enum { RST_ACTIVE = 1 };
+  enum { OPMODE_BASE = 0x00 };
+  enum { LNA_RX_GAIN = 0x20 | 0x03 };
+  enum { RSSI_MODEM_CONFIG2 = 0x74 };
+  // RSSI [dBm] = offset + LORARegPktRssiValue
+  enum { RSSI_OFFSET_HF = -139, RSSI_OFFSET_LF = -139 };
+  enum { RSSI_LF_MAX_FREQ = 0 };
+  enum { REG_PA_DAC = 0x5A };
+  // RegPaConfig on RFO: Pout = OutputPower - 1
+  enum { RFO_CONFIG = 0x00, RFO_OUTPUT_OFFSET = 1 };
+
+  static void configLoraModem(rps_t rps);
+};
+
+// SX1276/SX1277/SX1278/SX1279
+struct Sx1276 {
+  enum { VERSION = 0x12 };
+  enum { RST_ACTIVE = 0 };
+  enum { OPMODE_BASE = 0x08 }; // TBD: sx1276 high freq
+  enum { LNA_RX_GAIN = 0x20 | 0x01 };
+  enum { RSSI_MODEM_CONFIG2 = 0x70 };
+  // high frequency port (RFO_HF/RFI_HF) and low frequency port
+  enum { RSSI_OFFSET_HF = -157, RSSI_OFFSET_LF = -164 };
+  enum { RSSI_LF_MAX_FREQ = 525000000 };
+  enum { REG_PA_DAC = 0x4D };
+  // RegPaConfig on RFO: MaxPower 7 (15dBm), Pout = OutputPower
+  enum { RFO_CONFIG = 0x70, RFO_OUTPUT_OFFSET = 0 };
+
+  static void configLoraModem(rps_t rps);
+};
+
+// SX127x family, register interface. Chip gives the differences between
+// the variants.
+template <class Chip> class RadioSx127x : public RadioState {
 public:
-  void init(void);
-  void rst();
+  void init();
+  void sleep();
+  void standby();
   void tx(uint32_t freq, rps_t rps, int8_t txpow);
   void rx(uint32_t freq, rps_t rps, uint8_t rxsyms, OsTime const &rxtime);
   void rxon(uint32_t freq, rps_t rps, uint8_t rxsyms, OsTime const &rxtime);
+  void cad(uint32_t freq, rps_t rps);
+  void sniff(uint32_t freq, rps_t rps, OsDeltaTime const &interval);
 
   void irq_handler(uint8_t dio, OsTime const &trigger);
   void init_random(uint8_t randbuf[16]);
 
   uint8_t rssi();
+  uint8_t txCurrent(int8_t txpow) const;
 
-  Radio(uint8_t *frame, uint8_t &frameLength, OsTime &txend, OsTime &rxTime);
+  RadioSx127x(uint8_t *frame, uint8_t &frameLength, OsTime &txend,
+              OsTime &rxTime, int8_t &rssi, int8_t &snr, OsJobBase &done)
+      : RadioState(frame, frameLength, txend, rxTime, rssi, snr, done){};
 
 private:
-  uint8_t *framePtr = nullptr;
-  uint8_t &frameLength;
+  // FSK reception: the frame is read in chunks, the timeout is run by a job
+  OsJobType<RadioSx127x> fskRxTimeoutJob{*this, OSS};
+  bool fskLengthRead = false;
+  bool fskRxExtended = false;
+  uint8_t fskRxLength = 0;
+  uint8_t fskRxCount = 0;
 
-  OsTime &txEnd;
-  OsTime &rxTime;
+  OsJobType<RadioSx127x> sniffJob{*this, OSS};
 
-  rps_t currentRps;
+  void readPacketQuality();
+  void readFskFifo(bool complete);
+  void fskRxTimeout();
+  void sniffWake();
+  bool sniffContinue(OsTime const &now);
 };
 
-#endif
\ No newline at end of file
+using RadioSx1272 = RadioSx127x<Sx1272>;
+using RadioSx1276 = RadioSx127x<Sx1276>;
+
+// SX1261/SX1262, command interface
+class RadioSx126x : public RadioState {
+public:
+  void init();
+  void sleep();
+  void standby();
+  void tx(uint32_t freq, rps_t rps, int8_t txpow);
+  void rx(uint32_t freq, rps_t rps, uint8_t rxsyms, OsTime const &rxtime);
+  void rxon(uint32_t freq, rps_t rps, uint8_t rxsyms, OsTime const &rxtime);
+  void cad(uint32_t freq, rps_t rps);
+  void sniff(uint32_t freq, rps_t rps, OsDeltaTime const &interval);
+
+  void irq_handler(uint8_t dio, OsTime const &trigger);
+  void init_random(uint8_t randbuf[16]);
+
+  uint8_t rssi();
+  uint8_t txCurrent(int8_t txpow) const;
+
+  RadioSx126x(uint8_t *frame, uint8_t &frameLength, OsTime &txend,
+              OsTime &rxTime, int8_t &rssi, int8_t &snr, OsJobBase &done)
+      : RadioState(frame, frameLength, txend, rxTime, rssi, snr, done){};
+
+private:
+  OsJobType<RadioSx126x> sniffJob{*this, OSS};
+
+  void readPacketQuality();
+  void sniffWake();
+  bool sniffContinue(OsTime const &now);
+};
+
+// No hardware: records what the MAC asks for, the operations are finished
+// by the caller (tests, simulations).
+class RadioMock : public RadioState {
+public:
+  enum Op { OP_SLEEP, OP_STANDBY, OP_TX, OP_RX, OP_RXON, OP_CAD, OP_SNIFF };
+
+  void init();
+  void sleep();
+  void standby();
+  void tx(uint32_t freq, rps_t rps, int8_t txpow);
+  void rx(uint32_t freq, rps_t rps, uint8_t rxsyms, OsTime const &rxtime);
+  void rxon(uint32_t freq, rps_t rps, uint8_t rxsyms, OsTime const &rxtime);
+  void cad(uint32_t freq, rps_t rps);
+  // a single listening, ended by completeRx()
+  void sniff(uint32_t freq, rps_t rps, OsDeltaTime const &interval);
+
+  void irq_handler(uint8_t dio, OsTime const &trigger){};
+  void init_random(uint8_t randbuf[16]);
+
+  uint8_t rssi() { return 0; };
+  // no current model
+  uint8_t txCurrent(int8_t txpow) const { return 0; };
+
+  // last operation asked by the MAC and its parameters
+  Op operation() const { return op; };
+  uint32_t freq() const { return currentFreq; };
+  rps_t rps() const { return currentRps; };
+  int8_t txPower() const { return txPow; };
+  uint8_t rxSymbols() const { return rxSyms; };
+  OsTime const &rxStart() const { return rxAt; };
+  const uint8_t *txFrame() const { return framePtr; };
+  uint8_t txLength() const { return frameLength; };
+
+  // finish the current operation, as the chip interrupt would
+  void completeTx(OsTime const &end);
+  void completeRx(OsTime const &end, const uint8_t *data, uint8_t len,
+                  int8_t rssi, int8_t snr);
+  void timeoutRx();
+  void completeCad(bool detected);
+
+  RadioMock(uint8_t *frame, uint8_t &frameLength, OsTime &txend,
+            OsTime &rxTime, int8_t &rssi, int8_t &snr, OsJobBase &done)
+      : RadioState(frame, frameLength, txend, rxTime, rssi, snr, done){};
+
+private:
+  Op op = OP_SLEEP;
+  int8_t txPow = 0;
+  uint8_t rxSyms = 0;
+  OsTime rxAt;
+
+  void finish();
+};
+
+#if defined(CFG_sx1276_radio)
+using Radio = RadioSx1276;
+#elif defined(CFG_sx1272_radio)
+using Radio = RadioSx1272;
+#elif defined(CFG_sx126x_radio)
+using Radio = RadioSx126x;
+#elif defined(CFG_mock_radio)
+using Radio = RadioMock;
+#else
+#error Missing CFG_sx1272_radio/CFG_sx1276_radio/CFG_sx126x_radio/CFG_mock_radio
+#endif
+
+#endif
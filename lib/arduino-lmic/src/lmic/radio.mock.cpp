@@ -0,0 +1,112 @@
+//! \file
+//! Radio driver without hardware.
+//!
+//! Operations are only recorded, the caller ends them with completeTx(),
+//! completeRx(), timeoutRx() or completeCad() at the time of its choice,
+//! which is what the chip interrupt would do.
+#include "radio.h"
+#include "lmic.h"
+#include <string.h>
+
+void RadioMock::init() { op = OP_SLEEP; }
+
+void RadioMock::sleep() {
+  op = OP_SLEEP;
+  journalEnd(RADIO_EV_ABORT, 0, os_getTime());
+}
+
+void RadioMock::standby() {
+  op = OP_STANDBY;
+  journalEnd(RADIO_EV_ABORT, 0, os_getTime());
+}
+
+void RadioMock::tx(uint32_t freq, rps_t rps, int8_t txpow) {
+  op = OP_TX;
+  currentFreq = freq;
+  currentRps = rps;
+  txPow = txpow;
+  OsTime now = os_getTime();
+  journalBegin(RADIO_EV_TX, freq, rps, now);
+  captureFrame(false, freq, rps, now);
+}
+
+void RadioMock::rx(uint32_t freq, rps_t rps, uint8_t rxsyms,
+                   OsTime const &rxtime) {
+  op = OP_RX;
+  currentFreq = freq;
+  currentRps = rps;
+  rxSyms = rxsyms;
+  rxAt = rxtime;
+  journalBegin(RADIO_EV_RX, freq, rps, rxtime);
+}
+
+void RadioMock::rxon(uint32_t freq, rps_t rps, uint8_t rxsyms,
+                     OsTime const &rxtime) {
+  rx(freq, rps, rxsyms, rxtime);
+  op = OP_RXON;
+}
+
+void RadioMock::cad(uint32_t freq, rps_t rps) {
+  op = OP_CAD;
+  currentFreq = freq;
+  currentRps = rps;
+  channelBusy = false;
+  journalBegin(RADIO_EV_CAD, freq, rps, os_getTime());
+}
+
+void RadioMock::sniff(uint32_t freq, rps_t rps, OsDeltaTime const &interval) {
+  op = OP_SNIFF;
+  currentFreq = freq;
+  currentRps = rps;
+  journalBegin(RADIO_EV_RX, freq, rps, os_getTime());
+}
+
+// no noise to sample, the seed is fixed
+void RadioMock::init_random(uint8_t randbuf[16]) {
+  for (uint8_t i = 1; i < 16; i++) {
+    randbuf[i] = i;
+  }
+  randbuf[0] = 16; // set initial index
+}
+
+void RadioMock::completeTx(OsTime const &end) {
+  ASSERT(op == OP_TX);
+  txEnd = end;
+  journalEnd(RADIO_EV_TX, 0, end);
+  finish();
+}
+
+void RadioMock::completeRx(OsTime const &end, const uint8_t *data,
+                           uint8_t len, int8_t rssi, int8_t snr) {
+  ASSERT(op == OP_RX || op == OP_RXON || op == OP_SNIFF);
+  // for security clamp length of data
+  len = len < MAX_LEN_FRAME ? len : MAX_LEN_FRAME;
+  memcpy(framePtr, data, len);
+  frameLength = len;
+  rxTime = end;
+  packetRssi = rssi;
+  packetSnr = snr;
+  journalEnd(RADIO_EV_RX, 0, end);
+  captureFrame(true, currentFreq, currentRps, end);
+  finish();
+}
+
+void RadioMock::timeoutRx() {
+  ASSERT(op == OP_RX);
+  frameLength = 0;
+  journalEnd(RADIO_EV_RX_TIMEOUT, 0, os_getTime());
+  finish();
+}
+
+void RadioMock::completeCad(bool detected) {
+  ASSERT(op == OP_CAD);
+  channelBusy = detected;
+  journalEnd(RADIO_EV_CAD, 0, os_getTime());
+  finish();
+}
+
+void RadioMock::finish() {
+  op = OP_SLEEP;
+  // run os job (use preset func ptr)
+  done.setRunnable();
+}
@@ -0,0 +1,656 @@
+//! \file
+//! SX1261/SX1262 radio driver.
+//!
+//! The chip is driven by commands over SPI, every command has to wait until
+//! BUSY is low. All interrupts are routed to DIO1, which must be connected
+//! to lmic_pins.dio[0]. Between operations the chip is kept in warm start
+//! sleep.
+#include "radio.h"
+#include "lmic.h"
+#include "sx126x.h"
+
+// Define to the SetDIO3AsTcxoCtrl voltage code if the board has a TCXO
+// powered from DIO3 (e.g. 0x02 for 1.8V).
+// #define SX126X_TCXO_VOLTAGE 0x02
+// Define if DIO2 drives the antenna switch.
+// #define SX126X_DIO2_RF_SWITCH
+// Define to use the LDO instead of the DC-DC regulator, for boards
+// without the inductor.
+// #define SX126X_USE_LDO
+
+// LoRaWAN FSK: 50kbps, 25kHz deviation, 5 bytes preamble, sync word C194C1
+#define FSK_BITRATE 0x005000 // 32 * FXTAL / 50kbps
+#define FSK_FDEV 0x006666    // 25kHz * 2^25 / FXTAL
+#define FSK_PREAMBLE 5
+// time to send one byte at 50kbps
+#define FSK_BYTE_US 160
+
+// TCXO start up time, in steps of 15.625us
+#define TCXO_DELAY 320 // 5ms
+
+// image calibration for the band
+#if defined(CFG_eu868)
+#define CALIBRATE_IMAGE_FREQ1 0xD7 // 863MHz
+#define CALIBRATE_IMAGE_FREQ2 0xDB // 870MHz
+#elif defined(CFG_us915)
+#define CALIBRATE_IMAGE_FREQ1 0xE1 // 902MHz
+#define CALIBRATE_IMAGE_FREQ2 0xE9 // 928MHz
+#endif
+
+// CAD detection peak per SF (AN1200.48)
+static CONST_TABLE(uint8_t, CAD_DET_PEAK)[] = {
+    0,  // FSK -- not used
+    22, // SF7
+    22, // SF8
+    24, // SF9
+    25, // SF10
+    25, // SF11
+    28, // SF12
+};
+#define CAD_DET_MIN 10
+
+// chip is in sleep mode, the next access has to wake it up
+static bool sleeping = false;
+
+static void waitBusy() {
+  while (hal_pin_busy())
+    ;
+}
+
+// wake the chip from sleep with a falling NSS edge
+static void wakeup() {
+  if (!sleeping)
+    return;
+  hal_pin_nss(0);
+  hal_spi(SX126X_CMD_GET_STATUS);
+  hal_spi(0x00);
+  hal_pin_nss(1);
+  sleeping = false;
+  waitBusy();
+}
+
+static void writeCmd(uint8_t cmd, const uint8_t *data, uint8_t len) {
+  waitBusy();
+  hal_pin_nss(0);
+  hal_spi(cmd);
+  for (uint8_t i = 0; i < len; i++) {
+    hal_spi(data[i]);
+  }
+  hal_pin_nss(1);
+}
+
+static void readCmd(uint8_t cmd, uint8_t *data, uint8_t len) {
+  waitBusy();
+  hal_pin_nss(0);
+  hal_spi(cmd);
+  // status
+  hal_spi(0x00);
+  for (uint8_t i = 0; i < len; i++) {
+    data[i] = hal_spi(0x00);
+  }
+  hal_pin_nss(1);
+}
+
+static void writeCmd1(uint8_t cmd, uint8_t param) { writeCmd(cmd, &param, 1); }
+
+// mode of the chip in its status, SX126X_STATUS_MODE_*
+static uint8_t chipMode() {
+  waitBusy();
+  hal_pin_nss(0);
+  hal_spi(SX126X_CMD_GET_STATUS);
+  uint8_t status = hal_spi(0x00);
+  hal_pin_nss(1);
+  return status & SX126X_STATUS_MODE_MASK;
+}
+
+static void writeRegs(uint16_t addr, const uint8_t *data, uint8_t len) {
+  waitBusy();
+  hal_pin_nss(0);
+  hal_spi(SX126X_CMD_WRITE_REGISTER);
+  hal_spi(addr >> 8);
+  hal_spi(addr & 0xFF);
+  for (uint8_t i = 0; i < len; i++) {
+    hal_spi(data[i]);
+  }
+  hal_pin_nss(1);
+}
+
+static void writeReg(uint16_t addr, uint8_t data) {
+  writeRegs(addr, &data, 1);
+}
+
+static uint8_t readReg(uint16_t addr) {
+  waitBusy();
+  hal_pin_nss(0);
+  hal_spi(SX126X_CMD_READ_REGISTER);
+  hal_spi(addr >> 8);
+  hal_spi(addr & 0xFF);
+  // status
+  hal_spi(0x00);
+  uint8_t val = hal_spi(0x00);
+  hal_pin_nss(1);
+  return val;
+}
+
+static void writeBuf(uint8_t offset, const uint8_t *buf, uint8_t len) {
+  waitBusy();
+  hal_pin_nss(0);
+  hal_spi(SX126X_CMD_WRITE_BUFFER);
+  hal_spi(offset);
+  for (uint8_t i = 0; i < len; i++) {
+    hal_spi(buf[i]);
+  }
+  hal_pin_nss(1);
+}
+
+static void readBuf(uint8_t offset, uint8_t *buf, uint8_t len) {
+  waitBusy();
+  hal_pin_nss(0);
+  hal_spi(SX126X_CMD_READ_BUFFER);
+  hal_spi(offset);
+  // status
+  hal_spi(0x00);
+  for (uint8_t i = 0; i < len; i++) {
+    buf[i] = hal_spi(0x00);
+  }
+  hal_pin_nss(1);
+}
+
+static void setStandby() {
+  wakeup();
+  writeCmd1(SX126X_CMD_SET_STANDBY, SX126X_STANDBY_RC);
+}
+
+// sleep keeping the configuration, so that the next operation starts quickly
+static void setSleep() {
+  writeCmd1(SX126X_CMD_SET_SLEEP, SX126X_SLEEP_WARM_START);
+  sleeping = true;
+}
+
+static void writeCmd24(uint8_t cmd, uint32_t param) {
+  uint8_t buf[3] = {(uint8_t)(param >> 16), (uint8_t)(param >> 8),
+                    (uint8_t)param};
+  writeCmd(cmd, buf, 3);
+}
+
+static uint16_t getIrqStatus() {
+  uint8_t buf[2];
+  readCmd(SX126X_CMD_GET_IRQ_STATUS, buf, 2);
+  return (buf[0] << 8) | buf[1];
+}
+
+static void clearIrqStatus() {
+  uint8_t buf[2] = {SX126X_IRQ_ALL >> 8, SX126X_IRQ_ALL & 0xFF};
+  writeCmd(SX126X_CMD_CLEAR_IRQ_STATUS, buf, 2);
+}
+
+// route the given IRQs to DIO1
+static void setIrqs(uint16_t mask) {
+  uint8_t buf[8] = {(uint8_t)(mask >> 8), (uint8_t)mask, (uint8_t)(mask >> 8),
+                    (uint8_t)mask, 0, 0, 0, 0};
+  writeCmd(SX126X_CMD_SET_DIO_IRQ_PARAMS, buf, 8);
+  clearIrqStatus();
+}
+
+static void configChannel(uint32_t freq) {
+  // set frequency: FQ = (FRF * 32 Mhz) / (2 ^ 25)
+  uint64_t frf = ((uint64_t)freq << 25) / SX126X_FXTAL;
+  uint8_t buf[4] = {(uint8_t)(frf >> 24), (uint8_t)(frf >> 16),
+                    (uint8_t)(frf >> 8), (uint8_t)frf};
+  writeCmd(SX126X_CMD_SET_RF_FREQUENCY, buf, 4);
+}
+
+// optimal settings of the SX1262 high power PA: output [dBm] reached with
+// SetTxParams at +22dBm, paDutyCycle, hpMax and supply current [mA]
+enum { PA_LEVELS = 4 };
+static CONST_TABLE(int8_t, PA_OUTPUT)[] = {14, 17, 20, 22};
+static CONST_TABLE(uint8_t, PA_DUTY_CYCLE)[] = {0x02, 0x02, 0x03, 0x04};
+static CONST_TABLE(uint8_t, PA_HP_MAX)[] = {0x02, 0x03, 0x05, 0x07};
+static CONST_TABLE(uint8_t, PA_CURRENT)[] = {45, 58, 84, 118};
+#define PA_MIN_DBM (-9)
+
+// smallest PA setting which reaches pw
+static uint8_t selectPa(int8_t pw) {
+  uint8_t i = 0;
+  while (i < PA_LEVELS - 1 && TABLE_GET_S1(PA_OUTPUT, i) < pw) {
+    i++;
+  }
+  return i;
+}
+
+static void configPower(int8_t pw) {
+  uint8_t level = selectPa(pw);
+  int8_t output = TABLE_GET_S1(PA_OUTPUT, level);
+  uint8_t pa[4] = {TABLE_GET_U1(PA_DUTY_CYCLE, level),
+                   TABLE_GET_U1(PA_HP_MAX, level), 0x00, 0x01};
+  writeCmd(SX126X_CMD_SET_PA_CONFIG, pa, 4);
+  // lower powers are reached by reducing the power from +22dBm
+  pw = 22 - (output - (pw > output ? output : pw));
+  if (pw < PA_MIN_DBM) {
+    pw = PA_MIN_DBM;
+  }
+  // ramp time 40us
+  uint8_t params[2] = {(uint8_t)pw, 0x02};
+  writeCmd(SX126X_CMD_SET_TX_PARAMS, params, 2);
+}
+
+// configure modem for rps, payloadLen is the max length for rx, preamble
+// in symbols for LoRa
+static void configModem(rps_t rps, uint8_t payloadLen, bool invertIQ,
+                        uint16_t preamble) {
+  if (rps.sf == FSK) {
+    writeCmd1(SX126X_CMD_SET_PACKET_TYPE, SX126X_PACKET_TYPE_GFSK);
+    // bitrate, gaussian BT 0.5, rx bandwidth 117kHz, deviation
+    uint8_t mod[8] = {(uint8_t)(FSK_BITRATE >> 16),
+                      (uint8_t)(FSK_BITRATE >> 8),
+                      (uint8_t)FSK_BITRATE,
+                      0x09,
+                      0x0B,
+                      (uint8_t)(FSK_FDEV >> 16),
+                      (uint8_t)(FSK_FDEV >> 8),
+                      (uint8_t)FSK_FDEV};
+    writeCmd(SX126X_CMD_SET_MODULATION_PARAMS, mod, 8);
+    // preamble bits, 16 bits detector, 24 bits sync word, no address,
+    // variable length, 2 bytes inverted CCITT crc, whitening
+    uint8_t pkt[9] = {0x00, FSK_PREAMBLE * 8, 0x05, 24, 0x00, 0x01,
+                      payloadLen, 0x06, 0x01};
+    writeCmd(SX126X_CMD_SET_PACKET_PARAMS, pkt, 9);
+    uint8_t sync[3] = {0xC1, 0x94, 0xC1};
+    writeRegs(SX126X_REG_FSK_SYNC_WORD, sync, 3);
+    uint8_t crc[4] = {0x1D, 0x0F, 0x10, 0x21};
+    writeRegs(SX126X_REG_CRC_SEED, crc, 4);
+    uint8_t white[2] = {0x01, 0xFF};
+    writeRegs(SX126X_REG_WHITENING_SEED, white, 2);
+    return;
+  }
+
+  writeCmd1(SX126X_CMD_SET_PACKET_TYPE, SX126X_PACKET_TYPE_LORA);
+  uint8_t sf = rps.sf + 6; // SF7..SF12
+  // sx126x codes: 0x04 = 125kHz, 0x05 = 250kHz, 0x06 = 500kHz
+  uint8_t bw = 0x04 + rps.bw;
+  uint8_t ldro = (rps.sf >= SF11 && rps.bw == BW125) ? 1 : 0;
+  uint8_t mod[4] = {sf, bw, (uint8_t)(rps.cr + 1), ldro};
+  writeCmd(SX126X_CMD_SET_MODULATION_PARAMS, mod, 4);
+  // preamble, explicit or implicit header, length, crc, IQ
+  uint8_t pkt[6] = {(uint8_t)(preamble >> 8),
+                    (uint8_t)preamble,
+                    (uint8_t)(rps.ih ? 1 : 0),
+                    (uint8_t)(rps.ih ? rps.ih : payloadLen),
+                    (uint8_t)(rps.nocrc ? 0 : 1),
+                    (uint8_t)(invertIQ ? 1 : 0)};
+  writeCmd(SX126X_CMD_SET_PACKET_PARAMS, pkt, 6);
+  // IQ polarity errata: bit 2 must be cleared with inverted IQ
+  uint8_t iq = readReg(SX126X_REG_IQ_POLARITY);
+  writeReg(SX126X_REG_IQ_POLARITY, invertIQ ? iq & ~0x04 : iq | 0x04);
+  uint8_t syncWord[2] = {SX126X_LORA_SYNC_WORD_PUBLIC >> 8,
+                         SX126X_LORA_SYNC_WORD_PUBLIC & 0xFF};
+  writeRegs(SX126X_REG_LORA_SYNC_WORD, syncWord, 2);
+}
+
+// start channel activity detection, done with IRQ CAD_DONE
+static void startcad(uint32_t freq, rps_t rps, bool invertIQ) {
+  setStandby();
+  configChannel(freq);
+  configModem(rps, MAX_LEN_FRAME, invertIQ, LORA_PREAMBLE);
+  uint8_t params[7] = {SX126X_CAD_ON_2_SYMB,
+                       TABLE_GET_U1(CAD_DET_PEAK, rps.sf),
+                       CAD_DET_MIN,
+                       SX126X_CAD_ONLY,
+                       0,
+                       0,
+                       0};
+  writeCmd(SX126X_CMD_SET_CAD_PARAMS, params, 7);
+  setIrqs(SX126X_IRQ_CAD_DONE | SX126X_IRQ_CAD_DETECTED);
+  // enable antenna switch for RX
+  hal_pin_rxtx(0);
+  writeCmd(SX126X_CMD_SET_CAD, nullptr, 0);
+}
+
+// rx window for rxsyms symbols (bytes for FSK), in steps of 15.625us
+static uint32_t rxTimeout(rps_t rps, uint8_t rxsyms) {
+  if (rps.sf == FSK) {
+    return (uint32_t)rxsyms * FSK_BYTE_US * 64 / 1000;
+  }
+  // symbol time = 2^sf / bw
+  uint16_t bwKHz = 125 << rps.bw;
+  return ((uint32_t)rxsyms << (rps.sf + 6)) * 64 / bwKHz;
+}
+
+static void startrx(uint32_t freq, rps_t rps, uint32_t timeout,
+                    uint16_t preamble) {
+  setStandby();
+  configChannel(freq);
+#if !defined(DISABLE_INVERT_IQ_ON_RX)
+  // use inverted I/Q signal (prevent mote-to-mote communication), but for
+  // the beacons: the only frames received with an implicit header
+  configModem(rps, MAX_LEN_FRAME, rps.ih == 0, preamble);
+#else
+  configModem(rps, MAX_LEN_FRAME, false, preamble);
+#endif
+  writeReg(SX126X_REG_RX_GAIN, SX126X_RX_GAIN_POWER_SAVING);
+  // keep receiving once a preamble is detected
+  writeCmd1(SX126X_CMD_SET_STOP_RX_TIMER_ON_PREAMBLE, 0x01);
+  uint8_t base[2] = {0x00, 0x00};
+  writeCmd(SX126X_CMD_SET_BUFFER_BASE_ADDRESS, base, 2);
+  if (timeout == SX126X_RX_CONTINUOUS) {
+    setIrqs(SX126X_IRQ_RX_DONE);
+  } else {
+    setIrqs(SX126X_IRQ_RX_DONE | SX126X_IRQ_TIMEOUT);
+  }
+  // enable antenna switch for RX
+  hal_pin_rxtx(0);
+}
+
+void RadioSx126x::init() {
+  hal_disableIRQs();
+
+  // manually reset radio
+  hal_pin_rst(0); // drive RST pin low
+  // wait >100us
+  hal_wait(OsDeltaTime::from_ms(1));
+  hal_pin_rst(2); // configure RST pin floating!
+  // wait until the chip is ready
+  hal_wait(OsDeltaTime::from_ms(5));
+  sleeping = false;
+  waitBusy();
+
+#if !defined(CFG_noassert) || LMIC_DEBUG_LEVEL > 0
+  // no version register, check the reset value of the sync word
+  uint8_t v = readReg(SX126X_REG_LORA_SYNC_WORD);
+  PRINT_DEBUG_1("Sync word msb : %i", v);
+#endif
+  ASSERT(v == 0x14);
+
+  setStandby();
+#if defined(SX126X_TCXO_VOLTAGE)
+  uint8_t tcxo[4] = {SX126X_TCXO_VOLTAGE, 0, TCXO_DELAY >> 8,
+                     TCXO_DELAY & 0xFF};
+  writeCmd(SX126X_CMD_SET_DIO3_AS_TCXO_CTRL, tcxo, 4);
+#endif
+  writeCmd1(SX126X_CMD_CALIBRATE, SX126X_CALIBRATE_ALL);
+#if defined(SX126X_USE_LDO)
+  writeCmd1(SX126X_CMD_SET_REGULATOR_MODE, SX126X_REGULATOR_LDO);
+#else
+  writeCmd1(SX126X_CMD_SET_REGULATOR_MODE, SX126X_REGULATOR_DCDC);
+#endif
+#if defined(SX126X_DIO2_RF_SWITCH)
+  writeCmd1(SX126X_CMD_SET_DIO2_AS_RF_SWITCH_CTRL, 0x01);
+#endif
+  uint8_t img[2] = {CALIBRATE_IMAGE_FREQ1, CALIBRATE_IMAGE_FREQ2};
+  writeCmd(SX126X_CMD_CALIBRATE_IMAGE, img, 2);
+
+  setSleep();
+  hal_allow_sleep();
+
+  hal_enableIRQs();
+}
+
+// get random seed from the noise based random number generator
+void RadioSx126x::init_random(uint8_t randbuf[16]) {
+  hal_disableIRQs();
+
+  setStandby();
+  writeCmd1(SX126X_CMD_SET_PACKET_TYPE, SX126X_PACKET_TYPE_LORA);
+  setIrqs(0);
+  writeCmd24(SX126X_CMD_SET_RX, SX126X_RX_CONTINUOUS);
+  for (uint8_t i = 1; i < 16; i++) {
+    // wait for a fresh 32 bit value every 4 bytes
+    if ((i & 3) == 1) {
+      hal_wait(OsDeltaTime::from_us(100));
+    }
+    randbuf[i] = readReg(SX126X_REG_RANDOM_NUMBER + (i & 3));
+  }
+  randbuf[0] = 16; // set initial index
+  setStandby();
+  setSleep();
+  hal_enableIRQs();
+}
+
+// same scale as the SX127x: RSSI [dBm] = -157 + value. The chip only
+// measures in RX, elsewhere the value is meaningless and 0 is returned.
+uint8_t RadioSx126x::rssi() {
+  hal_disableIRQs();
+  // a sleeping chip is not woken, it does not listen
+  bool listening = !sleeping && chipMode() == SX126X_STATUS_MODE_RX;
+  uint8_t r = 0;
+  if (listening)
+    readCmd(SX126X_CMD_GET_RSSI_INST, &r, 1);
+  hal_enableIRQs();
+  if (!listening)
+    return 0;
+  // r = -RSSI * 2
+  int16_t v = 157 - r / 2;
+  return v < 0 ? 0 : v;
+}
+
+// below +14dBm the current of the +14dBm setting, linear between settings
+uint8_t RadioSx126x::txCurrent(int8_t txpow) const {
+  uint8_t level = selectPa(txpow);
+  uint8_t current = TABLE_GET_U1(PA_CURRENT, level);
+  if (level == 0 || txpow >= TABLE_GET_S1(PA_OUTPUT, level)) {
+    return current;
+  }
+  int8_t lowOutput = TABLE_GET_S1(PA_OUTPUT, level - 1);
+  uint8_t lowCurrent = TABLE_GET_U1(PA_CURRENT, level - 1);
+  return lowCurrent + (current - lowCurrent) * (txpow - lowOutput) /
+                          (TABLE_GET_S1(PA_OUTPUT, level) - lowOutput);
+}
+
+// read rx quality parameters of the packet in the buffer
+void RadioSx126x::readPacketQuality() {
+  uint8_t status[3];
+  readCmd(SX126X_CMD_GET_PACKET_STATUS, status, 3);
+  if (currentRps.sf == FSK) {
+    // RSSI at sync word, no SNR in FSK
+    packetRssi = RSSI_OFF - status[1] / 2;
+    packetSnr = 0;
+  } else {
+    // RSSI [dBm] = -RssiPkt / 2, SNR [dB] * 4
+    packetRssi = RSSI_OFF - status[0] / 2;
+    packetSnr = (int8_t)status[1];
+  }
+}
+
+// called by hal ext IRQ handler
+// (radio goes to sleep mode after tx/rx operations)
+void RadioSx126x::irq_handler(uint8_t dio, OsTime const &trigger) {
+  OsTime now = os_getTime();
+  if (now - trigger < OsDeltaTime::from_sec(1)) {
+    now = trigger;
+  } else {
+    PRINT_DEBUG_1("Not using interupt trigger %lu", trigger);
+  }
+
+  uint16_t flags = getIrqStatus();
+  PRINT_DEBUG_2("irq: dio: 0x%x flags: 0x%x\n", dio, flags);
+
+  if (flags & SX126X_IRQ_TX_DONE) {
+    // save exact tx time
+    txEnd = now;
+    journalEnd(RADIO_EV_TX, flags, now);
+    hal_allow_sleep();
+  } else if (flags & SX126X_IRQ_RX_DONE) {
+    // save exact rx time
+    rxTime = now;
+    if (flags & SX126X_IRQ_CRC_ERR) {
+      frameLength = 0;
+    } else {
+      // read the PDU and inform the MAC that we received something
+      uint8_t status[2];
+      readCmd(SX126X_CMD_GET_RX_BUFFER_STATUS, status, 2);
+      // for security clamp length of data
+      uint8_t length = status[0] < MAX_LEN_FRAME ? status[0] : MAX_LEN_FRAME;
+      readBuf(status[1], framePtr, length);
+      frameLength = length;
+      readPacketQuality();
+    }
+    journalEnd(RADIO_EV_RX, flags, now);
+    captureFrame(true, currentFreq, currentRps, now);
+    hal_allow_sleep();
+  } else if (flags & SX126X_IRQ_TIMEOUT) {
+    // indicate timeout
+    frameLength = 0;
+    journalEnd(RADIO_EV_RX_TIMEOUT, flags, now);
+    hal_allow_sleep();
+  } else if (flags & SX126X_IRQ_CAD_DONE) {
+    // a preamble was detected during the CAD
+    channelBusy = (flags & SX126X_IRQ_CAD_DETECTED) != 0;
+    journalEnd(RADIO_EV_CAD, flags, now);
+    hal_allow_sleep();
+  } else {
+    // nothing done yet
+    clearIrqStatus();
+    return;
+  }
+  clearIrqStatus();
+  // go from standby to sleep
+  setSleep();
+  if (sniffState != SNIFF_OFF && sniffContinue(now)) {
+    return;
+  }
+  // run os job (use preset func ptr)
+  done.setRunnable();
+}
+
+// an operation of the low power listening is over, true if it goes on
+bool RadioSx126x::sniffContinue(OsTime const &now) {
+  if (sniffState == SNIFF_CAD && channelBusy) {
+    // preamble on air, stay for the frame
+    sniffState = SNIFF_RX;
+    uint32_t timeout = rxTimeout(currentRps, SNIFF_RX_SYMS);
+    startrx(correctedFreq(currentFreq), currentRps, timeout,
+            sniffPreamble(currentRps, sniffInterval));
+    writeCmd24(SX126X_CMD_SET_RX, timeout);
+    journalBegin(RADIO_EV_RX, currentFreq, currentRps, now);
+    hal_forbid_sleep();
+    return true;
+  }
+  if (sniffState == SNIFF_RX && frameLength > 0) {
+    sniffState = SNIFF_OFF;
+    return false;
+  }
+  sniffSchedule();
+  sniffJob.setTimedCallback(sniffNext, &RadioSx126x::sniffWake);
+  return true;
+}
+
+void RadioSx126x::sniffWake() {
+  hal_disableIRQs();
+  channelBusy = false;
+#if !defined(DISABLE_INVERT_IQ_ON_RX)
+  startcad(correctedFreq(currentFreq), currentRps, true);
+#else
+  startcad(correctedFreq(currentFreq), currentRps, false);
+#endif
+  hal_forbid_sleep();
+  hal_enableIRQs();
+}
+
+void RadioSx126x::sleep() {
+  hal_disableIRQs();
+  // put radio to sleep
+  setStandby();
+  setSleep();
+  sniffState = SNIFF_OFF;
+  sniffJob.clearCallback();
+  journalEnd(RADIO_EV_ABORT, 0, os_getTime());
+  hal_allow_sleep();
+  hal_enableIRQs();
+}
+
+void RadioSx126x::standby() {
+  hal_disableIRQs();
+  // stop any operation, keep the oscillator running
+  setStandby();
+  sniffState = SNIFF_OFF;
+  sniffJob.clearCallback();
+  journalEnd(RADIO_EV_ABORT, 0, os_getTime());
+  hal_forbid_sleep();
+  hal_enableIRQs();
+}
+
+void RadioSx126x::tx(uint32_t freq, rps_t rps, int8_t txpow) {
+  hal_disableIRQs();
+  setStandby();
+  configChannel(correctedFreq(freq));
+  configModem(rps, frameLength, false, txPreambleSyms());
+  configPower(txpow);
+  uint8_t base[2] = {0x00, 0x00};
+  writeCmd(SX126X_CMD_SET_BUFFER_BASE_ADDRESS, base, 2);
+  writeBuf(0x00, framePtr, frameLength);
+  setIrqs(SX126X_IRQ_TX_DONE | SX126X_IRQ_TIMEOUT);
+
+  // enable antenna switch for TX
+  hal_pin_rxtx(1);
+  // now we actually start the transmission, no timeout
+  writeCmd24(SX126X_CMD_SET_TX, 0);
+  OsTime now = os_getTime();
+  journalBegin(RADIO_EV_TX, freq, rps, now);
+  captureFrame(false, freq, rps, now);
+  hal_forbid_sleep();
+  hal_enableIRQs();
+
+  PRINT_DEBUG_1("TXMODE, freq=%lu, len=%d, SF=%d", freq, frameLength,
+                rps.sf + 6);
+}
+
+void RadioSx126x::rx(uint32_t freq, rps_t rps, uint8_t rxsyms,
+                     OsTime const &rxtime) {
+  hal_disableIRQs();
+  currentRps = rps;
+  currentFreq = freq;
+  uint32_t timeout = rxTimeout(rps, rxsyms);
+  startrx(correctedFreq(freq), rps, timeout, LORA_PREAMBLE);
+  // receive frame now (exactly at rxtime)
+  hal_waitUntil(rxtime); // busy wait until exact rx time
+  writeCmd24(SX126X_CMD_SET_RX, timeout);
+  journalBegin(RADIO_EV_RX, freq, rps, rxtime);
+  hal_forbid_sleep();
+  hal_enableIRQs();
+
+  PRINT_DEBUG_1("RXMODE_SINGLE, freq=%lu, SF=%d, timeout=%lu", freq,
+                rps.sf + 6, timeout);
+}
+
+void RadioSx126x::rxon(uint32_t freq, rps_t rps, uint8_t rxsyms,
+                       OsTime const &rxtime) {
+  hal_disableIRQs();
+  currentRps = rps;
+  currentFreq = freq;
+  // start scanning for beacon now
+  startrx(correctedFreq(freq), rps, SX126X_RX_CONTINUOUS, LORA_PREAMBLE);
+  writeCmd24(SX126X_CMD_SET_RX, SX126X_RX_CONTINUOUS);
+  journalBegin(RADIO_EV_RX, freq, rps, os_getTime());
+  hal_forbid_sleep();
+  hal_enableIRQs();
+
+  PRINT_DEBUG_1("RXMODE_SCAN, freq=%lu, SF=%d", freq, rps.sf + 6);
+}
+
+void RadioSx126x::cad(uint32_t freq, rps_t rps) {
+  hal_disableIRQs();
+  currentRps = rps;
+  currentFreq = freq;
+  channelBusy = false;
+  // listen to other nodes uplinks: non inverted I/Q
+  startcad(correctedFreq(freq), rps, false);
+  journalBegin(RADIO_EV_CAD, freq, rps, os_getTime());
+  hal_forbid_sleep();
+  hal_enableIRQs();
+  PRINT_DEBUG_1("CAD, freq=%lu, SF=%d", freq, rps.sf + 6);
+}
+
+void RadioSx126x::sniff(uint32_t freq, rps_t rps, OsDeltaTime const &interval) {
+  ASSERT(rps.sf != FSK);
+  hal_disableIRQs();
+  currentRps = rps;
+  currentFreq = freq;
+  sniffInterval = interval;
+  sniffState = SNIFF_CAD;
+  // first look now
+  sniffNext = os_getTime();
+  sniffJob.setTimedCallback(sniffNext, &RadioSx126x::sniffWake);
+  hal_enableIRQs();
+  PRINT_DEBUG_1("SNIFF, freq=%lu, SF=%d, interval=%li us", freq, rps.sf + 6,
+                interval.to_us());
+}
@@ -0,0 +1,1183 @@
+/*******************************************************************************
+ * Copyright (c) 2014-2015 IBM Corporation.
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Contributors:
+ *    IBM Zurich Research Lab - initial API, implementation and documentation
+ *******************************************************************************/
+
+#include "radio.h"
+#include "../aes/aes.h"
+#include "lmic.h"
+
+// ----------------------------------------
+// Registers Mapping
+#define RegFifo 0x00     // common
+#define RegOpMode 0x01   // common
+#define RegFrfMsb 0x06   // common
+#define RegFrfMid 0x07   // common
+#define RegFrfLsb 0x08   // common
+#define RegPaConfig 0x09 // common
+#define RegPaRamp 0x0A   // common
+#define RegOcp 0x0B      // common
+#define RegLna 0x0C      // common
+#define LORARegFifoAddrPtr 0x0D
+#define LORARegFifoTxBaseAddr 0x0E
+#define LORARegFifoRxBaseAddr 0x0F
+#define LORARegFifoRxCurrentAddr 0x10
+#define LORARegIrqFlagsMask 0x11
+#define LORARegIrqFlags 0x12
+#define LORARegRxNbBytes 0x13
+#define LORARegRxHeaderCntValueMsb 0x14
+#define LORARegRxHeaderCntValueLsb 0x15
+#define LORARegRxPacketCntValueMsb 0x16
+#define LORARegRxpacketCntValueLsb 0x17
+#define LORARegModemStat 0x18
+#define LORARegPktSnrValue 0x19
+#define LORARegPktRssiValue 0x1A
+#define LORARegRssiValue 0x1B
+#define LORARegHopChannel 0x1C
+#define LORARegModemConfig1 0x1D
+#define LORARegModemConfig2 0x1E
+#define LORARegSymbTimeoutLsb 0x1F
+#define LORARegPreambleMsb 0x20
+#define LORARegPreambleLsb 0x21
+#define LORARegPayloadLength 0x22
+#define LORARegPayloadMaxLength 0x23
+#define LORARegHopPeriod 0x24
+#define LORARegFifoRxByteAddr 0x25
+#define LORARegModemConfig3 0x26
+#define LORARegFeiMsb 0x28
+#define LORAFeiMib 0x29
+#define LORARegFeiLsb 0x2A
+#define LORARegRssiWideband 0x2C
+#define LORARegDetectOptimize 0x31
+#define LORARegInvertIQ 0x33
+#define LORARegDetectionThreshold 0x37
+#define LORARegSyncWord 0x39
+#define FSKRegBitrateMsb 0x02
+#define FSKRegBitrateLsb 0x03
+#define FSKRegFdevMsb 0x04
+#define FSKRegFdevLsb 0x05
+#define FSKRegRxConfig 0x0D
+#define FSKRegRssiValue 0x11
+#define FSKRegRxBw 0x12
+#define FSKRegAfcBw 0x13
+#define FSKRegPreambleDetect 0x1F
+#define FSKRegPreambleMsb 0x25
+#define FSKRegPreambleLsb 0x26
+#define FSKRegSyncConfig 0x27
+#define FSKRegSyncValue1 0x28
+#define FSKRegSyncValue2 0x29
+#define FSKRegSyncValue3 0x2A
+#define FSKRegPacketConfig1 0x30
+#define FSKRegPacketConfig2 0x31
+#define FSKRegPayloadLength 0x32
+#define FSKRegFifoThresh 0x35
+#define FSKRegIrqFlags1 0x3E
+#define FSKRegIrqFlags2 0x3F
+#define RegDioMapping1 0x40 // common
+#define RegDioMapping2 0x41 // common
+#define RegVersion 0x42     // common
+// #define RegAgcRef                                  0x43 // common
+// #define RegAgcThresh1                              0x44 // common
+// #define RegAgcThresh2                              0x45 // common
+// #define RegAgcThresh3                              0x46 // common
+// #define RegPllHop                                  0x4B // common
+// #define RegTcxo                                    0x58 // common
+// #define RegPll                                     0x5C // common
+// #define RegPllLowPn                                0x5E // common
+// #define RegFormerTemp                              0x6C // common
+// #define RegBitRateFrac                             0x70 // common
+
+// ----------------------------------------
+// spread factors and mode for RegModemConfig2
+#define SX1272_MC2_FSK 0x00
+#define SX1272_MC2_SF7 0x70
+#define SX1272_MC2_SF8 0x80
+#define SX1272_MC2_SF9 0x90
+#define SX1272_MC2_SF10 0xA0
+#define SX1272_MC2_SF11 0xB0
+#define SX1272_MC2_SF12 0xC0
+// bandwidth for RegModemConfig1
+#define SX1272_MC1_BW_125 0x00
+#define SX1272_MC1_BW_250 0x40
+#define SX1272_MC1_BW_500 0x80
+// coding rate for RegModemConfig1
+#define SX1272_MC1_CR_4_5 0x08
+#define SX1272_MC1_CR_4_6 0x10
+#define SX1272_MC1_CR_4_7 0x18
+#define SX1272_MC1_CR_4_8 0x20
+#define SX1272_MC1_IMPLICIT_HEADER_MODE_ON 0x04 // required for receive
+#define SX1272_MC1_RX_PAYLOAD_CRCON 0x02
+#define SX1272_MC1_LOW_DATA_RATE_OPTIMIZE 0x01 // mandated for SF11 and SF12
+// transmit power configuration for RegPaConfig
+#define SX1272_PAC_PA_SELECT_PA_BOOST 0x80
+#define SX1272_PAC_PA_SELECT_RFIO_PIN 0x00
+
+// sx1276 RegModemConfig1
+#define SX1276_MC1_BW_125 0x70
+#define SX1276_MC1_BW_250 0x80
+#define SX1276_MC1_BW_500 0x90
+#define SX1276_MC1_CR_4_5 0x02
+#define SX1276_MC1_CR_4_6 0x04
+#define SX1276_MC1_CR_4_7 0x06
+#define SX1276_MC1_CR_4_8 0x08
+
+#define SX1276_MC1_IMPLICIT_HEADER_MODE_ON 0x01
+
+// sx1276 RegModemConfig2
+#define SX1276_MC2_RX_PAYLOAD_CRCON 0x04
+
+// sx1276 RegModemConfig3
+#define SX1276_MC3_LOW_DATA_RATE_OPTIMIZE 0x08
+#define SX1276_MC3_AGCAUTO 0x04
+
+// preamble for lora networks (nibbles swapped)
+#define LORA_MAC_PREAMBLE 0x34
+
+// LoRaWAN FSK: 50kbps, 25kHz deviation, 5 bytes preamble, sync word C194C1
+#define FSK_BITRATE 0x0280 // 32MHz / 50kbps
+#define FSK_FDEV 0x0199    // 25kHz / 61Hz
+#define FSK_PREAMBLE 5
+// time to send one byte at 50kbps
+#define FSK_BYTE_US 160
+// the FIFO holds 64 bytes, longer frames are streamed in chunks
+#define FSK_FIFO_SIZE 64
+#define FSK_FIFO_THRESH 32
+// reads of a full FIFO before a TX is given up: a read takes 16 SPI clocks
+// or more, 1.6us at 10MHz, so a working modem frees a byte within 100 reads
+#define FSK_FULL_POLLS 1000
+// length byte, payload and CRC of the longest frame
+#define FSK_MAX_FRAME_US ((1 + MAX_LEN_FRAME + 2) * FSK_BYTE_US)
+
+#define RXLORA_RXMODE_RSSI_REG_MODEM_CONFIG1 0x0A
+
+// ----------------------------------------
+// Constants for radio registers
+#define OPMODE_LORA 0x80
+#define OPMODE_MASK 0x07
+#define OPMODE_SLEEP 0x00
+#define OPMODE_STANDBY 0x01
+#define OPMODE_FSTX 0x02
+#define OPMODE_TX 0x03
+#define OPMODE_FSRX 0x04
+#define OPMODE_RX 0x05
+#define OPMODE_RX_SINGLE 0x06
+#define OPMODE_CAD 0x07
+
+// ----------------------------------------
+// Bits masking the corresponding IRQs from the radio
+#define IRQ_LORA_RXTOUT_MASK 0x80
+#define IRQ_LORA_RXDONE_MASK 0x40
+#define IRQ_LORA_CRCERR_MASK 0x20
+#define IRQ_LORA_HEADER_MASK 0x10
+#define IRQ_LORA_TXDONE_MASK 0x08
+#define IRQ_LORA_CDDONE_MASK 0x04
+#define IRQ_LORA_FHSSCH_MASK 0x02
+#define IRQ_LORA_CDDETD_MASK 0x01
+
+#define IRQ_FSK1_PREAMBLEDETECT_MASK 0x02
+#define IRQ_FSK1_SYNCADDRESSMATCH_MASK 0x01
+#define IRQ_FSK2_FIFOFULL_MASK 0x80
+#define IRQ_FSK2_FIFOLEVEL_MASK 0x20
+#define IRQ_FSK2_PACKETSENT_MASK 0x08
+#define IRQ_FSK2_PAYLOADREADY_MASK 0x04
+#define IRQ_FSK2_CRCOK_MASK 0x02
+
+// ----------------------------------------
+// DIO function mappings                D0D1D2D3
+#define MAP_DIO0_LORA_RXDONE 0x00  // 00------
+#define MAP_DIO0_LORA_TXDONE 0x40  // 01------
+#define MAP_DIO0_LORA_CADDONE 0x80 // 10------
+#define MAP_DIO1_LORA_RXTOUT 0x00  // --00----
+#define MAP_DIO1_LORA_CADDETD 0x20 // --10----
+#define MAP_DIO1_LORA_NOP 0x30     // --11----
+#define MAP_DIO2_LORA_NOP 0xC0     // ----11--
+#define MAP_DIO0_FSK_READY 0x00    // 00------ (packet sent / payload ready)
+#define MAP_DIO1_FSK_LEVEL 0x00    // --00----
+#define MAP_DIO1_FSK_NOP 0x30      // --11----
+#define MAP_DIO2_FSK_TXNOP 0x04    // ----01--
+#define MAP_DIO2_FSK_NOP 0x00      // ----00--
+
+static void writeReg(uint8_t addr, uint8_t data) {
+  hal_pin_nss(0);
+  hal_spi(addr | 0x80);
+  hal_spi(data);
+  hal_pin_nss(1);
+}
+
+static uint8_t readReg(uint8_t addr) {
+  hal_pin_nss(0);
+  hal_spi(addr & 0x7F);
+  uint8_t val = hal_spi(0x00);
+  hal_pin_nss(1);
+  return val;
+}
+
+static void writeBuf(uint8_t addr, uint8_t *buf, uint8_t len) {
+  hal_pin_nss(0);
+  hal_spi(addr | 0x80);
+  for (uint8_t i = 0; i < len; i++) {
+    hal_spi(buf[i]);
+  }
+  hal_pin_nss(1);
+}
+
+static void readBuf(uint8_t addr, uint8_t *buf, uint8_t len) {
+  hal_pin_nss(0);
+  hal_spi(addr & 0x7F);
+  for (uint8_t i = 0; i < len; i++) {
+    buf[i] = hal_spi(0x00);
+  }
+  hal_pin_nss(1);
+}
+
+static void opmode(uint8_t mode) {
+  writeReg(RegOpMode, (readReg(RegOpMode) & ~OPMODE_MASK) | mode);
+}
+
+template <class Chip> static void opmodeLora() {
+  writeReg(RegOpMode, OPMODE_LORA | Chip::OPMODE_BASE);
+}
+
+template <class Chip> static void opmodeFSK() {
+  writeReg(RegOpMode, Chip::OPMODE_BASE);
+}
+
+// configure LoRa modem (cfg1, cfg2, cfg3)
+void Sx1276::configLoraModem(rps_t rps) {
+  sf_t sf = rps.sf;
+  uint8_t mc1 = 0, mc2 = 0, mc3 = 0;
+
+  switch (rps.bw) {
+  case BW125:
+    mc1 |= SX1276_MC1_BW_125;
+    break;
+  case BW250:
+    mc1 |= SX1276_MC1_BW_250;
+    break;
+  case BW500:
+    mc1 |= SX1276_MC1_BW_500;
+    break;
+  default:
+    ASSERT(0);
+  }
+  switch (rps.cr) {
+  case CR_4_5:
+    mc1 |= SX1276_MC1_CR_4_5;
+    break;
+  case CR_4_6:
+    mc1 |= SX1276_MC1_CR_4_6;
+    break;
+  case CR_4_7:
+    mc1 |= SX1276_MC1_CR_4_7;
+    break;
+  case CR_4_8:
+    mc1 |= SX1276_MC1_CR_4_8;
+    break;
+  default:
+    ASSERT(0);
+  }
+
+  if (rps.ih) {
+    mc1 |= SX1276_MC1_IMPLICIT_HEADER_MODE_ON;
+    writeReg(LORARegPayloadLength, rps.ih); // required length
+  }
+  // set ModemConfig1
+  writeReg(LORARegModemConfig1, mc1);
+
+  mc2 = (SX1272_MC2_SF7 + ((sf - 1) << 4));
+  if (!rps.nocrc) {
+    mc2 |= SX1276_MC2_RX_PAYLOAD_CRCON;
+  }
+  writeReg(LORARegModemConfig2, mc2);
+
+  mc3 = SX1276_MC3_AGCAUTO;
+  if ((sf == SF11 || sf == SF12) && rps.bw == BW125) {
+    mc3 |= SX1276_MC3_LOW_DATA_RATE_OPTIMIZE;
+  }
+  writeReg(LORARegModemConfig3, mc3);
+}
+
+// configure LoRa modem (cfg1, cfg2)
+void Sx1272::configLoraModem(rps_t rps) {
+  sf_t sf = rps.sf;
+  uint8_t mc1 = (rps.bw << 6);
+
+  switch (rps.cr) {
+  case CR_4_5:
+    mc1 |= SX1272_MC1_CR_4_5;
+    break;
+  case CR_4_6:
+    mc1 |= SX1272_MC1_CR_4_6;
+    break;
+  case CR_4_7:
+    mc1 |= SX1272_MC1_CR_4_7;
+    break;
+  case CR_4_8:
+    mc1 |= SX1272_MC1_CR_4_8;
+    break;
+  }
+
+  if ((sf == SF11 || sf == SF12) && rps.bw == BW125) {
+    mc1 |= SX1272_MC1_LOW_DATA_RATE_OPTIMIZE;
+  }
+
+  if (rps.nocrc == 0) {
+    mc1 |= SX1272_MC1_RX_PAYLOAD_CRCON;
+  }
+
+  if (rps.ih) {
+    mc1 |= SX1272_MC1_IMPLICIT_HEADER_MODE_ON;
+    writeReg(LORARegPayloadLength, rps.ih); // required length
+  }
+  // set ModemConfig1
+  writeReg(LORARegModemConfig1, mc1);
+
+  // set ModemConfig2 (sf, AgcAutoOn=1 SymbTimeoutHi=00)
+  writeReg(LORARegModemConfig2, (SX1272_MC2_SF7 + ((sf - 1) << 4)) | 0x04);
+}
+
+static void configChannel(uint32_t freq) {
+  // set frequency: FQ = (FRF * 32 Mhz) / (2 ^ 19)
+  uint64_t frf = ((uint64_t)freq << 19) / 32000000;
+  writeReg(RegFrfMsb, (uint8_t)(frf >> 16));
+  writeReg(RegFrfMid, (uint8_t)(frf >> 8));
+  writeReg(RegFrfLsb, (uint8_t)(frf >> 0));
+}
+
+static void configPreamble(uint16_t preamble) {
+  writeReg(LORARegPreambleMsb, (uint8_t)(preamble >> 8));
+  writeReg(LORARegPreambleLsb, (uint8_t)preamble);
+}
+
+// power amplifier outputs
+enum { PA_RFO, PA_BOOST, PA_BOOST_20DBM };
+
+// output power range [dBm] of each output
+static CONST_TABLE(int8_t, PA_MIN_DBM)[] = {0, 2, 5};
+static CONST_TABLE(int8_t, PA_MAX_DBM)[] = {14, 17, 20};
+// supply current [mA] at the ends of the range, typical values of the
+// datasheet, linear in between
+static CONST_TABLE(uint8_t, PA_MIN_MA)[] = {10, 40, 65};
+static CONST_TABLE(uint8_t, PA_MAX_MA)[] = {31, 87, 120};
+// over current protection, 60mA, 100mA (reset value) and 140mA
+static CONST_TABLE(uint8_t, PA_OCP)[] = {0x23, 0x2B, 0x31};
+
+// the most efficient output of the board which can send pw
+static uint8_t selectPa(int8_t pw) {
+  uint8_t wired = lmic_pins.pa ? lmic_pins.pa : LMIC_PA_BOOST;
+  bool boost = (wired & (LMIC_PA_BOOST | LMIC_PA_BOOST_20DBM)) != 0;
+  if ((wired & LMIC_PA_RFO) &&
+      (pw <= TABLE_GET_S1(PA_MAX_DBM, PA_RFO) || !boost)) {
+    return PA_RFO;
+  }
+  if ((wired & LMIC_PA_BOOST_20DBM) &&
+      (pw > TABLE_GET_S1(PA_MAX_DBM, PA_BOOST) || !(wired & LMIC_PA_BOOST))) {
+    return PA_BOOST_20DBM;
+  }
+  return PA_BOOST;
+}
+
+static int8_t clampPower(uint8_t pa, int8_t pw) {
+  int8_t min = TABLE_GET_S1(PA_MIN_DBM, pa);
+  int8_t max = TABLE_GET_S1(PA_MAX_DBM, pa);
+  return pw < min ? min : pw > max ? max : pw;
+}
+
+template <class Chip> static void configPower(int8_t pw) {
+  uint8_t pa = selectPa(pw);
+  pw = clampPower(pa, pw);
+  uint8_t config;
+  if (pa == PA_RFO) {
+    config = Chip::RFO_CONFIG | (pw + Chip::RFO_OUTPUT_OFFSET);
+  } else if (pa == PA_BOOST) {
+    // Pout = 2 + OutputPower
+    config = SX1272_PAC_PA_SELECT_PA_BOOST | (pw - 2);
+  } else {
+    // Pout = 5 + OutputPower with the high power DAC
+    config = SX1272_PAC_PA_SELECT_PA_BOOST | (pw - 5);
+  }
+  writeReg(RegPaConfig, config);
+  writeReg(Chip::REG_PA_DAC, (readReg(Chip::REG_PA_DAC) & 0xF8) |
+                                 (pa == PA_BOOST_20DBM ? 0x07 : 0x04));
+  writeReg(RegOcp, TABLE_GET_U1(PA_OCP, pa));
+}
+
+template <class Chip>
+static void txlora(uint32_t freq, rps_t rps, int8_t txpow, uint8_t *frame,
+                   uint8_t dataLen, uint16_t preamble) {
+  // select LoRa modem (from sleep mode)
+  // writeReg(RegOpMode, OPMODE_LORA);
+  opmodeLora<Chip>();
+  ASSERT((readReg(RegOpMode) & OPMODE_LORA) != 0);
+
+  // enter standby mode (required for FIFO loading))
+  opmode(OPMODE_STANDBY);
+  // configure LoRa modem (cfg1, cfg2)
+  Chip::configLoraModem(rps);
+  // configure frequency
+  configChannel(freq);
+  // configure output power
+  writeReg(RegPaRamp,
+           (readReg(RegPaRamp) & 0xF0) | 0x08); // set PA ramp-up time 50 uSec
+  configPower<Chip>(txpow);
+  // set sync word
+  writeReg(LORARegSyncWord, LORA_MAC_PREAMBLE);
+  configPreamble(preamble);
+
+  // set the IRQ mapping DIO0=TxDone DIO1=NOP DIO2=NOP
+  writeReg(RegDioMapping1,
+           MAP_DIO0_LORA_TXDONE | MAP_DIO1_LORA_NOP | MAP_DIO2_LORA_NOP);
+  // clear all radio IRQ flags
+  writeReg(LORARegIrqFlags, 0xFF);
+  // mask all IRQs but TxDone
+  writeReg(LORARegIrqFlagsMask, ~IRQ_LORA_TXDONE_MASK);
+
+  // initialize the payload size and address pointers
+  writeReg(LORARegFifoTxBaseAddr, 0x00);
+  writeReg(LORARegFifoAddrPtr, 0x00);
+  writeReg(LORARegPayloadLength, dataLen);
+
+  // download buffer to the radio FIFO
+  writeBuf(RegFifo, frame, dataLen);
+
+  // enable antenna switch for TX
+  hal_pin_rxtx(1);
+
+  // now we actually start the transmission
+  opmode(OPMODE_TX);
+  hal_forbid_sleep();
+
+#if LMIC_DEBUG_LEVEL > 0
+  uint8_t sf = rps.sf + 6; // 1 == SF7
+  uint8_t bw = rps.bw;
+  uint8_t cr = rps.cr;
+  lmic_printf("%lu: TXMODE, freq=%lu, len=%d, SF=%d, BW=%d, CR=4/%d, IH=%d\n",
+              os_getTime(), freq, dataLen, sf,
+              bw == BW125 ? 125 : (bw == BW250 ? 250 : 500),
+              cr == CR_4_5 ? 5 : (cr == CR_4_6 ? 6 : (cr == CR_4_7 ? 7 : 8)),
+              rps.ih);
+#endif
+}
+
+// configure FSK modem as used by LoRaWAN
+static void configFskModem() {
+  // set bitrate and frequency deviation
+  writeReg(FSKRegBitrateMsb, FSK_BITRATE >> 8);
+  writeReg(FSKRegBitrateLsb, FSK_BITRATE & 0xFF);
+  writeReg(FSKRegFdevMsb, FSK_FDEV >> 8);
+  writeReg(FSKRegFdevLsb, FSK_FDEV & 0xFF);
+  // set preamble size
+  writeReg(FSKRegPreambleMsb, 0x00);
+  writeReg(FSKRegPreambleLsb, FSK_PREAMBLE);
+  // set sync config: sync word on, 3 bytes
+  writeReg(FSKRegSyncConfig, 0x12);
+  writeReg(FSKRegSyncValue1, 0xC1);
+  writeReg(FSKRegSyncValue2, 0x94);
+  writeReg(FSKRegSyncValue3, 0xC1);
+  // set packet mode
+  writeReg(FSKRegPacketConfig2, 0x40);
+}
+
+// start the TX of the frame, the bytes beyond the FIFO are left to feedfsk()
+// and the count loaded is returned
+template <class Chip>
+static uint8_t txfsk(uint32_t freq, int8_t txpow, uint8_t *frame,
+                     uint8_t dataLen) {
+  // select FSK modem (from sleep mode)
+  opmodeFSK<Chip>();
+  ASSERT((readReg(RegOpMode) & OPMODE_LORA) == 0);
+
+  // enter standby mode (required for FIFO loading))
+  opmode(OPMODE_STANDBY);
+  configFskModem();
+  // set packet config: variable length, whitening, crc on
+  writeReg(FSKRegPacketConfig1, 0xD0);
+  // start sending as soon as the FIFO is not empty
+  writeReg(FSKRegFifoThresh, 0x80 | FSK_FIFO_THRESH);
+  // configure frequency
+  configChannel(freq);
+  // configure output power
+  writeReg(RegPaRamp,
+           (readReg(RegPaRamp) & 0xF0) | 0x08); // set PA ramp-up time 50 uSec
+  configPower<Chip>(txpow);
+
+  // set the IRQ mapping DIO0=PacketSent DIO1=NOP DIO2=NOP
+  writeReg(RegDioMapping1,
+           MAP_DIO0_FSK_READY | MAP_DIO1_FSK_NOP | MAP_DIO2_FSK_TXNOP);
+
+  // download length byte and as much of the frame as fits the FIFO
+  writeReg(RegFifo, dataLen);
+  uint8_t len = dataLen < FSK_FIFO_SIZE - 1 ? dataLen : FSK_FIFO_SIZE - 1;
+  writeBuf(RegFifo, frame, len);
+
+  // enable antenna switch for TX
+  hal_pin_rxtx(1);
+
+  // now we actually start the transmission
+  opmode(OPMODE_TX);
+  hal_forbid_sleep();
+
+  PRINT_DEBUG_1("TXMODE FSK, freq=%lu, len=%d", freq, dataLen);
+  return len;
+}
+
+// feed the rest of a long FSK frame while the start is on air, from len on.
+// It takes up to 40ms so the IRQs stay enabled, and the wait for room in the
+// FIFO is bounded by a count of reads rather than by the clock. false if the
+// modem stopped taking the bytes.
+static bool feedfsk(uint8_t *frame, uint8_t len, uint8_t dataLen) {
+  for (; len < dataLen; len++) {
+    uint16_t polls = 0;
+    while (readReg(FSKRegIrqFlags2) & IRQ_FSK2_FIFOFULL_MASK) {
+      if (++polls == FSK_FULL_POLLS) {
+        PRINT_DEBUG_1("TX FSK aborted, FIFO full at %d of %d", len, dataLen);
+        return false;
+      }
+    }
+    writeReg(RegFifo, frame[len]);
+  }
+  return true;
+}
+
+// start transmitter, the count of bytes of the frame loaded is returned
+template <class Chip>
+static uint8_t starttx(uint32_t freq, rps_t rps, int8_t txpow, uint8_t *frame,
+                       uint8_t dataLen, uint16_t preamble) {
+  ASSERT((readReg(RegOpMode) & OPMODE_MASK) == OPMODE_SLEEP);
+  if (rps.sf == FSK) { // FSK modem
+    return txfsk<Chip>(freq, txpow, frame, dataLen);
+  }
+  // LoRa modem
+  txlora<Chip>(freq, rps, txpow, frame, dataLen, preamble);
+  // the radio will go back to STANDBY mode as soon as the TX is finished
+  // the corresponding IRQ will inform us about completion.
+  return dataLen;
+}
+
+enum { RXMODE_SINGLE, RXMODE_SCAN, RXMODE_RSSI };
+
+static CONST_TABLE(uint8_t, rxlorairqmask)[] = {
+    [RXMODE_SINGLE] = IRQ_LORA_RXDONE_MASK | IRQ_LORA_RXTOUT_MASK,
+    [RXMODE_SCAN] = IRQ_LORA_RXDONE_MASK,
+    [RXMODE_RSSI] = 0x00,
+};
+
+// start LoRa receiver
+template <class Chip>
+static void rxlora(uint8_t rxmode, uint32_t freq, rps_t rps, uint8_t rxsyms,
+                   OsTime const &rxtime, uint16_t preamble) {
+  // select LoRa modem (from sleep mode)
+  opmodeLora<Chip>();
+  ASSERT((readReg(RegOpMode) & OPMODE_LORA) != 0);
+  // enter standby mode (warm up))
+  opmode(OPMODE_STANDBY);
+  // don't use MAC settings at startup
+  if (rxmode == RXMODE_RSSI) { // use fixed settings for rssi scan
+    writeReg(LORARegModemConfig1, RXLORA_RXMODE_RSSI_REG_MODEM_CONFIG1);
+    writeReg(LORARegModemConfig2, Chip::RSSI_MODEM_CONFIG2);
+  } else { // single or continuous rx mode
+    // configure LoRa modem (cfg1, cfg2)
+    Chip::configLoraModem(rps);
+    // configure frequency
+    configChannel(freq);
+  }
+  // set LNA gain
+  writeReg(RegLna, Chip::LNA_RX_GAIN);
+  // set max payload size
+  writeReg(LORARegPayloadMaxLength, MAX_LEN_FRAME);
+#if !defined(DISABLE_INVERT_IQ_ON_RX)
+  // use inverted I/Q signal (prevent mote-to-mote communication), but for
+  // the beacons: the only frames received with an implicit header
+  uint8_t iq = readReg(LORARegInvertIQ);
+  writeReg(LORARegInvertIQ, rps.ih ? iq & ~(1 << 6) : iq | (1 << 6));
+#endif
+  // set symbol timeout (for single rx)
+  writeReg(LORARegSymbTimeoutLsb, rxsyms);
+  // set sync word
+  writeReg(LORARegSyncWord, LORA_MAC_PREAMBLE);
+  // the longest preamble expected
+  configPreamble(preamble);
+
+  // configure DIO mapping DIO0=RxDone DIO1=RxTout DIO2=NOP
+  writeReg(RegDioMapping1,
+           MAP_DIO0_LORA_RXDONE | MAP_DIO1_LORA_RXTOUT | MAP_DIO2_LORA_NOP);
+  // clear all radio IRQ flags
+  writeReg(LORARegIrqFlags, 0xFF);
+  // enable required radio IRQs
+  writeReg(LORARegIrqFlagsMask, ~TABLE_GET_U1(rxlorairqmask, rxmode));
+
+  // enable antenna switch for RX
+  hal_pin_rxtx(0);
+
+  // now instruct the radio to receive
+  if (rxmode == RXMODE_SINGLE) { // single rx
+    hal_waitUntil(rxtime);       // busy wait until exact rx time
+    opmode(OPMODE_RX_SINGLE);
+  } else { // continous rx (scan or rssi)
+    opmode(OPMODE_RX);
+  }
+  hal_forbid_sleep();
+
+#if LMIC_DEBUG_LEVEL > 0
+  if (rxmode == RXMODE_RSSI) {
+    lmic_printf("RXMODE_RSSI\n");
+  } else {
+    uint8_t sf = rps.sf + 6; // 1 == SF7
+    uint8_t bw = rps.bw;
+    uint8_t cr = rps.cr;
+    lmic_printf(
+        "%lu: %s, freq=%lu, SF=%d, BW=%d, CR=4/%d, IH=%d\n", os_getTime(),
+        rxmode == RXMODE_SINGLE
+            ? "RXMODE_SINGLE"
+            : (rxmode == RXMODE_SCAN ? "RXMODE_SCAN" : "UNKNOWN_RX"),
+        freq, sf, bw == BW125 ? 125 : (bw == BW250 ? 250 : 500),
+        cr == CR_4_5 ? 5 : (cr == CR_4_6 ? 6 : (cr == CR_4_7 ? 7 : 8)), rps.ih);
+  }
+#endif
+}
+
+// start FSK receiver, timeout is handled by RadioSx127x::fskRxTimeout
+template <class Chip>
+static void rxfsk(uint32_t freq, OsTime const &rxtime) {
+  // select FSK modem (from sleep mode)
+  opmodeFSK<Chip>();
+  ASSERT((readReg(RegOpMode) & OPMODE_LORA) == 0);
+  // enter standby mode (warm up))
+  opmode(OPMODE_STANDBY);
+  configFskModem();
+  // configure frequency
+  configChannel(freq);
+  // set LNA gain
+  writeReg(RegLna, Chip::LNA_RX_GAIN);
+  // set rx config: AFC and AGC on, start on preamble detection
+  writeReg(FSKRegRxConfig, 0x1E);
+  // set rx bandwidth 50kHz and AFC bandwidth 83.3kHz
+  writeReg(FSKRegRxBw, 0x0B);
+  writeReg(FSKRegAfcBw, 0x12);
+  // set preamble detection: on, 2 bytes, 10 chips tolerance
+  writeReg(FSKRegPreambleDetect, 0xAA);
+  // set packet config: variable length, whitening, crc on, keep bad frames
+  writeReg(FSKRegPacketConfig1, 0xD8);
+  // set max payload size
+  writeReg(FSKRegPayloadLength, MAX_LEN_FRAME);
+  // signal FIFO level to drain frames longer than the FIFO
+  writeReg(FSKRegFifoThresh, FSK_FIFO_THRESH);
+
+  // configure DIO mapping DIO0=PayloadReady DIO1=FifoLevel DIO2=NOP
+  writeReg(RegDioMapping1,
+           MAP_DIO0_FSK_READY | MAP_DIO1_FSK_LEVEL | MAP_DIO2_FSK_NOP);
+  // clear preamble and sync word flags
+  writeReg(FSKRegIrqFlags1, 0xFF);
+
+  // enable antenna switch for RX
+  hal_pin_rxtx(0);
+
+  // now instruct the radio to receive
+  hal_waitUntil(rxtime); // busy wait until exact rx time
+  opmode(OPMODE_RX);
+  hal_forbid_sleep();
+
+  PRINT_DEBUG_1("RXMODE FSK, freq=%lu", freq);
+}
+
+// start channel activity detection, done when the radio goes back to standby
+template <class Chip>
+static void cadlora(uint32_t freq, rps_t rps, bool invertIQ) {
+  ASSERT((readReg(RegOpMode) & OPMODE_MASK) == OPMODE_SLEEP);
+  // select LoRa modem (from sleep mode)
+  opmodeLora<Chip>();
+  ASSERT((readReg(RegOpMode) & OPMODE_LORA) != 0);
+  // enter standby mode (warm up)
+  opmode(OPMODE_STANDBY);
+  Chip::configLoraModem(rps);
+  configChannel(freq);
+  // set LNA gain
+  writeReg(RegLna, Chip::LNA_RX_GAIN);
+  uint8_t iq = readReg(LORARegInvertIQ);
+  writeReg(LORARegInvertIQ, invertIQ ? iq | (1 << 6) : iq & ~(1 << 6));
+  writeReg(LORARegSyncWord, LORA_MAC_PREAMBLE);
+
+  // configure DIO mapping DIO0=CadDone DIO1=CadDetected DIO2=NOP
+  writeReg(RegDioMapping1,
+           MAP_DIO0_LORA_CADDONE | MAP_DIO1_LORA_CADDETD | MAP_DIO2_LORA_NOP);
+  // clear all radio IRQ flags
+  writeReg(LORARegIrqFlags, 0xFF);
+  // enable required radio IRQs
+  writeReg(LORARegIrqFlagsMask,
+           (uint8_t) ~(IRQ_LORA_CDDONE_MASK | IRQ_LORA_CDDETD_MASK));
+
+  // enable antenna switch for RX
+  hal_pin_rxtx(0);
+  opmode(OPMODE_CAD);
+  hal_forbid_sleep();
+  PRINT_DEBUG_1("CAD, freq=%lu, SF=%d", freq, rps.sf + 6);
+}
+
+template <class Chip>
+static void startrx(uint8_t rxmode, uint32_t freq, rps_t rps, uint8_t rxsyms,
+                    OsTime const &rxtime, uint16_t preamble) {
+  ASSERT((readReg(RegOpMode) & OPMODE_MASK) == OPMODE_SLEEP);
+  if (rps.sf == FSK) { // FSK modem
+    // only single rx, the timeout is run by the Radio
+    ASSERT(rxmode == RXMODE_SINGLE);
+    rxfsk<Chip>(freq, rxtime);
+  } else { // LoRa modem
+    rxlora<Chip>(rxmode, freq, rps, rxsyms, rxtime, preamble);
+  }
+  // the radio will go back to STANDBY mode as soon as the RX is finished
+  // or timed out, and the corresponding IRQ will inform us about completion.
+}
+
+template <class Chip> void RadioSx127x<Chip>::init() {
+  hal_disableIRQs();
+
+  // manually reset radio
+  hal_pin_rst(Chip::RST_ACTIVE);
+  // wait >100us
+  hal_wait(OsDeltaTime::from_ms(1));
+  hal_pin_rst(2); // configure RST pin floating!
+  // wait 5ms
+  hal_wait(OsDeltaTime::from_ms(5));
+
+  opmode(OPMODE_SLEEP);
+
+#if !defined(CFG_noassert) || LMIC_DEBUG_LEVEL > 0
+  // some sanity checks, e.g., read version number
+  uint8_t v = readReg(RegVersion);
+  PRINT_DEBUG_1("Chip version : %i", v);
+  ASSERT(v == Chip::VERSION);
+#endif
+
+#ifdef CFG_sx1276mb1_board
+  // chain calibration
+  writeReg(RegPaConfig, 0);
+
+  // Launch Rx chain calibration for LF band
+  writeReg(FSKRegImageCal,
+           (readReg(FSKRegImageCal) & RF_IMAGECAL_IMAGECAL_MASK) |
+               RF_IMAGECAL_IMAGECAL_START);
+  while ((readReg(FSKRegImageCal) & RF_IMAGECAL_IMAGECAL_RUNNING) ==
+         RF_IMAGECAL_IMAGECAL_RUNNING) {
+    ;
+  }
+
+  // Sets a Frequency in HF band
+  uint32_t frf = 868000000;
+  writeReg(RegFrfMsb, (uint8_t)(frf >> 16));
+  writeReg(RegFrfMid, (uint8_t)(frf >> 8));
+  writeReg(RegFrfLsb, (uint8_t)(frf >> 0));
+
+  // Launch Rx chain calibration for HF band
+  writeReg(FSKRegImageCal,
+           (readReg(FSKRegImageCal) & RF_IMAGECAL_IMAGECAL_MASK) |
+               RF_IMAGECAL_IMAGECAL_START);
+  while ((readReg(FSKRegImageCal) & RF_IMAGECAL_IMAGECAL_RUNNING) ==
+         RF_IMAGECAL_IMAGECAL_RUNNING) {
+    ;
+  }
+#endif /* CFG_sx1276mb1_board */
+
+  opmode(OPMODE_SLEEP);
+  hal_allow_sleep();
+
+  hal_enableIRQs();
+}
+
+// get random seed from wideband noise rssi
+template <class Chip>
+void RadioSx127x<Chip>::init_random(uint8_t randbuf[16]) {
+  hal_disableIRQs();
+
+  // seed 15-byte randomness via noise rssi
+  // freq and rps not used
+  rps_t dumyrps;
+  rxlora<Chip>(RXMODE_RSSI, 0, dumyrps, 1, hal_ticks(), LORA_PREAMBLE);
+  while ((readReg(RegOpMode) & OPMODE_MASK) != OPMODE_RX)
+    ; // continuous rx
+  for (uint8_t i = 1; i < 16; i++) {
+    for (uint8_t j = 0; j < 8; j++) {
+      uint8_t b; // wait for two non-identical subsequent least-significant bits
+      while ((b = readReg(LORARegRssiWideband) & 0x01) ==
+             (readReg(LORARegRssiWideband) & 0x01))
+        ;
+      randbuf[i] = (randbuf[i] << 1) | b;
+    }
+  }
+  randbuf[0] = 16; // set initial index
+  opmode(OPMODE_SLEEP);
+  hal_enableIRQs();
+}
+
+template <class Chip> uint8_t RadioSx127x<Chip>::rssi() {
+  hal_disableIRQs();
+  uint8_t r = readReg(LORARegRssiValue);
+  hal_enableIRQs();
+  return r;
+}
+
+template <class Chip>
+uint8_t RadioSx127x<Chip>::txCurrent(int8_t txpow) const {
+  uint8_t pa = selectPa(txpow);
+  txpow = clampPower(pa, txpow);
+  int8_t min = TABLE_GET_S1(PA_MIN_DBM, pa);
+  int8_t max = TABLE_GET_S1(PA_MAX_DBM, pa);
+  uint8_t minMa = TABLE_GET_U1(PA_MIN_MA, pa);
+  uint8_t maxMa = TABLE_GET_U1(PA_MAX_MA, pa);
+  return minMa + (maxMa - minMa) * (txpow - min) / (max - min);
+}
+
+// read rx quality parameters of the packet in the FIFO
+template <class Chip> void RadioSx127x<Chip>::readPacketQuality() {
+  // SNR [dB] * 4
+  int8_t snr = (int8_t)readReg(LORARegPktSnrValue);
+  int16_t rssi = readReg(LORARegPktRssiValue);
+  if (snr < 0) {
+    // below noise floor the packet rssi does not include the noise
+    rssi += snr / SNR_SCALEUP;
+  } else {
+    // linearity correction: 16/15 * PacketRssi
+    rssi += rssi / 15;
+  }
+  rssi += currentFreq < (uint32_t)Chip::RSSI_LF_MAX_FREQ ? Chip::RSSI_OFFSET_LF
+                                                        : Chip::RSSI_OFFSET_HF;
+  // RSSI [dBm] (-192...+63)
+  rssi += RSSI_OFF;
+  packetRssi = rssi < -128 ? -128 : rssi > 127 ? 127 : rssi;
+  packetSnr = snr;
+}
+
+// read the received FSK frame from the FIFO, length byte first. While the
+// frame is on air only full chunks are taken, once complete all the rest.
+template <class Chip> void RadioSx127x<Chip>::readFskFifo(bool complete) {
+  do {
+    uint8_t count = FSK_FIFO_THRESH;
+    if (!fskLengthRead) {
+      uint8_t length = readReg(RegFifo);
+      // for security clamp length of data
+      fskRxLength = length < MAX_LEN_FRAME ? length : MAX_LEN_FRAME;
+      fskLengthRead = true;
+      count--;
+    }
+    uint8_t left = fskRxLength - fskRxCount;
+    if (complete || count > left)
+      count = left;
+    readBuf(RegFifo, framePtr + fskRxCount, count);
+    fskRxCount += count;
+  } while (!complete && fskRxCount < fskRxLength &&
+           (readReg(FSKRegIrqFlags2) & IRQ_FSK2_FIFOLEVEL_MASK));
+}
+
+// no DIO signals the FSK rx timeout, check the radio when the window is over
+template <class Chip> void RadioSx127x<Chip>::fskRxTimeout() {
+  hal_disableIRQs();
+  uint8_t flags1 = readReg(FSKRegIrqFlags1);
+  uint8_t flags2 = readReg(FSKRegIrqFlags2);
+  if (flags2 & IRQ_FSK2_PAYLOADREADY_MASK) {
+    // frame complete, irq_handler will take it
+    hal_enableIRQs();
+    return;
+  }
+  if (!fskRxExtended && (flags1 & (IRQ_FSK1_PREAMBLEDETECT_MASK |
+                                   IRQ_FSK1_SYNCADDRESSMATCH_MASK))) {
+    // a frame is on air, wait until the longest one is over
+    fskRxExtended = true;
+    fskRxTimeoutJob.setTimed(os_getTime() +
+                             OsDeltaTime::from_us(FSK_MAX_FRAME_US));
+    hal_enableIRQs();
+    return;
+  }
+  // indicate timeout
+  frameLength = 0;
+  journalEnd(RADIO_EV_RX_TIMEOUT, flags2, os_getTime());
+  opmode(OPMODE_SLEEP);
+  hal_allow_sleep();
+  hal_enableIRQs();
+  done.setRunnable();
+}
+
+// frequency error of the received LoRa frame [Hz], signal above receiver
+static int32_t readFreqError(bw_t bw) {
+  // MSB first, reading it latches the value
+  int32_t fei = readReg(LORARegFeiMsb) & 0x0F;
+  fei = (fei << 8) | readReg(LORAFeiMib);
+  fei = (fei << 8) | readReg(LORARegFeiLsb);
+  // 20 bits two's complement
+  if (fei & 0x80000) {
+    fei -= 0x100000;
+  }
+  // FreqError = FEI * 2^24 / Fxtal * BW / 500kHz
+  return (int64_t)fei * (1 << 24) * (125 << bw) / (32000000LL * 500);
+}
+
+static CONST_TABLE(int32_t, LORA_RXDONE_FIXUP)[] = {
+    [FSK] = us2osticks(0), // (   0 ticks)
+    [SF7] = us2osticks(0), // (   0 ticks)
+    [SF8] = us2osticks(1648),   [SF9] = us2osticks(3265),
+    [SF10] = us2osticks(7049),  [SF11] = us2osticks(13641),
+    [SF12] = us2osticks(31189),
+};
+
+// called by hal ext IRQ handler
+// (radio goes to stanby mode after tx/rx operations)
+template <class Chip>
+void RadioSx127x<Chip>::irq_handler(uint8_t dio, OsTime const &trigger) {
+  OsTime now = os_getTime();
+  if (now - trigger < OsDeltaTime::from_sec(1)) {
+    now = trigger;
+  } else {
+    PRINT_DEBUG_1("Not using interupt trigger %lu", trigger);
+  }
+
+  if ((readReg(RegOpMode) & OPMODE_LORA) != 0) { // LORA modem
+    uint8_t flags = readReg(LORARegIrqFlags);
+
+    PRINT_DEBUG_2("irq: dio: 0x%x flags: 0x%x\n", dio, flags);
+
+    if (flags & IRQ_LORA_TXDONE_MASK) {
+      // save exact tx time
+      txEnd = now; // - OsDeltaTime::from_us(43); // TXDONE FIXUP
+      journalEnd(RADIO_EV_TX, flags, now);
+      // forbid sleep to keep precise time counting.
+      // hal_forbid_sleep();
+      hal_allow_sleep();
+
+    } else if (flags & IRQ_LORA_RXDONE_MASK) {
+      // journal the raw end of rx, to check the fixup
+      OsTime rxDone = now;
+      // save exact rx time
+      if (currentRps.bw == BW125) {
+        now -= OsDeltaTime(TABLE_GET_S4(LORA_RXDONE_FIXUP, currentRps.sf));
+      }
+      PRINT_DEBUG_1("End RX -  Start RX : %li us ", (now - rxTime).to_us());
+      rxTime = now;
+       
+      // read the PDU and inform the MAC that we received something
+      uint8_t length =
+          (readReg(LORARegModemConfig1) & SX1272_MC1_IMPLICIT_HEADER_MODE_ON)
+              ? readReg(LORARegPayloadLength)
+              : readReg(LORARegRxNbBytes);
+
+      // for security clamp length of data
+      length = length < MAX_LEN_FRAME ? length : MAX_LEN_FRAME;
+
+      // set FIFO read address pointer
+      writeReg(LORARegFifoAddrPtr, readReg(LORARegFifoRxCurrentAddr));
+      // now read the FIFO
+      readBuf(RegFifo, framePtr, length);
+      frameLength = length;
+      
+      readPacketQuality();
+      int32_t error = readFreqError(currentRps.bw);
+      PRINT_DEBUG_1("Frequency error : %li Hz", error);
+      addFreqError(error, currentFreq);
+      journalEnd(RADIO_EV_RX, flags, rxDone);
+      captureFrame(true, currentFreq, currentRps, now);
+      hal_allow_sleep();
+    } else if (flags & IRQ_LORA_RXTOUT_MASK) {
+      // indicate timeout
+      frameLength = 0;
+      journalEnd(RADIO_EV_RX_TIMEOUT, flags, now);
+      hal_allow_sleep();
+    } else if (flags & IRQ_LORA_CDDONE_MASK) {
+      // a preamble was detected during the CAD
+      channelBusy = (flags & IRQ_LORA_CDDETD_MASK) != 0;
+      journalEnd(RADIO_EV_CAD, flags, now);
+      hal_allow_sleep();
+    }
+    // mask all radio IRQs
+    writeReg(LORARegIrqFlagsMask, 0xFF);
+    // clear radio IRQ flags
+    writeReg(LORARegIrqFlags, 0xFF);
+  } else { // FSK modem
+    uint8_t flags = readReg(FSKRegIrqFlags2);
+
+    PRINT_DEBUG_2("irq: dio: 0x%x flags2: 0x%x\n", dio, flags);
+
+    if (flags & IRQ_FSK2_PACKETSENT_MASK) {
+      // save exact tx time
+      txEnd = now;
+      journalEnd(RADIO_EV_TX, flags, now);
+      hal_allow_sleep();
+    } else if (flags & IRQ_FSK2_PAYLOADREADY_MASK) {
+      // save exact rx time
+      rxTime = now;
+      fskRxTimeoutJob.clearCallback();
+      readFskFifo(true);
+      // drop frames with bad crc
+      frameLength = (flags & IRQ_FSK2_CRCOK_MASK) ? fskRxCount : 0;
+      // RSSI [dBm] = -RssiValue / 2, no SNR in FSK
+      packetRssi = RSSI_OFF - readReg(FSKRegRssiValue) / 2;
+      packetSnr = 0;
+      journalEnd(RADIO_EV_RX, flags, now);
+      hal_allow_sleep();
+    } else if (flags & IRQ_FSK2_FIFOLEVEL_MASK) {
+      // a long frame is still being received
+      readFskFifo(false);
+      return;
+    } else {
+      // nothing done yet, keep radio running
+      return;
+    }
+  }
+  // go from stanby to sleep
+  opmode(OPMODE_SLEEP);
+  if (sniffState != SNIFF_OFF && sniffContinue(now)) {
+    return;
+  }
+  // run os job (use preset func ptr)
+  done.setRunnable();
+}
+
+// an operation of the low power listening is over, true if it goes on
+template <class Chip>
+bool RadioSx127x<Chip>::sniffContinue(OsTime const &now) {
+  if (sniffState == SNIFF_CAD && channelBusy) {
+    // preamble on air, stay for the frame
+    sniffState = SNIFF_RX;
+    startrx<Chip>(RXMODE_SINGLE, correctedFreq(currentFreq), currentRps,
+                  SNIFF_RX_SYMS, now, sniffPreamble(currentRps, sniffInterval));
+    journalBegin(RADIO_EV_RX, currentFreq, currentRps, now);
+    return true;
+  }
+  if (sniffState == SNIFF_RX && frameLength > 0) {
+    sniffState = SNIFF_OFF;
+    return false;
+  }
+  sniffSchedule();
+  sniffJob.setTimedCallback(sniffNext, &RadioSx127x::sniffWake);
+  return true;
+}
+
+template <class Chip> void RadioSx127x<Chip>::sniffWake() {
+  hal_disableIRQs();
+  channelBusy = false;
+#if !defined(DISABLE_INVERT_IQ_ON_RX)
+  cadlora<Chip>(correctedFreq(currentFreq), currentRps, true);
+#else
+  cadlora<Chip>(correctedFreq(currentFreq), currentRps, false);
+#endif
+  hal_enableIRQs();
+}
+
+template <class Chip> void RadioSx127x<Chip>::sleep() {
+  hal_disableIRQs();
+  // put radio to sleep
+  opmode(OPMODE_SLEEP);
+  fskRxTimeoutJob.clearCallback();
+  sniffState = SNIFF_OFF;
+  sniffJob.clearCallback();
+  journalEnd(RADIO_EV_ABORT, 0, os_getTime());
+  hal_allow_sleep();
+  hal_enableIRQs();
+}
+
+template <class Chip>
+void RadioSx127x<Chip>::tx(uint32_t freq, rps_t rps, int8_t txpow) {
+  hal_disableIRQs();
+  // transmit frame now
+  uint8_t loaded = starttx<Chip>(correctedFreq(freq), rps, txpow, framePtr,
+                                 frameLength, txPreambleSyms());
+  OsTime now = os_getTime();
+  journalBegin(RADIO_EV_TX, freq, rps, now);
+  hal_enableIRQs();
+  // PacketSent is only handled by the run loop, not while feeding
+  bool sent = loaded == frameLength || feedfsk(framePtr, loaded, frameLength);
+  hal_disableIRQs();
+  if (!sent) {
+    // no PacketSent will come, end the TX as if the frame was sent
+    hal_pin_rxtx(0);
+    txEnd = os_getTime();
+    journalEnd(RADIO_EV_ABORT, 0, txEnd);
+    opmode(OPMODE_SLEEP);
+    hal_allow_sleep();
+    hal_enableIRQs();
+    done.setRunnable();
+    return;
+  }
+  captureFrame(false, freq, rps, now);
+  hal_enableIRQs();
+}
+
+template <class Chip>
+void RadioSx127x<Chip>::rx(uint32_t freq, rps_t rps, uint8_t rxsyms,
+                           OsTime const &rxtime) {
+  hal_disableIRQs();
+  currentRps = rps;
+  currentFreq = freq;
+  if (rps.sf == FSK) {
+    fskLengthRead = false;
+    fskRxCount = 0;
+    fskRxExtended = false;
+    // window to catch the preamble and sync word, rxsyms counts bytes
+    fskRxTimeoutJob.setTimedCallback(
+        rxtime + OsDeltaTime::from_us((int32_t)rxsyms * FSK_BYTE_US),
+        &RadioSx127x::fskRxTimeout);
+  }
+  // receive frame now (exactly at rxtime)
+  startrx<Chip>(RXMODE_SINGLE, correctedFreq(freq), rps, rxsyms, rxtime,
+                LORA_PREAMBLE);
+  journalBegin(RADIO_EV_RX, freq, rps, rxtime);
+  hal_enableIRQs();
+}
+
+template <class Chip>
+void RadioSx127x<Chip>::rxon(uint32_t freq, rps_t rps, uint8_t rxsyms,
+                             OsTime const &rxtime) {
+  hal_disableIRQs();
+  currentRps = rps;
+  currentFreq = freq;
+  // start scanning for beacon now
+  startrx<Chip>(RXMODE_SCAN, correctedFreq(freq), rps, rxsyms, rxtime,
+                LORA_PREAMBLE);
+  journalBegin(RADIO_EV_RX, freq, rps, os_getTime());
+  hal_enableIRQs();
+}
+
+template <class Chip> void RadioSx127x<Chip>::cad(uint32_t freq, rps_t rps) {
+  hal_disableIRQs();
+  currentRps = rps;
+  currentFreq = freq;
+  channelBusy = false;
+  // listen to other nodes uplinks: non inverted I/Q
+  cadlora<Chip>(correctedFreq(freq), rps, false);
+  journalBegin(RADIO_EV_CAD, freq, rps, os_getTime());
+  hal_enableIRQs();
+}
+
+template <class Chip>
+void RadioSx127x<Chip>::sniff(uint32_t freq, rps_t rps,
+                              OsDeltaTime const &interval) {
+  ASSERT(rps.sf != FSK);
+  hal_disableIRQs();
+  currentRps = rps;
+  currentFreq = freq;
+  sniffInterval = interval;
+  sniffState = SNIFF_CAD;
+  // first look now
+  sniffNext = os_getTime();
+  sniffJob.setTimedCallback(sniffNext, &RadioSx127x::sniffWake);
+  hal_enableIRQs();
+  PRINT_DEBUG_1("SNIFF, freq=%lu, SF=%d, interval=%li us", freq, rps.sf + 6,
+                interval.to_us());
+}
+
+template <class Chip> void RadioSx127x<Chip>::standby() {
+  hal_disableIRQs();
+  // stop any operation, keep the oscillator running
+  opmode(OPMODE_STANDBY);
+  fskRxTimeoutJob.clearCallback();
+  sniffState = SNIFF_OFF;
+  sniffJob.clearCallback();
+  journalEnd(RADIO_EV_ABORT, 0, os_getTime());
+  hal_forbid_sleep();
+  hal_enableIRQs();
+}
+
+template class RadioSx127x<Sx1272>;
+template class RadioSx127x<Sx1276>;
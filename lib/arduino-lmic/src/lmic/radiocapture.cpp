@@ -0,0 +1,116 @@
+//! \file
+//! Capture of the radio frames in pcap format, see RadioCapture.
+#include "radio.h"
+#include "lmic.h"
+
+#if RADIO_CAPTURE_SIZE > 0
+
+enum { PCAP_MAGIC = 0xA1B2C3D4 };
+enum { LINKTYPE_LORATAP = 270 };
+// LoRaTap RSSI [dBm] = value - offset
+enum { LORATAP_RSSI_OFFSET = 139 };
+// LoRaWAN public network
+enum { LORATAP_SYNC_WORD = 0x34 };
+
+static void setLe32(uint8_t *buf, uint32_t value) {
+  buf[0] = value;
+  buf[1] = value >> 8;
+  buf[2] = value >> 16;
+  buf[3] = value >> 24;
+}
+
+void RadioCapture::fileHeader(uint8_t header[PCAP_FILE_HEADER_LEN]) {
+  setLe32(header, PCAP_MAGIC);
+  // version 2.4
+  header[4] = 2;
+  header[5] = 0;
+  header[6] = 4;
+  header[7] = 0;
+  // time zone and accuracy
+  setLe32(header + 8, 0);
+  setLe32(header + 12, 0);
+  // snapshot length
+  setLe32(header + 16, LORATAP_HEADER_LEN + MAX_LEN_FRAME);
+  setLe32(header + 20, LINKTYPE_LORATAP);
+}
+
+void RadioCapture::put(uint8_t byte) {
+  buffer[(first + count) % RADIO_CAPTURE_SIZE] = byte;
+  count++;
+}
+
+void RadioCapture::putLe32(uint32_t value) {
+  put(value);
+  put(value >> 8);
+  put(value >> 16);
+  put(value >> 24);
+}
+
+void RadioCapture::record(bool rx, uint32_t freq, rps_t rps, int8_t rssi,
+                          int8_t snr, OsTime const &time,
+                          const uint8_t *frame, uint8_t length) {
+  uint16_t size = PCAP_RECORD_HEADER_LEN + LORATAP_HEADER_LEN + length;
+  if (size > RADIO_CAPTURE_SIZE - count) {
+    // never split a record, the stream would be lost
+    if (dropped < 0xFFFF) {
+      dropped++;
+    }
+    return;
+  }
+  // time since start of the os clock
+  uint32_t ticks = time.tick();
+  putLe32(ticks / OSTICKS_PER_SEC);
+  putLe32((ticks % OSTICKS_PER_SEC) * US_PER_OSTICK);
+  putLe32(LORATAP_HEADER_LEN + length);
+  putLe32(LORATAP_HEADER_LEN + length);
+
+  // LoRaTap v0, big endian
+  put(0);
+  put(0);
+  put(0);
+  put(LORATAP_HEADER_LEN);
+  put(freq >> 24);
+  put(freq >> 16);
+  put(freq >> 8);
+  put(freq);
+  // bandwidth in steps of 125kHz
+  put(1 << rps.bw);
+  put(rps.sf + 6);
+  int16_t packetRssi = 0;
+  if (rx) {
+    packetRssi = rssi - RSSI_OFF + LORATAP_RSSI_OFFSET;
+    packetRssi = packetRssi < 0 ? 0 : packetRssi > 255 ? 255 : packetRssi;
+  }
+  // packet, max and current RSSI
+  put(packetRssi);
+  put(0);
+  put(0);
+  put(rx ? snr : 0);
+  put(LORATAP_SYNC_WORD);
+
+  for (uint8_t i = 0; i < length; i++) {
+    put(frame[i]);
+  }
+}
+
+uint16_t RadioCapture::read(uint8_t *dest, uint16_t max) {
+  hal_disableIRQs();
+  uint16_t n = count < max ? count : max;
+  for (uint16_t i = 0; i < n; i++) {
+    dest[i] = buffer[first];
+    first = (first + 1) % RADIO_CAPTURE_SIZE;
+  }
+  count -= n;
+  hal_enableIRQs();
+  return n;
+}
+
+void RadioCapture::clear() {
+  hal_disableIRQs();
+  first = 0;
+  count = 0;
+  dropped = 0;
+  hal_enableIRQs();
+}
+
+#endif // RADIO_CAPTURE_SIZE > 0
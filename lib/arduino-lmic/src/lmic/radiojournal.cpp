@@ -0,0 +1,79 @@
+//! \file
+#include "radio.h"
+#include "lmic.h"
+
+#if RADIO_JOURNAL_SIZE > 0
+
+void RadioJournal::begin(uint8_t op, uint32_t freq, rps_t rps,
+                         OsTime const &start) {
+  current.start = start;
+  current.duration = OsDeltaTime(0);
+  current.freq = freq;
+  current.rps = rps;
+  current.op = op;
+  current.flags = 0;
+  current.length = 0;
+  current.rssi = 0;
+  current.snr = 0;
+  pending = true;
+}
+
+void RadioJournal::end(uint8_t op, uint16_t flags, OsTime const &time,
+                       uint8_t length, int8_t rssi, int8_t snr) {
+  if (!pending) {
+    return;
+  }
+  pending = false;
+  current.op = op;
+  current.flags = flags;
+  current.duration = time - current.start;
+  if (op == RADIO_EV_TX || op == RADIO_EV_RX) {
+    current.length = length;
+  }
+  if (op == RADIO_EV_RX) {
+    current.rssi = rssi;
+    current.snr = snr;
+  }
+  if (count == RADIO_JOURNAL_SIZE) {
+    // overwrite the oldest
+    first = (first + 1) % RADIO_JOURNAL_SIZE;
+    count--;
+    if (overwritten < 0xFFFF) {
+      overwritten++;
+    }
+  }
+  events[(first + count) % RADIO_JOURNAL_SIZE] = current;
+  count++;
+}
+
+uint8_t RadioJournal::snapshot(RadioEvent *dest, uint8_t max) const {
+  hal_disableIRQs();
+  uint8_t n = count < max ? count : max;
+  for (uint8_t i = 0; i < n; i++) {
+    dest[i] = events[(first + i) % RADIO_JOURNAL_SIZE];
+  }
+  hal_enableIRQs();
+  return n;
+}
+
+bool RadioJournal::read(RadioEvent &event) {
+  hal_disableIRQs();
+  bool available = count > 0;
+  if (available) {
+    event = events[first];
+    first = (first + 1) % RADIO_JOURNAL_SIZE;
+    count--;
+  }
+  hal_enableIRQs();
+  return available;
+}
+
+void RadioJournal::clear() {
+  hal_disableIRQs();
+  first = 0;
+  count = 0;
+  overwritten = 0;
+  hal_enableIRQs();
+}
+
+#endif // RADIO_JOURNAL_SIZE > 0
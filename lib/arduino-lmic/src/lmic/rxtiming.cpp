@@ -0,0 +1,59 @@
+//! \file
+#include "lmic.h"
+
+// margin below the resolution of the timestamps [us]
+enum { RXT_MARGIN_MIN = 2 * US_PER_OSTICK };
+
+void RxTiming::reset() {
+  driftAvg = 0;
+  jitterAvg = 0;
+  samples = 0;
+}
+
+void RxTiming::addReception(OsDeltaTime const &error,
+                            OsDeltaTime const &delay) {
+  int32_t delayUs = delay.to_us();
+  if (delayUs <= 0)
+    return;
+  int32_t errorUs = error.to_us();
+  // deviation from the prediction, before the drift learns this sample
+  int32_t deviation = errorUs - offset(delay).to_us();
+  deviation = deviation < 0 ? -deviation : deviation;
+  deviation = deviation < RXT_JITTER_MAX ? deviation : RXT_JITTER_MAX;
+  int32_t sample = (int64_t)errorUs * 16 * 1000000 / delayUs;
+
+  if (samples < 0xFF)
+    samples++;
+  // plain mean over the first samples, so the first ones are not
+  // weighted down against the zero start
+  int32_t weight = samples < (1 << RXT_EWMA_SHIFT) ? samples
+                                                    : (1 << RXT_EWMA_SHIFT);
+  driftAvg += (sample - driftAvg) / weight;
+  if (samples > 1) {
+    // the first sample has no prediction to deviate from
+    jitterAvg += (deviation * 16 - jitterAvg) / (weight - 1);
+  }
+}
+
+void RxTiming::missed() {
+  if (!calibrated())
+    return;
+  // the frame may have fallen outside the window
+  jitterAvg = 2 * jitterAvg + 16 * RXT_MARGIN_MIN;
+  if (jitterAvg > 16 * (int32_t)RXT_JITTER_MAX)
+    jitterAvg = 16 * (int32_t)RXT_JITTER_MAX;
+}
+
+int16_t RxTiming::drift() const { return (driftAvg + 8) / 16; }
+
+int32_t RxTiming::jitter() const { return (jitterAvg + 8) / 16; }
+
+OsDeltaTime RxTiming::offset(OsDeltaTime const &delay) const {
+  return OsDeltaTime::from_us((int64_t)driftAvg * delay.to_us() /
+                              (16 * 1000000L));
+}
+
+OsDeltaTime RxTiming::margin() const {
+  return OsDeltaTime::from_us(
+      (int64_t)RXT_JITTER_FACTOR * jitterAvg / 16 + RXT_MARGIN_MIN);
+}
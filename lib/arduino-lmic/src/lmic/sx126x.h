@@ -0,0 +1,96 @@
+#ifndef _sx126x_h_
+#define _sx126x_h_
+
+// SX1261/SX1262 commands, registers and constants, shared by the radio
+// driver and the host emulator.
+
+// ----------------------------------------
+// Commands
+#define SX126X_CMD_SET_SLEEP 0x84
+#define SX126X_CMD_SET_STANDBY 0x80
+#define SX126X_CMD_SET_FS 0xC1
+#define SX126X_CMD_SET_TX 0x83
+#define SX126X_CMD_SET_RX 0x82
+#define SX126X_CMD_SET_STOP_RX_TIMER_ON_PREAMBLE 0x9F
+#define SX126X_CMD_SET_CAD 0xC5
+#define SX126X_CMD_SET_REGULATOR_MODE 0x96
+#define SX126X_CMD_CALIBRATE 0x89
+#define SX126X_CMD_CALIBRATE_IMAGE 0x98
+#define SX126X_CMD_SET_PA_CONFIG 0x95
+#define SX126X_CMD_WRITE_REGISTER 0x0D
+#define SX126X_CMD_READ_REGISTER 0x1D
+#define SX126X_CMD_WRITE_BUFFER 0x0E
+#define SX126X_CMD_READ_BUFFER 0x1E
+#define SX126X_CMD_SET_DIO_IRQ_PARAMS 0x08
+#define SX126X_CMD_GET_IRQ_STATUS 0x12
+#define SX126X_CMD_CLEAR_IRQ_STATUS 0x02
+#define SX126X_CMD_SET_DIO2_AS_RF_SWITCH_CTRL 0x9D
+#define SX126X_CMD_SET_DIO3_AS_TCXO_CTRL 0x97
+#define SX126X_CMD_SET_RF_FREQUENCY 0x86
+#define SX126X_CMD_SET_PACKET_TYPE 0x8A
+#define SX126X_CMD_SET_TX_PARAMS 0x8E
+#define SX126X_CMD_SET_MODULATION_PARAMS 0x8B
+#define SX126X_CMD_SET_PACKET_PARAMS 0x8C
+#define SX126X_CMD_SET_CAD_PARAMS 0x88
+#define SX126X_CMD_SET_BUFFER_BASE_ADDRESS 0x8F
+#define SX126X_CMD_GET_STATUS 0xC0
+#define SX126X_CMD_GET_RSSI_INST 0x15
+#define SX126X_CMD_GET_RX_BUFFER_STATUS 0x13
+#define SX126X_CMD_GET_PACKET_STATUS 0x14
+
+// ----------------------------------------
+// Registers
+#define SX126X_REG_CRC_SEED 0x06BC
+#define SX126X_REG_CRC_POLY 0x06BE
+#define SX126X_REG_WHITENING_SEED 0x06B8
+#define SX126X_REG_FSK_SYNC_WORD 0x06C0
+#define SX126X_REG_IQ_POLARITY 0x0736
+#define SX126X_REG_LORA_SYNC_WORD 0x0740
+#define SX126X_REG_RANDOM_NUMBER 0x0819
+#define SX126X_REG_RX_GAIN 0x08AC
+#define SX126X_REG_OCP 0x08E7
+
+// ----------------------------------------
+// Constants for commands
+#define SX126X_SLEEP_WARM_START 0x04
+#define SX126X_STANDBY_RC 0x00
+#define SX126X_STANDBY_XOSC 0x01
+#define SX126X_PACKET_TYPE_GFSK 0x00
+#define SX126X_PACKET_TYPE_LORA 0x01
+#define SX126X_REGULATOR_LDO 0x00
+#define SX126X_REGULATOR_DCDC 0x01
+#define SX126X_CALIBRATE_ALL 0x7F
+// SetRx timeout, in steps of 15.625us
+#define SX126X_RX_SINGLE 0x000000
+#define SX126X_RX_CONTINUOUS 0xFFFFFF
+#define SX126X_LORA_SYNC_WORD_PUBLIC 0x3444
+#define SX126X_RX_GAIN_POWER_SAVING 0x94
+#define SX126X_CAD_ON_2_SYMB 0x01
+#define SX126X_CAD_ONLY 0x00
+
+// GetStatus chip mode (bits 6:4)
+#define SX126X_STATUS_MODE_MASK 0x70
+#define SX126X_STATUS_MODE_STDBY_RC 0x20
+#define SX126X_STATUS_MODE_STDBY_XOSC 0x30
+#define SX126X_STATUS_MODE_FS 0x40
+#define SX126X_STATUS_MODE_RX 0x50
+#define SX126X_STATUS_MODE_TX 0x60
+
+// ----------------------------------------
+// Bits of the IRQ status
+#define SX126X_IRQ_TX_DONE 0x0001
+#define SX126X_IRQ_RX_DONE 0x0002
+#define SX126X_IRQ_PREAMBLE_DETECTED 0x0004
+#define SX126X_IRQ_SYNC_WORD_VALID 0x0008
+#define SX126X_IRQ_HEADER_VALID 0x0010
+#define SX126X_IRQ_HEADER_ERR 0x0020
+#define SX126X_IRQ_CRC_ERR 0x0040
+#define SX126X_IRQ_CAD_DONE 0x0080
+#define SX126X_IRQ_CAD_DETECTED 0x0100
+#define SX126X_IRQ_TIMEOUT 0x0200
+#define SX126X_IRQ_ALL 0x03FF
+
+// crystal frequency, RF frequency step is FXTAL / 2^25
+#define SX126X_FXTAL 32000000
+
+#endif // _sx126x_h_
@@ -0,0 +1,60 @@
+//! \file
+//! Queue of the uplinks waiting for the MAC, see UplinkQueue.
+#include "lmic.h"
+
+#if UPLINK_QUEUE_SIZE > 0
+
+bool UplinkQueue::push(UplinkMessage const &msg) {
+  if (count == UPLINK_QUEUE_SIZE)
+    return false;
+  messages[count++] = msg;
+  return true;
+}
+
+bool UplinkQueue::pop(UplinkMessage &msg) {
+  if (count == 0)
+    return false;
+  uint8_t best = 0;
+  for (uint8_t i = 1; i < count; i++) {
+    if (messages[i].priority > messages[best].priority ||
+        (messages[i].priority == messages[best].priority &&
+         messages[i].queued - messages[best].queued < 0)) {
+      best = i;
+    }
+  }
+  msg = messages[best];
+  // order is kept by the time queued, a removed slot takes the last one
+  messages[best] = messages[--count];
+  return true;
+}
+
+bool UplinkQueue::popExpired(OsTime const &now, UplinkMessage &msg) {
+  for (uint8_t i = 0; i < count; i++) {
+    if (messages[i].expires && now - messages[i].deadline >= 0) {
+      msg = messages[i];
+      messages[i] = messages[--count];
+      countExpired();
+      return true;
+    }
+  }
+  return false;
+}
+
+void UplinkQueue::countExpired() {
+  if (expired < 0xFFFF)
+    expired++;
+}
+
+void UplinkQueue::clear() { count = 0; }
+
+OsDeltaTime UplinkQueue::age(OsTime const &now) const {
+  OsDeltaTime oldest(0);
+  for (uint8_t i = 0; i < count; i++) {
+    OsDeltaTime waited = now - messages[i].queued;
+    if (waited > oldest)
+      oldest = waited;
+  }
+  return oldest;
+}
+
+#endif // UPLINK_QUEUE_SIZE > 0
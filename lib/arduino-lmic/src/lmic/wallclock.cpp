@@ -0,0 +1,97 @@
+//! \file
+//! Wall clock disciplined by the network time, see WallClock.
+#include "lmic.h"
+
+static int64_t ticksToUs(OsDeltaTime const &delta) {
+  return (int64_t)delta.tick() * 1000000 / OSTICKS_PER_SEC;
+}
+
+int64_t WallClock::elapsed(OsTime const &time) const {
+  int64_t local = ticksToUs(time - refTime);
+  return local + local * driftAvg / (16 * 1000000L);
+}
+
+void WallClock::sync(OsTime const &time, uint32_t seconds, uint8_t fraction) {
+  uint32_t us = ((uint32_t)fraction * 1000000) >> 8;
+  if (synced()) {
+    // local time since the last sync, and the error of the prediction
+    int64_t local = ticksToUs(time - refTime) + (int64_t)sinceSync * 1000;
+    int64_t measured = (int64_t)(int32_t)(seconds - refSeconds) * 1000000 +
+                       us - refUs;
+    int64_t residual = measured - elapsed(time);
+    // drift resolution given by the time resolution over the interval
+    int32_t resolution = local > 0 ? 2 * WCLK_SYNC_ERROR * 1000000LL / local
+                                   : WCLK_DRIFT_MAX;
+    if (resolution < WCLK_DRIFT_MAX) {
+      int32_t sample = driftAvg + residual * 16 * 1000000 / local;
+      if (driftSamples < 0xFF)
+        driftSamples++;
+      // plain mean over the first samples, as in RxTiming
+      int32_t weight = driftSamples < (1 << WCLK_EWMA_SHIFT)
+                           ? driftSamples
+                           : (1 << WCLK_EWMA_SHIFT);
+      int32_t deviation = sample - driftAvg;
+      deviation = deviation < 0 ? -deviation : deviation;
+      driftAvg += (sample - driftAvg) / weight;
+      if (driftSamples > 1) {
+        driftDev += (deviation - driftDev) / (weight - 1);
+      }
+      driftError = (driftDev + 15) / 16 + resolution + 1;
+    }
+    PRINT_DEBUG_1("Time sync error: %li us, drift: %i ppm", (long)residual,
+                  drift());
+  }
+  refTime = time;
+  refSeconds = seconds;
+  refUs = us;
+  refError = WCLK_SYNC_ERROR;
+  sinceSync = 0;
+  if (syncs < 0xFF)
+    syncs++;
+}
+
+void WallClock::rebase(OsTime const &time) {
+  OsDeltaTime delta = time - refTime;
+  if (!synced() || delta < OsDeltaTime::from_sec(WCLK_REBASE_PERIOD))
+    return;
+  refError = error(time);
+  int64_t us = refUs + elapsed(time);
+  refSeconds += us / 1000000;
+  refUs = us % 1000000;
+  sinceSync += delta.to_ms();
+  refTime = time;
+}
+
+bool WallClock::gpsTime(OsTime const &time, uint32_t &seconds,
+                        uint16_t &ms) const {
+  if (!synced())
+    return false;
+  int64_t us = refUs + elapsed(time);
+  int32_t sec = us / 1000000;
+  int32_t rem = us % 1000000;
+  if (rem < 0) {
+    // before the reference
+    rem += 1000000;
+    sec--;
+  }
+  seconds = refSeconds + sec;
+  ms = rem / 1000;
+  return true;
+}
+
+bool WallClock::utcTime(OsTime const &time, uint32_t &seconds,
+                        uint16_t &ms) const {
+  if (!gpsTime(time, seconds, ms))
+    return false;
+  seconds += GPS_UNIX_OFFSET - GPS_LEAP_SECONDS;
+  return true;
+}
+
+uint32_t WallClock::error(OsTime const &time) const {
+  if (!synced())
+    return 0xFFFFFFFF;
+  int64_t local = ticksToUs(time - refTime);
+  local = local < 0 ? -local : local;
+  int64_t err = refError + local * driftError / 1000000;
+  return err < 0xFFFFFFFF ? err : 0xFFFFFFFF;
+}
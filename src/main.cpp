@@ -87,7 +87,9 @@ void onEvent(ev_t ev)
             PRINT_DEBUG_2("Received ack");
         if (LMIC.dataLen)
         {
-            PRINT_DEBUG_2("Received %d  bytes of payload", LMIC.dataLen);
+            Downlink dn = LMIC.readDownlink();
+            PRINT_DEBUG_2("Received %d  bytes of payload on port %d",
+                          dn.length, dn.port);
         }
         // Schedule next transmission
         sendjob.setTimedCallback(os_getTime() + TX_INTERVAL, do_send);
@@ -99,7 +101,7 @@ void onEvent(ev_t ev)
         PRINT_DEBUG_2("EV_RESET");
         break;
     case EV_RXCOMPLETE:
-        // data received in ping slot
+        // data received in ping slot or class C continuous RX
         PRINT_DEBUG_2("EV_RXCOMPLETE");
         break;
     case EV_LINK_DEAD:
@@ -108,6 +110,27 @@ void onEvent(ev_t ev)
     case EV_LINK_ALIVE:
         PRINT_DEBUG_2("EV_LINK_ALIVE");
         break;
+    case EV_LINK_CHECK:
+        PRINT_DEBUG_2("EV_LINK_CHECK margin %d dB, %d gateways",
+                      LMIC.getLinkCheck().margin,
+                      LMIC.getLinkCheck().gateways);
+        break;
+    case EV_FRAG_DONE:
+        PRINT_DEBUG_2("EV_FRAG_DONE");
+        break;
+    case EV_TXEXPIRED:
+        PRINT_DEBUG_2("EV_TXEXPIRED id %d", LMIC.getTxMessageId());
+        break;
+#if FUOTA_MAX_FRAGS > 0
+    case EV_UPDATE_READY:
+        PRINT_DEBUG_2("EV_UPDATE_READY");
+        // hand the image over to the bootloader
+        LMIC.installUpdate();
+        break;
+    case EV_UPDATE_FAILED:
+        PRINT_DEBUG_2("EV_UPDATE_FAILED");
+        break;
+#endif
     default:
         PRINT_DEBUG_2("Unknown event");
         break;
@@ -116,39 +139,37 @@ void onEvent(ev_t ev)
 
 void do_send()
 {
-    // Check if there is not a current TX/RX job running
-    if (LMIC.getOpMode() & OP_TXRXPEND)
+    const uint8_t pinCmd = 6;
+    pinMode(pinCmd, OUTPUT);
+    digitalWrite(pinCmd, 1);
+    delay(100);
+    // battery
+    data[0] = analogRead(A2);
+
+    if (data[0] > (int)(4.1 * 1024 / 6.6))
     {
-        PRINT_DEBUG_1("OP_TXRXPEND, not sending");
-        // should not happen so reschedule anymway
-        sendjob.setTimedCallback(os_getTime() + TX_INTERVAL, do_send);
+        // use battery...
+        nosleep = true;
     }
     else
     {
-        const uint8_t pinCmd = 6;
-        pinMode(pinCmd, OUTPUT);
-        digitalWrite(pinCmd, 1);
-        delay(100);
-        // battery
-        data[0] = analogRead(A2);
-
-        if (data[0] > (int)(4.1 * 1024 / 6.6))
-        {
-            // use battery...
-            nosleep = true;
-        }
-        else
-        {
-            nosleep = false;
-        }
+        nosleep = false;
+    }
 
-        // humidity
-        data[1] = analogRead(A1);
-        if (!nosleep)
-            digitalWrite(pinCmd, 0);
+    // humidity
+    data[1] = analogRead(A1);
+    if (!nosleep)
+        digitalWrite(pinCmd, 0);
 
-        // Prepare upstream data transmission at the next possible time.
-        LMIC.setTxData2(1, (uint8_t *)data, 4, false);
+    // Queue upstream data transmission, sent at the next possible time.
+    if (LMIC.queueTxData(1, (uint8_t *)data, 4, false) < 0)
+    {
+        PRINT_DEBUG_1("Uplink queue full, not sending");
+        // should not happen so reschedule anymway
+        sendjob.setTimedCallback(os_getTime() + TX_INTERVAL, do_send);
+    }
+    else
+    {
         PRINT_DEBUG_1("Packet queued");
     }
     // Next TX is scheduled after TX_COMPLETE event.
@@ -197,7 +218,8 @@ void setup()
     LMIC.setDevEuiCallback(getDevEui);
     LMIC.setArtEuiCallback(getArtEui);
 
-    // set clock error to allow good connection.
+    // clock error to allow good connection until the RX timing is learned
+    // from the first downlinks.
     LMIC.setClockError(MAX_CLOCK_ERROR * 5 / 100);
 
     // for(int i = 1; i <= 8; i++) LMIC_disableChannel(i);
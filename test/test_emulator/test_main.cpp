@@ -0,0 +1,234 @@
+/*
+ * Regression test of the MAC against the SX126x emulator (see
+ * hal/hal_linux.cpp): OTAA join, then uplinks answered in RX1 and in RX2.
+ * Run on the host with: pio test -e native
+ */
+#include <string.h>
+#include <unity.h>
+
+#include <aes/aes.h>
+#include <hal/hal.h>
+#include <hal/sx126x_emu.h>
+#include <lmic.h>
+#include <lmic/bufferpack.h>
+
+const lmic_pinmap lmic_pins = {};
+
+static const uint8_t APPEUI[8] = {0x01, 0x00, 0x00, 0x00,
+                                  0x00, 0xD5, 0xB3, 0x70};
+static const uint8_t DEVEUI[8] = {0x02, 0x00, 0x00, 0x00,
+                                  0x00, 0x00, 0x00, 0x00};
+static uint8_t APPKEY[16] = {0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE,
+                             0xD2, 0xA6, 0xAB, 0xF7, 0x15, 0x88,
+                             0x09, 0xCF, 0x4F, 0x3C};
+static const uint32_t DEVADDR = 0x26011234;
+// JoinAccept of AppNonce 010203, NetID 000013, DevAddr 26011234, RX2 on
+// DR3 and RX1 after 1s, encrypted with APPKEY as the network server does
+static const uint8_t JOIN_ACCEPT[LEN_JA] = {
+    0x20, 0xC0, 0x8B, 0xC3, 0x07, 0xE1, 0xAD, 0x6C, 0x1B,
+    0x77, 0x27, 0x22, 0x7E, 0x9F, 0x7B, 0x3F, 0xEE};
+static const uint8_t APPNONCE_NETID[6] = {0x01, 0x02, 0x03, 0x13, 0x00, 0x00};
+
+// the network server side
+static Aes server;
+static uint32_t seqnoDn = 0;
+
+static uint8_t joined = 0;
+static uint8_t txComplete = 0;
+// uplinks of the emulator already checked
+static uint16_t uplinksSeen = 0;
+
+static void getArtEui(uint8_t *buf) { memcpy(buf, APPEUI, 8); }
+static void getDevEui(uint8_t *buf) { memcpy(buf, DEVEUI, 8); }
+
+void onEvent(ev_t ev) {
+  if (ev == EV_JOINED)
+    joined++;
+  if (ev == EV_TXCOMPLETE)
+    txComplete++;
+}
+
+static void runFor(OsDeltaTime const &time) {
+  hal_sim_run(hal_ticks() + time);
+}
+
+// run until the next uplink not checked yet is over, false if none within
+// limit
+static bool waitUplink(OsDeltaTime const &limit) {
+  OsTime end = hal_ticks() + limit;
+  while (sx126xEmulator.uplinkCount() == uplinksSeen) {
+    if (hal_ticks() - end > 0)
+      return false;
+    runFor(OsDeltaTime::from_ms(10));
+  }
+  uplinksSeen++;
+  return true;
+}
+
+// run until count goes above before, false if it did not within limit
+static bool waitEvent(uint8_t const &count, uint8_t before,
+                      OsDeltaTime const &limit) {
+  OsTime end = hal_ticks() + limit;
+  while (count == before) {
+    if (hal_ticks() - end > 0)
+      return false;
+    runFor(OsDeltaTime::from_ms(10));
+  }
+  return true;
+}
+
+static void queueDownlink(OsTime const &start, uint32_t freq, rps_t rps,
+                          const uint8_t *pdu, uint8_t len) {
+  Sx126xEmulator::Frame f = {};
+  memcpy(f.data, pdu, len);
+  f.length = len;
+  f.start = start;
+  f.freq = freq;
+  f.rps = rps;
+  f.rps.nocrc = 1;
+  f.invertIQ = true;
+  f.rssi = -80;
+  f.snr = 20;
+  TEST_ASSERT_TRUE(sx126xEmulator.queueDownlink(f));
+}
+
+// unconfirmed data down of text on port, answering the last uplink after
+// delay on the channel and DR given
+static void answer(OsDeltaTime const &delay, uint32_t freq, rps_t rps,
+                   uint8_t port, const char *text) {
+  uint8_t pdu[32];
+  uint8_t len = strlen(text);
+  pdu[0] = HDR_FTYPE_DADN | HDR_MAJOR_V1;
+  wlsbf4(pdu + 1, DEVADDR);
+  pdu[5] = 0;
+  wlsbf2(pdu + 6, seqnoDn);
+  pdu[8] = port;
+  memcpy(pdu + 9, text, len);
+  server.framePayloadEncryption(port, DEVADDR, seqnoDn, 1, pdu + 9, len);
+  server.appendMic(DEVADDR, seqnoDn, 1, pdu, 9 + len + 4);
+  seqnoDn++;
+  queueDownlink(sx126xEmulator.lastUplinkEnd() + delay, freq, rps, pdu,
+                9 + len + 4);
+}
+
+// check the last uplink is data up of text on port
+static void checkDataUp(uint8_t port, const char *text) {
+  Sx126xEmulator::Frame const &up = sx126xEmulator.lastUplink();
+  uint8_t pdu[64];
+  memcpy(pdu, up.data, up.length);
+  TEST_ASSERT_EQUAL_HEX8(HDR_FTYPE_DAUP | HDR_MAJOR_V1, pdu[0]);
+  TEST_ASSERT_EQUAL_HEX32(DEVADDR, rlsbf4(pdu + 1));
+  uint32_t seqno = rlsbf2(pdu + 6);
+  TEST_ASSERT_TRUE(server.verifyMic(DEVADDR, seqno, 0, pdu, up.length));
+  uint8_t fopts = pdu[5] & 0x0F;
+  uint8_t len = up.length - 8 - fopts - 1 - 4;
+  TEST_ASSERT_EQUAL(port, pdu[8 + fopts]);
+  TEST_ASSERT_EQUAL(strlen(text), len);
+  server.framePayloadEncryption(port, DEVADDR, seqno, 0, pdu + 9 + fopts,
+                                len);
+  TEST_ASSERT_EQUAL_MEMORY(text, pdu + 9 + fopts, len);
+}
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+void test_join(void) {
+  os_init();
+  LMIC.reset();
+  LMIC.aes.setDevKey(APPKEY);
+  LMIC.setEventCallBack(onEvent);
+  LMIC.setDevEuiCallback(getDevEui);
+  LMIC.setArtEuiCallback(getArtEui);
+  server.setDevKey(APPKEY);
+
+  // the first uplink starts the join
+  TEST_ASSERT_TRUE(
+      LMIC.queueTxData(1, (const uint8_t *)"one", 3, false) >= 0);
+  TEST_ASSERT_TRUE(waitUplink(OsDeltaTime::from_sec(10)));
+  Sx126xEmulator::Frame const &jr = sx126xEmulator.lastUplink();
+  uint8_t pdu[LEN_JR];
+  TEST_ASSERT_EQUAL(LEN_JR, jr.length);
+  memcpy(pdu, jr.data, LEN_JR);
+  TEST_ASSERT_EQUAL_HEX8(HDR_FTYPE_JREQ | HDR_MAJOR_V1, pdu[OFF_JR_HDR]);
+  TEST_ASSERT_EQUAL_MEMORY(APPEUI, pdu + OFF_JR_ARTEUI, 8);
+  TEST_ASSERT_EQUAL_MEMORY(DEVEUI, pdu + OFF_JR_DEVEUI, 8);
+  TEST_ASSERT_TRUE(server.verifyMic0(pdu, LEN_JR));
+
+  queueDownlink(sx126xEmulator.lastUplinkEnd() +
+                    OsDeltaTime::from_sec(DELAY_JACC1),
+                jr.freq, jr.rps, JOIN_ACCEPT, LEN_JA);
+  TEST_ASSERT_TRUE(
+      waitEvent(joined, 0, OsDeltaTime::from_sec(DELAY_JACC1 + 1)));
+
+  // the keys of the session, as the device derives them
+  server.sessKeys(rlsbf2(pdu + OFF_JR_DEVNONCE), APPNONCE_NETID);
+  TEST_ASSERT_EQUAL(0, sx126xEmulator.protocolErrors());
+}
+
+void test_downlink_rx1(void) {
+  uint8_t done = txComplete;
+  // the data waiting during the join
+  TEST_ASSERT_TRUE(waitUplink(OsDeltaTime::from_sec(60)));
+  checkDataUp(1, "one");
+  Sx126xEmulator::Frame const &up = sx126xEmulator.lastUplink();
+  answer(OsDeltaTime::from_sec(DELAY_DNW1), up.freq, up.rps, 2, "rx1");
+  TEST_ASSERT_TRUE(waitEvent(txComplete, done, OsDeltaTime::from_sec(5)));
+
+  TEST_ASSERT_BITS_HIGH(TXRX_DNW1 | TXRX_PORT, LMIC.txrxFlags);
+  Downlink dn = LMIC.readDownlink();
+  TEST_ASSERT_EQUAL(2, dn.port);
+  TEST_ASSERT_EQUAL(3, dn.length);
+  TEST_ASSERT_EQUAL_MEMORY("rx1", dn.data, 3);
+}
+
+void test_downlink_rx2(void) {
+  uint8_t done = txComplete;
+  TEST_ASSERT_TRUE(
+      LMIC.queueTxData(1, (const uint8_t *)"two", 3, false) >= 0);
+  TEST_ASSERT_TRUE(waitUplink(OsDeltaTime::from_sec(60)));
+  checkDataUp(1, "two");
+  // RX2 of the JoinAccept: 869.525MHz DR3
+  answer(OsDeltaTime::from_sec(DELAY_DNW2), FREQ_DNW2, dndr2rps(DR_SF9), 3,
+         "rx2");
+  TEST_ASSERT_TRUE(waitEvent(txComplete, done, OsDeltaTime::from_sec(5)));
+
+  TEST_ASSERT_BITS_HIGH(TXRX_DNW2 | TXRX_PORT, LMIC.txrxFlags);
+  Downlink dn = LMIC.readDownlink();
+  TEST_ASSERT_EQUAL(3, dn.port);
+  TEST_ASSERT_EQUAL(3, dn.length);
+  TEST_ASSERT_EQUAL_MEMORY("rx2", dn.data, 3);
+}
+
+void test_no_downlink(void) {
+  uint8_t done = txComplete;
+  TEST_ASSERT_TRUE(
+      LMIC.queueTxData(1, (const uint8_t *)"three", 5, false) >= 0);
+  TEST_ASSERT_TRUE(waitUplink(OsDeltaTime::from_sec(60)));
+  checkDataUp(1, "three");
+  TEST_ASSERT_TRUE(waitEvent(txComplete, done, OsDeltaTime::from_sec(5)));
+  TEST_ASSERT_BITS_LOW(TXRX_DNW1 | TXRX_DNW2, LMIC.txrxFlags);
+  TEST_ASSERT_EQUAL(0, LMIC.dataLen);
+  TEST_ASSERT_EQUAL(0, sx126xEmulator.protocolErrors());
+}
+
+void test_rssi(void) {
+  // the idle radio sleeps, there is nothing to measure
+  TEST_ASSERT_EQUAL(0, LMIC.radio.rssi());
+  // the noise floor of the emulator while listening
+  LMIC.radio.rxon(FREQ_DNW2, dndr2rps(DR_SF9), 8, os_getTime());
+  runFor(OsDeltaTime::from_ms(10));
+  TEST_ASSERT_EQUAL(157 - 120, LMIC.radio.rssi());
+  LMIC.radio.sleep();
+  TEST_ASSERT_EQUAL(0, sx126xEmulator.protocolErrors());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_join);
+  RUN_TEST(test_downlink_rx1);
+  RUN_TEST(test_downlink_rx2);
+  RUN_TEST(test_no_downlink);
+  RUN_TEST(test_rssi);
+  return UNITY_END();
+}
@@ -0,0 +1,346 @@
+/*
+ * Test of the MAC driven through the mock radio (RadioMock in
+ * lmic/radio.h): the timing of the RX windows and the retry of confirmed
+ * uplinks. The test ends the radio operations itself.
+ * Run on the host with: pio test -e native_mock
+ */
+#include <string.h>
+#include <unity.h>
+
+#include <aes/aes.h>
+#include <hal/hal.h>
+#include <hal/sx126x_emu.h>
+#include <lmic.h>
+#include <lmic/bufferpack.h>
+
+const lmic_pinmap lmic_pins = {};
+
+static const uint32_t DEVADDR = 0x26011234;
+static uint8_t NWKSKEY[16] = {1, 2,  3,  4,  5,  6,  7,  8,
+                              9, 10, 11, 12, 13, 14, 15, 16};
+static uint8_t APPSKEY[16] = {16, 15, 14, 13, 12, 11, 10, 9,
+                              8,  7,  6,  5,  4,  3,  2,  1};
+// preamble of the downlinks, the RX windows are centred on it
+static const uint8_t PREAMBLE_SYMS = 8;
+
+// the network server side
+static Aes server;
+static uint32_t seqnoDn = 0;
+
+static uint8_t txComplete = 0;
+static uint8_t txExpired = 0;
+// ids of the EV_TXEXPIRED, the first ones
+static uint8_t expiredIds[4];
+static uint8_t rxComplete = 0;
+static Downlink received;
+
+void onEvent(ev_t ev) {
+  if (ev == EV_TXCOMPLETE)
+    txComplete++;
+  if (ev == EV_TXEXPIRED && txExpired < sizeof(expiredIds))
+    expiredIds[txExpired++] = LMIC.getTxMessageId();
+  if (ev == EV_RXCOMPLETE) {
+    rxComplete++;
+    received = LMIC.readDownlink();
+  }
+}
+
+// half a LoRa symbol at 125kHz
+static OsDeltaTime halfSymbol(sf_t sf) {
+  return OsDeltaTime::from_us((int32_t)4 << (sf - SF7 + 7));
+}
+
+// run until the radio is asked for op, false if not within limit
+static bool waitOperation(RadioMock::Op op, OsDeltaTime const &limit) {
+  OsTime end = hal_ticks() + limit;
+  while (LMIC.radio.operation() != op) {
+    if (hal_ticks() - end > 0)
+      return false;
+    hal_sim_run(hal_ticks() + OsDeltaTime::from_ms(1));
+  }
+  return true;
+}
+
+// the frame on air for airtime, returns its end
+static OsTime sendUplink(OsDeltaTime const &airtime) {
+  hal_sim_run(hal_ticks() + airtime);
+  OsTime end = hal_ticks();
+  LMIC.radio.completeTx(end);
+  return end;
+}
+
+// check the RX window asked is centred on the preamble of a downlink
+// starting delay after end, on freq and sf
+static void checkWindow(OsTime const &end, OsDeltaTime const &delay,
+                        uint32_t freq, sf_t sf) {
+  TEST_ASSERT_TRUE(waitOperation(RadioMock::OP_RX, delay));
+  TEST_ASSERT_EQUAL_UINT32(freq, LMIC.radio.freq());
+  TEST_ASSERT_EQUAL(sf, LMIC.radio.rps().sf);
+  OsDeltaTime hsym = halfSymbol(sf);
+  OsDeltaTime center =
+      (LMIC.radio.rxStart() - end) + LMIC.radio.rxSymbols() * hsym;
+  TEST_ASSERT_EQUAL_INT32((delay + PREAMBLE_SYMS * hsym).tick(),
+                          center.tick());
+  // the radio is set up before the window
+  TEST_ASSERT_TRUE(hal_ticks() - LMIC.radio.rxStart() <= 0);
+}
+
+// nothing received until the end of the window
+static void timeoutWindow() {
+  hal_sim_run(LMIC.radio.rxStart() +
+              2 * LMIC.radio.rxSymbols() * halfSymbol(LMIC.radio.rps().sf));
+  LMIC.radio.timeoutRx();
+  hal_sim_run(hal_ticks() + OsDeltaTime::from_ms(1));
+}
+
+// downlink of the MAC commands fopts received in the RX window opened
+static void receiveWindow(uint8_t fctrl, const uint8_t *fopts, uint8_t olen) {
+  uint8_t pdu[32];
+  pdu[0] = HDR_FTYPE_DADN | HDR_MAJOR_V1;
+  wlsbf4(pdu + 1, DEVADDR);
+  pdu[OFF_DAT_FCT] = fctrl | olen;
+  wlsbf2(pdu + OFF_DAT_SEQNO, seqnoDn);
+  if (olen)
+    memcpy(pdu + OFF_DAT_OPTS, fopts, olen);
+  uint8_t len = OFF_DAT_OPTS + olen + 4;
+  server.appendMic(DEVADDR, seqnoDn, 1, pdu, len);
+  seqnoDn++;
+  hal_sim_run(LMIC.radio.rxStart() + OsDeltaTime::from_ms(30));
+  LMIC.radio.completeRx(hal_ticks(), pdu, len, -80, 20);
+  hal_sim_run(hal_ticks() + OsDeltaTime::from_ms(1));
+}
+
+// acknowledgement received in the RX window opened
+static void ackWindow() { receiveWindow(FCT_ACK, nullptr, 0); }
+
+void setUp(void) {
+  os_init();
+  LMIC.reset();
+  LMIC.setEventCallBack(onEvent);
+  LMIC.setSession(0x13, DEVADDR, NWKSKEY, APPSKEY);
+  LMIC.setDrTxpow(DR_SF7, 14);
+  server.setNetworkSessionKey(NWKSKEY);
+  server.setApplicationSessionKey(APPSKEY);
+  seqnoDn = 0;
+  txComplete = 0;
+  txExpired = 0;
+  rxComplete = 0;
+}
+
+void tearDown(void) {}
+
+void test_rx_windows(void) {
+  TEST_ASSERT_TRUE(
+      LMIC.queueTxData(1, (const uint8_t *)"one", 3, false) >= 0);
+  TEST_ASSERT_TRUE(waitOperation(RadioMock::OP_TX, OsDeltaTime::from_sec(1)));
+  uint32_t freq = LMIC.radio.freq();
+  TEST_ASSERT_EQUAL(SF7, LMIC.radio.rps().sf);
+  OsTime end = sendUplink(OsDeltaTime::from_ms(50));
+
+  // RX1 on the channel and DR of the uplink, RX2 on its own parameters
+  checkWindow(end, OsDeltaTime::from_sec(DELAY_DNW1), freq, SF7);
+  timeoutWindow();
+  checkWindow(end, OsDeltaTime::from_sec(DELAY_DNW2), FREQ_DNW2, SF12);
+  TEST_ASSERT_EQUAL(0, txComplete);
+  timeoutWindow();
+
+  TEST_ASSERT_EQUAL(1, txComplete);
+  TEST_ASSERT_BITS_LOW(TXRX_DNW1 | TXRX_DNW2, LMIC.txrxFlags);
+}
+
+void test_retry_without_ack(void) {
+  TEST_ASSERT_TRUE(LMIC.queueTxData(1, (const uint8_t *)"one", 3, true) >= 0);
+  TEST_ASSERT_TRUE(waitOperation(RadioMock::OP_TX, OsDeltaTime::from_sec(1)));
+  uint8_t first[32];
+  uint8_t length = LMIC.radio.txLength();
+  memcpy(first, LMIC.radio.txFrame(), length);
+  TEST_ASSERT_EQUAL_HEX8(HDR_FTYPE_DCUP | HDR_MAJOR_V1, first[0]);
+  OsTime end = sendUplink(OsDeltaTime::from_ms(50));
+  checkWindow(end, OsDeltaTime::from_sec(DELAY_DNW1), LMIC.radio.freq(),
+              SF7);
+  timeoutWindow();
+  TEST_ASSERT_TRUE(waitOperation(RadioMock::OP_RX, OsDeltaTime::from_sec(2)));
+  timeoutWindow();
+  TEST_ASSERT_EQUAL(0, txComplete);
+
+  // the same frame again, after the random delay of the retry policy
+  TEST_ASSERT_TRUE(waitOperation(
+      RadioMock::OP_TX, OsDeltaTime::from_sec(RETRY_PERIOD_secs + 1)));
+  TEST_ASSERT_EQUAL(length, LMIC.radio.txLength());
+  TEST_ASSERT_EQUAL(rlsbf2(first + OFF_DAT_SEQNO),
+                    rlsbf2(LMIC.radio.txFrame() + OFF_DAT_SEQNO));
+  end = sendUplink(OsDeltaTime::from_ms(50));
+  checkWindow(end, OsDeltaTime::from_sec(DELAY_DNW1), LMIC.radio.freq(),
+              LMIC.radio.rps().sf);
+  ackWindow();
+
+  TEST_ASSERT_EQUAL(1, txComplete);
+  TEST_ASSERT_BITS_HIGH(TXRX_ACK | TXRX_DNW1, LMIC.txrxFlags);
+}
+
+void test_retries_exhausted(void) {
+  RetryPolicy policy = {2, 1, 0, 0, false, 0};
+  LMIC.setRetryPolicy(policy);
+  TEST_ASSERT_TRUE(LMIC.queueTxData(1, (const uint8_t *)"one", 3, true) >= 0);
+  for (uint8_t attempt = 0; attempt < 2; attempt++) {
+    TEST_ASSERT_TRUE(
+        waitOperation(RadioMock::OP_TX, OsDeltaTime::from_sec(3)));
+    sendUplink(OsDeltaTime::from_ms(50));
+    TEST_ASSERT_TRUE(
+        waitOperation(RadioMock::OP_RX, OsDeltaTime::from_sec(2)));
+    timeoutWindow();
+    TEST_ASSERT_TRUE(
+        waitOperation(RadioMock::OP_RX, OsDeltaTime::from_sec(2)));
+    timeoutWindow();
+  }
+
+  TEST_ASSERT_EQUAL(1, txComplete);
+  TEST_ASSERT_BITS_HIGH(TXRX_NACK, LMIC.txrxFlags);
+  // no third attempt
+  TEST_ASSERT_FALSE(waitOperation(RadioMock::OP_TX, OsDeltaTime::from_sec(5)));
+}
+
+void test_answer_each_command(void) {
+  TEST_ASSERT_TRUE(
+      LMIC.queueTxData(1, (const uint8_t *)"one", 3, false) >= 0);
+  TEST_ASSERT_TRUE(waitOperation(RadioMock::OP_TX, OsDeltaTime::from_sec(1)));
+  sendUplink(OsDeltaTime::from_ms(50));
+  TEST_ASSERT_TRUE(waitOperation(RadioMock::OP_RX, OsDeltaTime::from_sec(2)));
+  // NewChannelReq of 867.1MHz, then one out of the band
+  const uint8_t fopts[] = {MCMD_SNCH_REQ, 3,    0x18, 0x4F, 0x84, 0x50,
+                           MCMD_SNCH_REQ, 4,    0x40, 0x42, 0x0F, 0x50};
+  receiveWindow(0, fopts, sizeof(fopts));
+  TEST_ASSERT_EQUAL(1, txComplete);
+
+  // one answer per command, with its own status
+  TEST_ASSERT_TRUE(
+      LMIC.queueTxData(1, (const uint8_t *)"two", 3, false) >= 0);
+  TEST_ASSERT_TRUE(
+      waitOperation(RadioMock::OP_TX, OsDeltaTime::from_sec(10)));
+  const uint8_t *up = LMIC.radio.txFrame();
+  const uint8_t answers[] = {
+      MCMD_SNCH_REQ, MCMD_SNCH_ANS_DRACK | MCMD_SNCH_ANS_FQACK,
+      MCMD_SNCH_REQ, 0};
+  TEST_ASSERT_EQUAL(sizeof(answers), up[OFF_DAT_FCT] & FCT_OPTLEN);
+  TEST_ASSERT_EQUAL_MEMORY(answers, up + OFF_DAT_OPTS, sizeof(answers));
+}
+
+void test_queue_deadline(void) {
+  TEST_ASSERT_TRUE(
+      LMIC.queueTxData(1, (const uint8_t *)"one", 3, false) >= 0);
+  // taken after the first one, before its deadline, but the duty cycle
+  // holds it past the deadline
+  int8_t late = LMIC.queueTxData(1, (const uint8_t *)"two", 3, false, 0,
+                                 OsDeltaTime::from_sec(3));
+  TEST_ASSERT_TRUE(late >= 0);
+  TEST_ASSERT_TRUE(waitOperation(RadioMock::OP_TX, OsDeltaTime::from_sec(1)));
+  // the queued message being sent is not replaced
+  TEST_ASSERT_EQUAL(-1,
+                    LMIC.setTxData2(1, (const uint8_t *)"new", 3, false));
+  sendUplink(OsDeltaTime::from_ms(50));
+  TEST_ASSERT_TRUE(waitOperation(RadioMock::OP_RX, OsDeltaTime::from_sec(2)));
+  timeoutWindow();
+  TEST_ASSERT_TRUE(waitOperation(RadioMock::OP_RX, OsDeltaTime::from_sec(2)));
+  timeoutWindow();
+  TEST_ASSERT_EQUAL(1, txComplete);
+
+  TEST_ASSERT_FALSE(
+      waitOperation(RadioMock::OP_TX, OsDeltaTime::from_sec(10)));
+  TEST_ASSERT_EQUAL(1, txExpired);
+  TEST_ASSERT_EQUAL(late, LMIC.getTxMessageId());
+  TEST_ASSERT_EQUAL(1, LMIC.getTxQueue().expiredCount());
+}
+
+void test_queue_deadlines_reported(void) {
+  uint16_t expired = LMIC.getTxQueue().expiredCount();
+  TEST_ASSERT_TRUE(
+      LMIC.queueTxData(1, (const uint8_t *)"one", 3, false) >= 0);
+  // the first is taken after the uplink of one and expires waiting for the
+  // duty cycle, the second expires in the queue meanwhile
+  int8_t late1 = LMIC.queueTxData(1, (const uint8_t *)"two", 3, false, 0,
+                                  OsDeltaTime::from_sec(3));
+  int8_t late2 = LMIC.queueTxData(1, (const uint8_t *)"three", 5, false, 0,
+                                  OsDeltaTime::from_sec(3));
+  TEST_ASSERT_TRUE(late1 >= 0 && late2 >= 0);
+  TEST_ASSERT_TRUE(waitOperation(RadioMock::OP_TX, OsDeltaTime::from_sec(1)));
+  sendUplink(OsDeltaTime::from_ms(50));
+  TEST_ASSERT_TRUE(waitOperation(RadioMock::OP_RX, OsDeltaTime::from_sec(2)));
+  timeoutWindow();
+  TEST_ASSERT_TRUE(waitOperation(RadioMock::OP_RX, OsDeltaTime::from_sec(2)));
+  timeoutWindow();
+  TEST_ASSERT_EQUAL(1, txComplete);
+
+  // each one is reported with its id, its buffer is free then
+  TEST_ASSERT_FALSE(
+      waitOperation(RadioMock::OP_TX, OsDeltaTime::from_sec(10)));
+  TEST_ASSERT_EQUAL(2, txExpired);
+  TEST_ASSERT_EQUAL(late1, expiredIds[0]);
+  TEST_ASSERT_EQUAL(late2, expiredIds[1]);
+  TEST_ASSERT_EQUAL(expired + 2, LMIC.getTxQueue().expiredCount());
+  TEST_ASSERT_EQUAL(0, LMIC.getTxQueue().depth());
+}
+
+#if MC_GROUP_COUNT > 0
+static const uint32_t MCADDR = 0x01ABCDEF;
+static uint8_t MCKEY[16] = {7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7};
+
+void test_multicast_in_window(void) {
+  TEST_ASSERT_TRUE(LMIC.setMcGroup(0, MCADDR, MCKEY, MCKEY, 0, DR_SF12));
+  TEST_ASSERT_TRUE(LMIC.queueTxData(1, (const uint8_t *)"one", 3, true) >= 0);
+  TEST_ASSERT_TRUE(waitOperation(RadioMock::OP_TX, OsDeltaTime::from_sec(1)));
+  uint32_t seqno = rlsbf2(LMIC.radio.txFrame() + OFF_DAT_SEQNO);
+  sendUplink(OsDeltaTime::from_ms(50));
+  TEST_ASSERT_TRUE(waitOperation(RadioMock::OP_RX, OsDeltaTime::from_sec(2)));
+
+  // a frame of the group in RX1, not the ack of the uplink
+  Aes group;
+  group.setNetworkSessionKey(MCKEY);
+  group.setApplicationSessionKey(MCKEY);
+  uint8_t pdu[16];
+  pdu[0] = HDR_FTYPE_DADN | HDR_MAJOR_V1;
+  wlsbf4(pdu + 1, MCADDR);
+  pdu[OFF_DAT_FCT] = 0;
+  wlsbf2(pdu + OFF_DAT_SEQNO, 0);
+  pdu[OFF_DAT_OPTS] = 5;
+  memcpy(pdu + OFF_DAT_OPTS + 1, "mc", 2);
+  group.framePayloadEncryption(5, MCADDR, 0, 1, pdu + OFF_DAT_OPTS + 1, 2);
+  group.appendMic(MCADDR, 0, 1, pdu, OFF_DAT_OPTS + 3 + 4);
+  hal_sim_run(LMIC.radio.rxStart() + OsDeltaTime::from_ms(30));
+  LMIC.radio.completeRx(hal_ticks(), pdu, OFF_DAT_OPTS + 3 + 4, -80, 20);
+  hal_sim_run(hal_ticks() + OsDeltaTime::from_ms(1));
+  TEST_ASSERT_EQUAL(1, rxComplete);
+  TEST_ASSERT_EQUAL(0, received.group);
+  TEST_ASSERT_EQUAL(5, received.port);
+  TEST_ASSERT_EQUAL(2, received.length);
+  TEST_ASSERT_EQUAL_MEMORY("mc", received.data, 2);
+
+  // RX2 is still opened, then the uplink is sent again
+  TEST_ASSERT_TRUE(waitOperation(RadioMock::OP_RX, OsDeltaTime::from_sec(2)));
+  TEST_ASSERT_EQUAL_UINT32(FREQ_DNW2, LMIC.radio.freq());
+  timeoutWindow();
+  TEST_ASSERT_EQUAL(0, txComplete);
+  TEST_ASSERT_TRUE(waitOperation(
+      RadioMock::OP_TX, OsDeltaTime::from_sec(RETRY_PERIOD_secs + 1)));
+  TEST_ASSERT_EQUAL(seqno, rlsbf2(LMIC.radio.txFrame() + OFF_DAT_SEQNO));
+  sendUplink(OsDeltaTime::from_ms(50));
+  TEST_ASSERT_TRUE(waitOperation(RadioMock::OP_RX, OsDeltaTime::from_sec(2)));
+  ackWindow();
+  TEST_ASSERT_EQUAL(1, txComplete);
+  TEST_ASSERT_BITS_HIGH(TXRX_ACK, LMIC.txrxFlags);
+  LMIC.clearMcGroup(0);
+}
+#endif
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_rx_windows);
+  RUN_TEST(test_retry_without_ack);
+  RUN_TEST(test_retries_exhausted);
+  RUN_TEST(test_answer_each_command);
+  RUN_TEST(test_queue_deadline);
+  RUN_TEST(test_queue_deadlines_reported);
+#if MC_GROUP_COUNT > 0
+  RUN_TEST(test_multicast_in_window);
+#endif
+  return UNITY_END();
+}